@@ -49,10 +49,12 @@ struct lpage;
 /* MMU control */
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
+void mmu_unmap_page(paddr_t pa);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
+paddr_t coremap_allocspare(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
 
 /* physical page pinning */
@@ -84,6 +86,7 @@ void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
  * Coremap functions whose existence is machine-dependent.
  */
 void coremap_bootstrap(void);
+void coremap_pageout_bootstrap(void);
 void coremap_print_short(void);
 void coremap_print_long(void);
 
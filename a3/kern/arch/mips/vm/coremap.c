@@ -85,7 +85,8 @@ struct coremap_entry {
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_referenced:1;/* true if used since the clock hand passed */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
 };
@@ -108,6 +109,17 @@ static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
  */
 static struct wchan *coremap_pinchan;
 static struct wchan *coremap_shootchan;
+static struct wchan *coremap_pageoutchan;
+
+/*
+ * Evictions are done by faulting threads when memory is short as well
+ * as by the pageout thread, and any number of pages may be in transit
+ * at once. To keep a memory crunch from turning every thread into a
+ * pager, only CM_MAX_PAGEOUTS evictors run at once; each holds a slot
+ * (a count of coremap_pageoutsem) while it chooses and evicts pages.
+ */
+#define CM_MAX_PAGEOUTS	4
+static struct semaphore *coremap_pageoutsem;
 
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
@@ -120,6 +132,21 @@ static volatile uint32_t ct_shootdowns_sent;
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
 
+/*
+ * The pageout thread wakes when fewer than pageout_lowater pages are
+ * free, and evicts pages until pageout_hiwater are.
+ */
+static uint32_t pageout_lowater;
+static uint32_t pageout_hiwater;
+static volatile uint32_t ct_pageout_evictions;
+static volatile uint32_t ct_direct_evictions;
+
+#if !OPT_RANDPAGE
+static uint32_t clock_hand;		/* next coremap entry to look at */
+static volatile uint32_t ct_clock_scanned;
+static volatile uint32_t ct_clock_dirtytaken;
+#endif
+
 ////////////////////////////////////////////////////////////
 //
 // Per-CPU data
@@ -146,16 +173,32 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sd, si, pe, de;
+#if !OPT_RANDPAGE
+	uint32_t cs, cd;
+#endif
 
 	spinlock_acquire(&coremap_spinlock);
 	ss = ct_shootdowns_sent;
 	sd = ct_shootdowns_done;
 	si = ct_shootdown_interrupts;
+	pe = ct_pageout_evictions;
+	de = ct_direct_evictions;
+#if !OPT_RANDPAGE
+	cs = ct_clock_scanned;
+	cd = ct_clock_dirtytaken;
+#endif
 	spinlock_release(&coremap_spinlock);
 
 	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
 		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: %lu pages evicted by the pageout thread, "
+		"%lu while faulting\n",
+		(unsigned long) pe, (unsigned long) de);
+#if !OPT_RANDPAGE
+	kprintf("vm: clock: %lu pages scanned, %lu dirty victims\n",
+		(unsigned long) cs, (unsigned long) cd);
+#endif
 }
 
 ////////////////////////////////////////////////////////////
@@ -287,6 +330,57 @@ tlb_shootwait(void)
 	spinlock_acquire(&coremap_spinlock);
 }
 
+/*
+ * coremap_pinwait: wait for a pinned page to unpin.
+ */
+static
+void
+coremap_pinwait(void)
+{
+	wchan_lock(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+	wchan_sleep(coremap_pinchan);
+	spinlock_acquire(&coremap_spinlock);
+}
+
+/*
+ * tlb_shootpage: make sure no TLB on any CPU still maps the page at
+ * coremap index WHERE, shooting down a remote mapping if necessary.
+ * The page must be pinned, so nobody can map it again meanwhile.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May block.
+ */
+static
+void
+tlb_shootpage(unsigned where)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
+
+	if (coremap[where].cm_tlbix < 0) {
+		return;
+	}
+
+	if (coremap[where].cm_cpunum != curcpu->c_number) {
+		/* yay, TLB shootdown */
+		struct tlbshootdown ts;
+		ts.ts_tlbix = coremap[where].cm_tlbix;
+		ts.ts_coremapindex = where;
+		ct_shootdowns_sent++;
+		ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
+		while (coremap[where].cm_tlbix != -1) {
+			tlb_shootwait();
+		}
+	}
+	else {
+		tlb_invalidate(coremap[where].cm_tlbix);
+	}
+	KASSERT(coremap[where].cm_tlbix == -1);
+	KASSERT(coremap[where].cm_cpunum == 0);
+	DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+	      (unsigned long) COREMAP_TO_PADDR(where));
+}
+
 /*
  * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
  * it if it exists.
@@ -347,9 +441,13 @@ mipstlb_getslot(void)
  * To evict a page, it must be non-kernel and non-pinned.
  *
  * page_replace() takes no arguments and returns an index into the
- * coremap (for the selected victim page).
+ * coremap (for the selected victim page), or PAGE_REPLACE_NONE if
+ * every user page is pinned, which can happen under load while pages
+ * are in transit to or from swap.
  */
 
+#define PAGE_REPLACE_NONE	((uint32_t)-1)
+
 #if OPT_RANDPAGE
 
 /*
@@ -357,30 +455,106 @@ mipstlb_getslot(void)
  *
  * Repeatedly generates a random index into the coremap until the 
  * selected page is not pinned and does not belong to the kernel.
+ * If that fails num_coremap_entries times, scans for any such page
+ * before giving up.
  */
 static
 uint32_t 
 page_replace(void)
 {
-    // Complete this function.
-	return 0;
+	uint32_t i, where;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<num_coremap_entries; i++) {
+		where = random() % num_coremap_entries;
+		if (!coremap[where].cm_pinned && !coremap[where].cm_kernel) {
+			return where;
+		}
+	}
+	for (where=0; where<num_coremap_entries; where++) {
+		if (!coremap[where].cm_pinned && !coremap[where].cm_kernel) {
+			return where;
+		}
+	}
+	return PAGE_REPLACE_NONE;
 }
 
 #else /* not OPT_RANDPAGE */
 
 /*
- * Sequential page replacement.
+ * Clock (second-chance) page replacement.
  *
- * Selects pages to be evicted from the coremap sequentially. Skips
- * pages that are pinned or that belong to the kernel.
+ * The MIPS has no hardware referenced bit, so we keep one in the
+ * coremap: cm_referenced is set whenever a page is entered into the
+ * TLB, which is to say on every fault on it. When the hand passes a
+ * referenced page it clears the bit and knocks the page out of the
+ * TLB it is in, shooting it down if that's another CPU's, so a page
+ * still in use faults again, and is marked again, before the hand
+ * comes back round.
+ *
+ * Among the unreferenced pages, clean ones are preferred, since they
+ * can be dropped without a disk write. The hand skips dirty ones for
+ * its first trip round, and if it gets all the way round without
+ * finding a clean page it takes the first dirty one it passed.
  */
-
 static
 uint32_t
 page_replace(void)
 {
-	// Complete this function.
-	return 0;
+	uint32_t i, where, dirtyvictim;
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	dirtyvictim = num_coremap_entries;
+	for (i=0; i<3*num_coremap_entries; i++) {
+		if (i == num_coremap_entries &&
+		    dirtyvictim < num_coremap_entries) {
+			ct_clock_dirtytaken++;
+			return dirtyvictim;
+		}
+
+		where = clock_hand;
+		clock_hand = (clock_hand + 1) % num_coremap_entries;
+		ct_clock_scanned++;
+
+		if (coremap[where].cm_pinned || coremap[where].cm_kernel) {
+			continue;
+		}
+		if (!coremap[where].cm_allocated) {
+			return where;
+		}
+
+		if (coremap[where].cm_referenced) {
+			coremap[where].cm_referenced = 0;
+			if (coremap[where].cm_tlbix >= 0) {
+				/* Pin it across a possible shootdown wait */
+				coremap[where].cm_pinned = 1;
+				tlb_shootpage(where);
+				coremap[where].cm_pinned = 0;
+				wchan_wakeall(coremap_pinchan);
+			}
+			continue;
+		}
+
+		/*
+		 * Peek at the dirty bit without locking the lpage
+		 * (we can't, holding the coremap spinlock). It can
+		 * only be a hint anyway.
+		 */
+		lp = coremap[where].cm_lpage;
+		KASSERT(lp != NULL);
+		if (i < num_coremap_entries && LP_ISDIRTY(lp)) {
+			if (dirtyvictim == num_coremap_entries) {
+				dirtyvictim = where;
+			}
+			continue;
+		}
+		return where;
+	}
+
+	return PAGE_REPLACE_NONE;
 }
 
 #endif /* OPT_RANDPAGE */
@@ -473,6 +647,7 @@ coremap_bootstrap(void)
 		coremap[i].cm_kernel = 0;
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
 		coremap[i].cm_pinned = 0;
 		coremap[i].cm_tlbix = -1;
 		coremap[i].cm_cpunum = 0;
@@ -481,9 +656,16 @@ coremap_bootstrap(void)
 
 	coremap_pinchan = wchan_create("vmpin");
 	coremap_shootchan = wchan_create("tlbshoot");
-	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
+	coremap_pageoutchan = wchan_create("pageout");
+	if (coremap_pinchan == NULL || coremap_shootchan == NULL ||
+	    coremap_pageoutchan == NULL) {
 		panic("Failed allocating coremap wchans\n");
 	}
+
+	coremap_pageoutsem = sem_create("pageout", CM_MAX_PAGEOUTS);
+	if (coremap_pageoutsem == NULL) {
+		panic("Failed allocating coremap pageout semaphore\n");
+	}
 }	
 
 ////////////////////////////////////////////////////////////
@@ -506,15 +688,20 @@ piggish_kernel(int proposed_kernel_pages)
 	return 0;
 }
 
+/*
+ * Eviction is done in two halves around lpage_evict (or
+ * lpage_evict_cluster), which has to run without the coremap
+ * spinlock: evict_prepare pins the victim and gets it out of every
+ * TLB; evict_finish marks it free. The caller holds a pageout slot.
+ */
 static
-void
-do_evict(int where)
+struct lpage *
+evict_prepare(int where)
 {
 	struct lpage *lp;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_allocated);
@@ -529,39 +716,20 @@ do_evict(int where)
 	 */
 	coremap[where].cm_pinned = 1;
 
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
-			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
-		}
-		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
-		}
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
-	}
+	tlb_shootpage(where);
+	KASSERT(coremap[where].cm_lpage == lp);
 
 	/* properly we ought to lock the lpage to test this */
 	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
 
-	/* release the coremap spinlock in case we need to swap out */
-	spinlock_release(&coremap_spinlock);
-
-	lpage_evict(lp);
+	return lp;
+}
 
-	spinlock_acquire(&coremap_spinlock);
+static
+void
+evict_finish(int where, struct lpage *lp)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
 	/* because the page is pinned these shouldn't have changed */
 	KASSERT(coremap[where].cm_allocated == 1);
@@ -581,26 +749,21 @@ do_evict(int where)
 }
 
 static
-int
-do_page_replace(void)
+void
+do_evict(int where)
 {
-	int where;
+	struct lpage *lp;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(lock_do_i_hold(global_paging_lock));
+	lp = evict_prepare(where);
 
-	where = page_replace();
+	/* release the coremap spinlock in case we need to swap out */
+	spinlock_release(&coremap_spinlock);
 
-	KASSERT(coremap[where].cm_pinned==0);
-	KASSERT(coremap[where].cm_kernel==0);
+	lpage_evict(lp);
 
-	if (coremap[where].cm_allocated) {
-		KASSERT(coremap[where].cm_lpage != NULL);
-		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-		do_evict(where);
-	}
+	spinlock_acquire(&coremap_spinlock);
 
-	return where;
+	evict_finish(where, lp);
 }
 
 static
@@ -629,6 +792,9 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		if (i < start+npages-1) {
 			coremap[i].cm_notlast = 1;
 		}
+
+		/* New pages start with their second chance */
+		coremap[i].cm_referenced = 1;
 	}
 	if (iskern) {
 		num_coremap_kernel += npages;
@@ -641,6 +807,72 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 	       == num_coremap_entries);
 }
 
+/*
+ * Find a free page for a single-page allocation, or return -1.
+ *
+ * For single-page allocations, start at the top end of memory. We
+ * will do multi-page allocations at the bottom end in the hope of
+ * reducing long-term fragmentation. But it probably won't help
+ * much if the system gets busy.
+ */
+static
+int
+coremap_find_free(void)
+{
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (num_coremap_free == 0) {
+		return -1;
+	}
+	for (i = num_coremap_entries-1; i>=0; i--) {
+		if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
+			continue;
+		}
+		KASSERT(coremap[i].cm_kernel==0);
+		KASSERT(coremap[i].cm_lpage==NULL);
+		return i;
+	}
+	return -1;
+}
+
+static
+int
+do_page_replace(void)
+{
+	uint32_t where;
+	int freepage;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+
+	while ((where = page_replace()) == PAGE_REPLACE_NONE) {
+		/*
+		 * Every user page is pinned, most likely in transit
+		 * to or from swap. Each one unpins (with a wakeup on
+		 * coremap_pinchan) when its I/O is done; wait for
+		 * that, unless a page has come free meanwhile.
+		 */
+		coremap_pinwait();
+		freepage = coremap_find_free();
+		if (freepage >= 0) {
+			return freepage;
+		}
+	}
+
+	KASSERT(coremap[where].cm_pinned==0);
+	KASSERT(coremap[where].cm_kernel==0);
+
+	if (coremap[where].cm_allocated) {
+		KASSERT(coremap[where].cm_lpage != NULL);
+		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+		do_evict(where);
+	}
+
+	return where;
+}
+
 /*
  * coremap_alloc_one_page
  *
@@ -652,18 +884,13 @@ static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int candidate, i, iskern;
+	int candidate, iskern, canpage, paging;
 
 	iskern = (lp == NULL);
 
-	/*
-	 * Hold this while allocating to reduce starvation of multipage
-	 * allocations. (But we can't if we're in an interrupt, or if
-	 * we're still very early in boot.)
-	 */
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
+	/* We can't page in an interrupt, or very early in boot. */
+	canpage = curthread != NULL && !curthread->t_in_interrupt;
+	paging = 0;
 
 	spinlock_acquire(&coremap_spinlock);
 
@@ -673,44 +900,34 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	if (iskern && piggish_kernel(1)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting 1 page\n");
 		return INVALID_PADDR;
 	}
 
 	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
+	 * Normally the pageout thread has left a free page, and we
+	 * take it without waiting for anything. Only if there is none
+	 * do we get a pageout slot and look again (someone else may
+	 * have freed a page while we waited for it) before evicting.
 	 */
-
-	candidate = -1;
-
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
-
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
-			break;
+	candidate = coremap_find_free();
+	if (candidate < 0 && canpage) {
+		spinlock_release(&coremap_spinlock);
+		P(coremap_pageoutsem);
+		paging = 1;
+		spinlock_acquire(&coremap_spinlock);
+
+		candidate = coremap_find_free();
+		if (candidate < 0) {
+			/* The pageout thread hasn't kept up */
+			candidate = do_page_replace();
+			ct_direct_evictions++;
 		}
 	}
 
-	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
-		KASSERT(num_coremap_free==0);
-		candidate = do_page_replace();
-	}
-
 	if (candidate < 0) {
 		spinlock_release(&coremap_spinlock);
-		/* we don't hold global_paging_lock; don't unlock it */
+		/* we don't hold a pageout slot; don't give it back */
 		return INVALID_PADDR;
 	}
 
@@ -722,9 +939,13 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	KASSERT(coremap[candidate].cm_tlbix < 0);
 	KASSERT(coremap[candidate].cm_cpunum == 0);
 
+	if (num_coremap_free < pageout_lowater) {
+		wchan_wakeone(coremap_pageoutchan);
+	}
+
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
+	if (paging) {
+		V(coremap_pageoutsem);
 	}
 
 	return COREMAP_TO_PADDR(candidate);
@@ -742,13 +963,13 @@ coremap_alloc_multipages(unsigned npages)
 	KASSERT(npages>1);
 
 	/*
-	 * Get this early and hold it during the allocation so nobody else
-	 * can start paging while we're trying to page out the victims in
-	 * the allocation range.
+	 * Get a pageout slot early and hold it during the allocation,
+	 * in case we have to page out the victims in the allocation
+	 * range.
 	 */
 
 	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
+		P(coremap_pageoutsem);
 	}
 
 	spinlock_acquire(&coremap_spinlock);
@@ -757,7 +978,7 @@ coremap_alloc_multipages(unsigned npages)
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
 		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
+			V(coremap_pageoutsem);
 		}
 		kprintf("alloc_kpages: kernel heap full getting %u pages\n",
 			npages);
@@ -786,12 +1007,9 @@ coremap_alloc_multipages(unsigned npages)
 				KASSERT(coremap[i].cm_lpage != NULL);
 				/*
 				 * We should do badness += 2 if page
-				 * needs cleaning, but we don't know
-				 * that here for now. Also, we shouldn't
-				 * prefer clean pages when there isn't a
-				 * pageout thread, as we'll end up always
-				 * replacing code and never data, which
-				 * doesn't work well. FUTURE.
+				 * needs cleaning, but the dirty bit is
+				 * in the lpage and can't be read here
+				 * consistently.
 				 */
 				badness++;
 			}
@@ -817,18 +1035,16 @@ coremap_alloc_multipages(unsigned npages)
 			/* no good */
 			spinlock_release(&coremap_spinlock);
 			if (curthread != NULL && !curthread->t_in_interrupt) {
-				lock_release(global_paging_lock);
+				V(coremap_pageoutsem);
 			}
 			return INVALID_PADDR;
 		}
 
 		/*
 		 * If any pages need evicting, evict them and try the
-		 * whole schmear again. Because we are holding
-		 * global_paging_lock, nobody else *ought* to allocate
-		 * or pin these pages until we're done. But the
-		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
+		 * whole schmear again. Other threads page concurrently
+		 * and may allocate or pin these pages while we're
+		 * evicting one of them -- so tolerate and retry if
 		 * something changes while we're paging.
 		 */
 
@@ -859,11 +1075,122 @@ coremap_alloc_multipages(unsigned npages)
 				     
 	spinlock_release(&coremap_spinlock);
 	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
+		V(coremap_pageoutsem);
 	}
 	return COREMAP_TO_PADDR(bestbase);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Pageout thread
+//
+// So that faults on a full machine don't each have to wait for a
+// victim to be written out first, a kernel thread keeps a reserve of
+// free pages. Allocations wake it when the reserve drops below
+// pageout_lowater; it then evicts pages, choosing them the same way
+// a fault would, until pageout_hiwater are free. A fault that finds
+// the reserve empty still evicts a page itself.
+//
+// The thread evicts up to SWAP_CLUSTER victims at a time, so that
+// dirty ones that sit next to each other in swap can be written out
+// with one I/O.
+//
+
+static
+void
+pageout_thread(void *junk1, unsigned long junk2)
+{
+	uint32_t where, tries, evicted;
+	uint32_t wheres[SWAP_CLUSTER];
+	struct lpage *victims[SWAP_CLUSTER];
+	unsigned i, n;
+	bool idle = false;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		spinlock_acquire(&coremap_spinlock);
+		while (idle || num_coremap_free >= pageout_lowater) {
+			wchan_lock(coremap_pageoutchan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(coremap_pageoutchan);
+			spinlock_acquire(&coremap_spinlock);
+			idle = false;
+		}
+		spinlock_release(&coremap_spinlock);
+
+		/*
+		 * Evict a batch at a time, taking a pageout slot
+		 * afresh for each, so faults can get in between.
+		 */
+		evicted = 0;
+		tries = 0;
+		while (tries < num_coremap_entries) {
+			P(coremap_pageoutsem);
+			spinlock_acquire(&coremap_spinlock);
+			n = 0;
+			while (n < SWAP_CLUSTER &&
+			       num_coremap_free + n < pageout_hiwater &&
+			       tries < num_coremap_entries) {
+				tries++;
+				where = page_replace();
+				if (where == PAGE_REPLACE_NONE) {
+					/* Everything's pinned; try later */
+					break;
+				}
+				if (coremap[where].cm_allocated) {
+					wheres[n] = where;
+					victims[n] = evict_prepare(where);
+					n++;
+				}
+			}
+			if (n == 0) {
+				spinlock_release(&coremap_spinlock);
+				V(coremap_pageoutsem);
+				break;
+			}
+			spinlock_release(&coremap_spinlock);
+
+			lpage_evict_cluster(victims, n);
+
+			spinlock_acquire(&coremap_spinlock);
+			for (i=0; i<n; i++) {
+				evict_finish(wheres[i], victims[i]);
+			}
+			ct_pageout_evictions += n;
+			evicted += n;
+			spinlock_release(&coremap_spinlock);
+			V(coremap_pageoutsem);
+		}
+
+		/* If nothing could be evicted, wait for the next wakeup */
+		idle = (evicted == 0);
+	}
+}
+
+/*
+ * coremap_pageout_bootstrap: set the watermarks and start the pageout
+ * thread. Called once swap is ready.
+ */
+void
+coremap_pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_lowater = num_coremap_entries / 32;
+	if (pageout_lowater < CM_MIN_SLACK / 2) {
+		pageout_lowater = CM_MIN_SLACK / 2;
+	}
+	pageout_hiwater = 2 * pageout_lowater;
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("vm: Could not start pageout thread: %s\n",
+		      strerror(result));
+	}
+}
+
 /*
  * coremap_allocuser
  *
@@ -880,6 +1207,47 @@ coremap_allocuser(struct lpage *lp)
 	return coremap_alloc_one_page(lp, 1 /* dopin */);
 }
 
+/*
+ * coremap_allocspare
+ *
+ * Like coremap_allocuser, but only hands out a page that's free and
+ * not part of the pageout thread's reserve; never evicts anything.
+ * This is for reading pages ahead, which isn't worth pushing other
+ * pages out for.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+paddr_t
+coremap_allocspare(struct lpage *lp)
+{
+	int candidate;
+
+	KASSERT(lp != NULL);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	candidate = -1;
+	if (num_coremap_free > pageout_lowater) {
+		candidate = coremap_find_free();
+	}
+	if (candidate < 0) {
+		spinlock_release(&coremap_spinlock);
+		return INVALID_PADDR;
+	}
+
+	mark_pages_allocated(candidate, 1 /* npages */, 1 /* dopin */,
+			     0 /* iskern */);
+	coremap[candidate].cm_lpage = lp;
+
+	// free pages should not be in the TLB
+	KASSERT(coremap[candidate].cm_tlbix < 0);
+	KASSERT(coremap[candidate].cm_cpunum == 0);
+
+	spinlock_release(&coremap_spinlock);
+
+	return COREMAP_TO_PADDR(candidate);
+}
+
 /*
  * coremap_free 
  *
@@ -1045,19 +1413,6 @@ coremap_print_short(void)
 }
 #undef NCOLS
 
-/*
- * coremap_pinwait: wait for a pinned page to unpin.
- */
-static
-void
-coremap_pinwait(void)
-{
-	wchan_lock(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_pinchan);
-	spinlock_acquire(&coremap_spinlock);
-}
-
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
  *
@@ -1197,11 +1552,39 @@ mmu_unmap(struct addrspace *as, vaddr_t va)
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * mmu_unmap_page: Remove whatever translation maps a physical page,
+ * on this CPU or any other. Used when a page becomes shared
+ * copy-on-write and must stop being writable. The page must be
+ * pinned.
+ *
+ * Synchronization: takes coremap_spinlock. May block waiting for
+ * TLB shootdown.
+ */
+void
+mmu_unmap_page(paddr_t pa)
+{
+	unsigned cmix;
+
+	spinlock_acquire(&coremap_spinlock);
+	cmix = PADDR_TO_COREMAP(pa);
+	KASSERT(cmix < num_coremap_entries);
+	tlb_shootpage(cmix);
+	spinlock_release(&coremap_spinlock);
+}
+
 /*
  * mmu_map: Enter a translation into the MMU. (This is the end result
  * of fault handling.)
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * Each physical page is mapped by at most one TLB entry. A page
+ * shared copy-on-write may still be mapped on another CPU by the
+ * other address space; if so it's shot down first. Likewise the TLB
+ * may still hold a translation for VA that points at the shared page
+ * this address space just copied; that entry is dropped.
+ *
+ * Synchronization: Takes coremap_spinlock. May block waiting for TLB
+ * shootdown, but only before looking at the TLB.
  */
 void
 mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
@@ -1215,15 +1598,29 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 	
 	spinlock_acquire(&coremap_spinlock);
 
-	KASSERT(as == curcpu->c_vm.cvm_lastas);
-
 	cmix = PADDR_TO_COREMAP(pa);
 	KASSERT(cmix < num_coremap_entries);
 
 	/* Page must be pinned. */
 	KASSERT(coremap[cmix].cm_pinned);
 
+	if (coremap[cmix].cm_tlbix >= 0 &&
+	    coremap[cmix].cm_cpunum != curcpu->c_number) {
+		tlb_shootpage(cmix);
+	}
+
+	/* Sleeping in the shootdown reloads this on the way back. */
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+
 	tlbix = tlb_probe(va, 0);
+	if (tlbix >= 0) {
+		tlb_read(&ehi, &elo, tlbix);
+		if ((elo & TLBLO_PPAGE) != (pa & TLBLO_PPAGE)) {
+			/* stale; was mapping a page we've since copied */
+			tlb_invalidate(tlbix);
+			tlbix = -1;
+		}
+	}
 	if (tlbix < 0) {
 		KASSERT(coremap[cmix].cm_tlbix == -1);
 		KASSERT(coremap[cmix].cm_cpunum == 0);
@@ -1248,6 +1645,9 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	tlb_write(ehi, elo, tlbix);
 
+	/* It's in use; tell the clock hand */
+	coremap[cmix].cm_referenced = 1;
+
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
 	wchan_wakeall(coremap_pinchan);
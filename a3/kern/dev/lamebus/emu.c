@@ -479,11 +479,17 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
+	/* Someone picked it up again; consume VOP_DECREF's reference */
+	spinlock_acquire(&ev->ev_v.vn_countlock);
 	if (ev->ev_v.vn_refcount != 1) {
+		KASSERT(ev->ev_v.vn_refcount > 1);
+		ev->ev_v.vn_refcount--;
+		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&ev->ev_v.vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -555,6 +561,22 @@ emufs_read(struct vnode *v, struct uio *uio)
 	return 0;
 }
 
+/*
+ * VOP_READAHEAD
+ *
+ * Each read is a single request to the emulator, which does its own
+ * caching on the host, so there is nothing to gain here.
+ */
+static
+int
+emufs_readahead(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return 0;
+}
+
 /*
  * VOP_READDIR
  */
@@ -1068,6 +1090,16 @@ emufs_truncate_isdir(struct vnode *v, off_t len)
 	return ENOTDIR;
 }
 
+static
+int
+emufs_readahead_isdir(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return EISDIR;
+}
+
 //////////////////////////////
 
 /*
@@ -1081,6 +1113,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_reclaim,
 
 	emufs_read,
+	emufs_readahead,
 	emufs_readlink_notlink,
 	emufs_uio_op_notdir, /* getdirentry */
 	emufs_write,
@@ -1116,6 +1149,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_reclaim,
 
 	emufs_uio_op_isdir,   /* read */
+	emufs_readahead_isdir,
 	emufs_uio_op_isdir,   /* readlink */
 	emufs_getdirentry,
 	emufs_uio_op_isdir,   /* write */
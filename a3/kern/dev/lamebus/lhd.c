@@ -35,7 +35,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -94,29 +95,153 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Request queue
+//
+// Pending requests are kept in C-LOOK order: first the ones at or
+// beyond the last sector we started, in ascending order, then the
+// ones behind it, also ascending. The head only ever sweeps upward;
+// when it runs out of requests ahead of it, it jumps back to the
+// lowest pending sector and sweeps up again. Requests that touch
+// adjacent sectors end up next to each other in the queue and so go
+// to the disk back to back.
+//
+// Everything here is protected by lh_lock and may be called from the
+// interrupt handler.
+
+/*
+ * Return true if A should be serviced before B given the current head
+ * position.
+ */
+static
+bool
+lhd_clook_before(struct lhd_softc *lh, struct lhd_request *a,
+		 struct lhd_request *b)
+{
+	bool aahead = a->lr_sector >= lh->lh_headpos;
+	bool bahead = b->lr_sector >= lh->lh_headpos;
+
+	if (aahead != bahead) {
+		return aahead;
+	}
+	return a->lr_sector < b->lr_sector;
+}
+
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Add a request to the pending queue.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_enqueue(struct lhd_softc *lh, struct lhd_request *req)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	pp = &lh->lh_queue;
+	while (*pp != NULL && !lhd_clook_before(lh, req, *pp)) {
+		pp = &(*pp)->lr_next;
+	}
+	req->lr_next = *pp;
+	*pp = req;
+}
+
+/*
+ * Start the next sector of the active request.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *req = lh->lh_active;
+	uint32_t sector, statval;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->lr_donesect < req->lr_nsect);
+
+	sector = req->lr_sector + req->lr_donesect;
+	statval = LHD_WORKING;
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (req->lr_iswrite) {
+		memcpy(lh->lh_buf, req->lr_buf + req->lr_donesect*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lh->lh_headpos = sector;
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, start the next pending request.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+	lh->lh_active = lh->lh_queue;
+	lh->lh_queue = lh->lh_active->lr_next;
+	lh->lh_active->lr_next = NULL;
+	lhd_startsector(lh);
+}
+
+/*
+ * Queue a request. Returns an error if the request is malformed;
+ * otherwise lr_done will be set, and lr_wchan woken, when it
+ * completes.
+ */
+static
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	/* Don't allow I/O past the end of the disk. */
+	if (req->lr_nsect == 0 ||
+	    req->lr_sector + req->lr_nsect > lh->lh_dev.d_blocks ||
+	    req->lr_sector + req->lr_nsect < req->lr_sector) {
+		return EINVAL;
+	}
+	KASSERT(req->lr_wchan != NULL);
+
+	req->lr_next = NULL;
+	req->lr_donesect = 0;
+	req->lr_result = 0;
+	req->lr_done = false;
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, req);
+	lhd_dispatch(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, finish off the sector, and either go on to the next sector
+ * of the request or complete it and start the next request.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_request *req, *done = NULL;
+	struct wchan *wc;
 	uint32_t val;
+	int err;
 	
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -127,9 +252,50 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		err = lhd_code_to_errno(lh, val);
+
+		req = lh->lh_active;
+		if (req == NULL) {
+			kprintf("lhd%d: Stray completion interrupt\n",
+				lh->lh_unit);
+			break;
+		}
+
+		/* If reading, transfer the data out of the card buffer. */
+		if (err == 0 && !req->lr_iswrite) {
+			memcpy(req->lr_buf + req->lr_donesect*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+
+		if (err == 0) {
+			req->lr_donesect++;
+		}
+		if (err == 0 && req->lr_donesect < req->lr_nsect) {
+			/* More of this request to go */
+			lhd_startsector(lh);
+		}
+		else {
+			req->lr_result = err;
+			lh->lh_active = NULL;
+			done = req;
+			lhd_dispatch(lh);
+		}
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+
+	/*
+	 * Wake the waiter without holding our lock. Once lr_done is
+	 * set the request may vanish, so get the wchan first.
+	 */
+	if (done != NULL) {
+		wc = done->lr_wchan;
+		wchan_lock(wc);
+		done->lr_done = true;
+		wchan_unlock(wc);
+		wchan_wakeall(wc);
+	}
 }
 
 /*
@@ -193,21 +359,193 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Borrow a wait channel for a thread about to wait for requests,
+ * waiting for one if they're all in use.
+ */
+static
+struct wchan *
+lhd_getwchan(struct lhd_softc *lh)
+{
+	struct wchan *wc;
+
+	spinlock_acquire(&lh->lh_lock);
+	while (lh->lh_nfreewchans == 0) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	wc = lh->lh_freewchans[--lh->lh_nfreewchans];
+	spinlock_release(&lh->lh_lock);
+	return wc;
+}
+
+/*
+ * Give back a wait channel from lhd_getwchan.
+ */
+static
+void
+lhd_putwchan(struct lhd_softc *lh, struct wchan *wc)
+{
+	spinlock_acquire(&lh->lh_lock);
+	KASSERT(lh->lh_nfreewchans < LHD_NWAITCHANS);
+	lh->lh_freewchans[lh->lh_nfreewchans++] = wc;
+	spinlock_release(&lh->lh_lock);
+	wchan_wakeone(lh->lh_wchan);
+}
+
+/*
+ * Wait for a submitted request to finish. The caller has WC, the
+ * request's lr_wchan, locked; it is unlocked on return.
+ */
+static
+void
+lhd_waitfor(struct wchan *wc, struct lhd_request *req)
+{
+	while (!req->lr_done) {
+		wchan_sleep(wc);
+		wchan_lock(wc);
+	}
+	wchan_unlock(wc);
+}
+
+/*
+ * Submit a request and wait for it to finish.
+ */
+static
+int
+lhd_io_wait(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct wchan *wc;
+	int result;
+
+	wc = lhd_getwchan(lh);
+	req->lr_wchan = wc;
+
+	result = lhd_submit(lh, req);
+	if (result == 0) {
+		wchan_lock(wc);
+		lhd_waitfor(wc, req);
+		result = req->lr_result;
+	}
+
+	lhd_putwchan(lh, wc);
+	return result;
+}
+
+/*
+ * Scattered I/O: queue one request for each of several kernel
+ * buffers that go to consecutive sectors, then wait for all of them.
+ * Since they're adjacent on disk the queue runs them back to back.
+ * This is how a cluster of pages is swapped in or out; it needs no
+ * memory allocation, unlike the bounce buffer.
+ */
+#define LHD_MAXSCATTER 8
+
+static
+bool
+lhd_can_scatter(struct uio *uio)
+{
+	size_t total;
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE ||
+	    uio->uio_iovcnt > LHD_MAXSCATTER) {
+		return false;
+	}
+	total = 0;
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+		total += uio->uio_iov[i].iov_len;
+	}
+	return total == uio->uio_resid;
+}
+
+static
+int
+lhd_io_scatter(struct lhd_softc *lh, struct uio *uio, uint32_t sector)
+{
+	struct lhd_request reqs[LHD_MAXSCATTER];
+	struct iovec *iov;
+	struct wchan *wc;
+	unsigned i, nsub;
+	int result;
+
+	/* All the pieces share one wait channel, since we wait for all */
+	wc = lhd_getwchan(lh);
+
+	result = 0;
+	nsub = 0;
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		iov = &uio->uio_iov[i];
+		if (iov->iov_len == 0) {
+			continue;
+		}
+		reqs[nsub].lr_sector = sector;
+		reqs[nsub].lr_nsect = iov->iov_len / LHD_SECTSIZE;
+		reqs[nsub].lr_iswrite = (uio->uio_rw == UIO_WRITE);
+		reqs[nsub].lr_buf = iov->iov_kbase;
+		reqs[nsub].lr_wchan = wc;
+		result = lhd_submit(lh, &reqs[nsub]);
+		if (result) {
+			break;
+		}
+		sector += reqs[nsub].lr_nsect;
+		nsub++;
+	}
+
+	/* Wait for whatever got started, even if something failed. */
+	for (i=0; i<nsub; i++) {
+		wchan_lock(wc);
+		lhd_waitfor(wc, &reqs[i]);
+	}
+	lhd_putwchan(lh, wc);
+
+	for (i=0; i<nsub && result == 0; i++) {
+		result = reqs[i].lr_result;
+	}
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		iov = &uio->uio_iov[i];
+		iov->iov_kbase = (char *)iov->iov_kbase + iov->iov_len;
+		iov->iov_len = 0;
+	}
+	uio->uio_offset += uio->uio_resid;
+	uio->uio_resid = 0;
+	return 0;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * This is a synchronous wrapper around the request queue. Kernel
+ * buffers are handed to the driver directly, one request each if
+ * there are several (see lhd_io_scatter); anything else (user
+ * buffers, or kernel buffers too scattered for that) is staged
+ * through a bounce buffer LHD_MAXBOUNCE sectors at a time.
  */
+#define LHD_MAXBOUNCE  64
+
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_request req;
+	struct iovec *iov;
+	char *bounce;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	uint32_t chunk;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +558,71 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	req.lr_iswrite = (uio->uio_rw == UIO_WRITE);
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+	/* The common case: one kernel buffer. Use it directly. */
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		KASSERT(iov->iov_len == uio->uio_resid);
+		req.lr_sector = sector;
+		req.lr_nsect = len;
+		req.lr_buf = iov->iov_kbase;
+		result = lhd_io_wait(lh, &req);
+		if (result) {
+			return result;
 		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	if (lhd_can_scatter(uio)) {
+		return lhd_io_scatter(lh, uio, sector);
+	}
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	chunk = len < LHD_MAXBOUNCE ? len : LHD_MAXBOUNCE;
+	bounce = kmalloc(chunk * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	result = 0;
+	while (len > 0) {
+		if (chunk > len) {
+			chunk = len;
 		}
+		req.lr_sector = sector;
+		req.lr_nsect = chunk;
+		req.lr_buf = bounce;
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		if (req.lr_iswrite) {
+			result = uiomove(bounce, chunk * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = lhd_io_wait(lh, &req);
 		if (result) {
-			return result;
+			break;
+		}
+		if (!req.lr_iswrite) {
+			result = uiomove(bounce, chunk * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += chunk;
+		len -= chunk;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -282,6 +632,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -289,17 +640,28 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	for (i=0; i<LHD_NWAITCHANS; i++) {
+		lh->lh_freewchans[i] = wchan_create("lhdio");
+		if (lh->lh_freewchans[i] == NULL) {
+			while (i-- > 0) {
+				wchan_destroy(lh->lh_freewchans[i]);
+			}
+			wchan_destroy(lh->lh_wchan);
+			spinlock_cleanup(&lh->lh_lock);
+			return ENOMEM;
+		}
 	}
+	lh->lh_nfreewchans = LHD_NWAITCHANS;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
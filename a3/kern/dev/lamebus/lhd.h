@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,35 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A disk request: a contiguous run of sectors to transfer to or from
+ * a kernel buffer.
+ *
+ * lhd_io queues requests and sleeps until they're done; the interrupt
+ * handler carries them out and wakes the waiter. Each waiting thread
+ * borrows a wait channel of its own from the softc for the duration,
+ * so a completion wakes only the thread that is waiting for it.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	uint32_t lr_nsect;		/* number of sectors */
+	bool lr_iswrite;		/* true to write, false to read */
+	char *lr_buf;			/* lr_nsect * LHD_SECTSIZE bytes */
+	struct wchan *lr_wchan;		/* waiter to wake when done */
+
+	/* Maintained by the driver */
+	struct lhd_request *lr_next;	/* link in the pending queue */
+	uint32_t lr_donesect;		/* sectors finished so far */
+	int lr_result;			/* result, valid once lr_done */
+	bool lr_done;			/* set under lr_wchan's lock */
+};
+
+/*
+ * Number of wait channels kept for threads waiting on requests. More
+ * waiters than this wait for one to come free.
+ */
+#define LHD_NWAITCHANS	16
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +81,14 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct lhd_request *lh_active;	/* Request the disk is working on */
+	struct lhd_request *lh_queue;	/* Pending requests, C-LOOK order */
+	uint32_t lh_headpos;		/* Last sector started */
+	struct wchan *lh_freewchans[LHD_NWAITCHANS]; /* Not in use */
+	unsigned lh_nfreewchans;	/* Entries in lh_freewchans */
+	struct wchan *lh_wchan;		/* For waiting for a free one */
 
 	struct device lh_dev;		/* VFS device structure */
 };
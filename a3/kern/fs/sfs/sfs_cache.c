@@ -0,0 +1,1136 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Block buffer cache.
+ *
+ * All metadata blocks (inodes, indirect blocks, directory blocks) and
+ * file data go through here rather than straight to the device. A
+ * buffer is looked up by (device, block) in a small hash table; a
+ * buffer nobody is using sits on an LRU list, and misses recycle the
+ * least recently released one.
+ *
+ * Callers hold a reference to a buffer from sfs_buf_read/sfs_buf_get
+ * until sfs_buf_release, and may only touch sb_data in between.
+ *
+ * Writes are delayed: a modified buffer stays dirty in memory until
+ * it is recycled, until the syncer thread (see sfs_fsops.c) flushes
+ * it, or until an explicit sync. Repeated updates to the same
+ * directory or indirect block thus cost one disk write, not many.
+ *
+ * Blocks a reader is expected to want soon can be queued for the
+ * read-ahead thread, which loads them in the background. A buffer it
+ * loads is marked sb_readahead until first used, so we can count how
+ * much of the read-ahead pays off.
+ *
+ * File data written into a hole can be held in a delayed buffer,
+ * keyed by (vnode, file block), without a disk block at all. The
+ * file's delayed buffers get disk blocks together when it is synced
+ * (see sfs_delalloc_flush in sfs_vnops.c), so they can be placed in
+ * one run; the cache itself never writes them.
+ *
+ * On a volume with a journal, modified metadata is marked sb_meta
+ * and must not reach its home block before the journal has committed
+ * it (see sfs_journal.c). Such buffers are passed over when choosing
+ * one to recycle and when flushing; the commit writes them out. Only
+ * if nothing else can be recycled does one go out early, which costs
+ * the crash atomicity of the operations that changed it.
+ *
+ * Locking: bc_lock protects the hash chains, the LRU list, and every
+ * buffer's bookkeeping fields. It is never held across device I/O.
+ * While a buffer is being read or written it is marked sb_busy;
+ * anyone else who wants it waits on bc_cv. The contents of a buffer
+ * are protected by whoever holds the reference (in practice, the
+ * lock of the vnode the block belongs to).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+
+/*
+ * Hash function for (device, block), or (vnode, file block) for a
+ * delayed buffer.
+ */
+static
+unsigned
+sfs_buf_hash(const void *owner, uint32_t block)
+{
+	return (block ^ ((uintptr_t)owner >> 4)) % SFS_CACHE_NBUCKETS;
+}
+
+/*
+ * Which of the above a buffer is hashed by.
+ */
+static
+const void *
+sfs_buf_owner(struct sfs_buf *buf)
+{
+	if (buf->sb_vnode != NULL) {
+		return buf->sb_vnode;
+	}
+	return buf->sb_device;
+}
+
+////////////////////////////////////////////////////////////
+//
+// LRU list maintenance
+
+static
+void
+sfs_lru_remove(struct sfs_bufcache *bc, struct sfs_buf *buf)
+{
+	if (buf->sb_lruprev != NULL) {
+		buf->sb_lruprev->sb_lrunext = buf->sb_lrunext;
+	}
+	else {
+		KASSERT(bc->bc_lruhead == buf);
+		bc->bc_lruhead = buf->sb_lrunext;
+	}
+	if (buf->sb_lrunext != NULL) {
+		buf->sb_lrunext->sb_lruprev = buf->sb_lruprev;
+	}
+	else {
+		KASSERT(bc->bc_lrutail == buf);
+		bc->bc_lrutail = buf->sb_lruprev;
+	}
+	buf->sb_lrunext = buf->sb_lruprev = NULL;
+}
+
+static
+void
+sfs_lru_addhead(struct sfs_bufcache *bc, struct sfs_buf *buf)
+{
+	buf->sb_lruprev = NULL;
+	buf->sb_lrunext = bc->bc_lruhead;
+	if (bc->bc_lruhead != NULL) {
+		bc->bc_lruhead->sb_lruprev = buf;
+	}
+	else {
+		bc->bc_lrutail = buf;
+	}
+	bc->bc_lruhead = buf;
+}
+
+static
+void
+sfs_lru_addtail(struct sfs_bufcache *bc, struct sfs_buf *buf)
+{
+	buf->sb_lrunext = NULL;
+	buf->sb_lruprev = bc->bc_lrutail;
+	if (bc->bc_lrutail != NULL) {
+		bc->bc_lrutail->sb_lrunext = buf;
+	}
+	else {
+		bc->bc_lruhead = buf;
+	}
+	bc->bc_lrutail = buf;
+}
+
+/*
+ * Choose a buffer to recycle: the least recently used one, passing
+ * over metadata waiting for a commit unless there is nothing else.
+ * Buffers being written back stay on the list while the write is in
+ * progress (sb_busy); they're skipped. Returns NULL if every buffer
+ * is held or busy.
+ */
+static
+struct sfs_buf *
+sfs_lru_victim(struct sfs_bufcache *bc)
+{
+	struct sfs_buf *buf, *metabuf;
+
+	metabuf = NULL;
+	for (buf = bc->bc_lrutail; buf != NULL; buf = buf->sb_lruprev) {
+		if (buf->sb_busy) {
+			continue;
+		}
+		if (!buf->sb_meta) {
+			return buf;
+		}
+		if (metabuf == NULL) {
+			metabuf = buf;
+		}
+	}
+	return metabuf;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Hash table maintenance
+
+static
+void
+sfs_hash_remove(struct sfs_bufcache *bc, struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	pp = &bc->bc_hash[sfs_buf_hash(sfs_buf_owner(buf), buf->sb_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->sb_hashnext;
+	}
+	*pp = buf->sb_hashnext;
+	buf->sb_hashnext = NULL;
+}
+
+static
+void
+sfs_hash_add(struct sfs_bufcache *bc, struct sfs_buf *buf)
+{
+	unsigned h;
+
+	h = sfs_buf_hash(sfs_buf_owner(buf), buf->sb_block);
+	buf->sb_hashnext = bc->bc_hash[h];
+	bc->bc_hash[h] = buf;
+}
+
+static
+struct sfs_buf *
+sfs_hash_find(struct sfs_bufcache *bc, struct device *dev, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	buf = bc->bc_hash[sfs_buf_hash(dev, block)];
+	while (buf != NULL) {
+		if (buf->sb_device == dev && buf->sb_block == block) {
+			return buf;
+		}
+		buf = buf->sb_hashnext;
+	}
+	return NULL;
+}
+
+static
+struct sfs_buf *
+sfs_hash_finddelayed(struct sfs_bufcache *bc, struct sfs_vnode *sv,
+		     uint32_t fileblock)
+{
+	struct sfs_buf *buf;
+
+	buf = bc->bc_hash[sfs_buf_hash(sv, fileblock)];
+	while (buf != NULL) {
+		if (buf->sb_vnode == sv && buf->sb_block == fileblock) {
+			return buf;
+		}
+		buf = buf->sb_hashnext;
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buffer I/O
+
+/*
+ * Write a dirty buffer back to disk. Called with bc_lock held and the
+ * buffer idle; the lock is dropped during the I/O and held again on
+ * return. Metadata still waiting for a commit is going out early;
+ * once written it no longer needs the commit to write it.
+ */
+static
+int
+sfs_buf_writeout(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	bool meta;
+	int result;
+
+	KASSERT(lock_do_i_hold(bc->bc_lock));
+	KASSERT(buf->sb_valid);
+	KASSERT(buf->sb_dirty);
+	KASSERT(!buf->sb_busy);
+	KASSERT(buf->sb_device == sfs->sfs_device);
+
+	/*
+	 * Clear the dirty flag before starting, so a change made by a
+	 * reference holder while the write is in progress isn't lost.
+	 */
+	meta = buf->sb_meta;
+	if (meta) {
+		buf->sb_meta = false;
+		bc->bc_nmeta--;
+	}
+	buf->sb_busy = true;
+	buf->sb_dirty = false;
+	bc->bc_ndirty--;
+	lock_release(bc->bc_lock);
+
+	result = sfs_wblock(sfs, buf->sb_data, buf->sb_block);
+
+	lock_acquire(bc->bc_lock);
+	buf->sb_busy = false;
+	if (result) {
+		if (!buf->sb_dirty) {
+			buf->sb_dirty = true;
+			bc->bc_ndirty++;
+		}
+		if (meta && !buf->sb_meta) {
+			buf->sb_meta = true;
+			bc->bc_nmeta++;
+		}
+	}
+	else {
+		bc->bc_writes++;
+		if (meta) {
+			bc->bc_early++;
+		}
+	}
+	cv_broadcast(bc->bc_cv, bc->bc_lock);
+	return result;
+}
+
+/*
+ * Find the buffer for BLOCK, or recycle one for it, and take a
+ * reference. If DOREAD is set and the contents aren't there, read
+ * them; otherwise the caller is going to overwrite the whole block
+ * and the contents are garbage until it does.
+ */
+static
+int
+sfs_buf_lookup(struct sfs_fs *sfs, uint32_t block, bool doread,
+	       struct sfs_buf **ret)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	int result;
+
+	if (block >= sfs->sfs_super.sp_nblocks) {
+		panic("sfs: buffer requested for invalid block %u\n", block);
+	}
+
+	lock_acquire(bc->bc_lock);
+
+ again:
+	buf = sfs_hash_find(bc, sfs->sfs_device, block);
+	if (buf != NULL) {
+		if (buf->sb_busy) {
+			cv_wait(bc->bc_cv, bc->bc_lock);
+			goto again;
+		}
+		bc->bc_hits++;
+		if (buf->sb_readahead) {
+			buf->sb_readahead = false;
+			bc->bc_rahits++;
+		}
+		if (buf->sb_refcount == 0) {
+			sfs_lru_remove(bc, buf);
+		}
+		buf->sb_refcount++;
+	}
+	else {
+		bc->bc_misses++;
+
+		/* Take the least recently used buffer nobody is holding. */
+		buf = sfs_lru_victim(bc);
+		if (buf == NULL) {
+			/* Everything is in use; wait for a release
+			   or for a writeback to finish. */
+			cv_wait(bc->bc_cv, bc->bc_lock);
+			goto again;
+		}
+		KASSERT(buf->sb_refcount == 0);
+		KASSERT(!buf->sb_busy);
+
+		if (buf->sb_dirty) {
+			/*
+			 * Write it back, then start over: while the
+			 * lock was dropped someone may have grabbed
+			 * this buffer, or loaded BLOCK elsewhere.
+			 */
+			result = sfs_buf_writeout(sfs, buf);
+			if (result) {
+				lock_release(bc->bc_lock);
+				return result;
+			}
+			goto again;
+		}
+
+		sfs_lru_remove(bc, buf);
+		if (buf->sb_device != NULL) {
+			sfs_hash_remove(bc, buf);
+		}
+		if (buf->sb_readahead) {
+			buf->sb_readahead = false;
+			bc->bc_rawasted++;
+		}
+
+		buf->sb_device = sfs->sfs_device;
+		buf->sb_block = block;
+		buf->sb_valid = false;
+		buf->sb_refcount = 1;
+		sfs_hash_add(bc, buf);
+	}
+
+	if (!buf->sb_valid) {
+		if (doread) {
+			buf->sb_busy = true;
+			lock_release(bc->bc_lock);
+
+			result = sfs_rblock(sfs, buf->sb_data, block);
+
+			lock_acquire(bc->bc_lock);
+			buf->sb_busy = false;
+			cv_broadcast(bc->bc_cv, bc->bc_lock);
+			if (result) {
+				lock_release(bc->bc_lock);
+				/* Leave it invalid; drop it back on the list */
+				sfs_buf_release(sfs, buf);
+				return result;
+			}
+			bc->bc_reads++;
+		}
+		buf->sb_valid = true;
+	}
+
+	lock_release(bc->bc_lock);
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Get a buffer for BLOCK with its contents read from disk.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, true, ret);
+}
+
+/*
+ * Get a buffer for BLOCK without reading it in. This is for callers
+ * that are about to overwrite the whole block; if the block was not
+ * already cached, the contents are garbage until they do.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, false, ret);
+}
+
+/*
+ * Note that the caller changed the contents of a buffer.
+ */
+void
+sfs_buf_markdirty(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+
+	lock_acquire(bc->bc_lock);
+	KASSERT(buf->sb_refcount > 0);
+	KASSERT(buf->sb_valid);
+	if (!buf->sb_dirty) {
+		buf->sb_dirty = true;
+		bc->bc_ndirty++;
+	}
+	lock_release(bc->bc_lock);
+}
+
+/*
+ * Note that the caller changed the contents of a metadata buffer:
+ * an inode, indirect or extent block, or directory block. With a
+ * journal, it then stays in the cache until the next commit.
+ */
+void
+sfs_buf_markmeta(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+
+	lock_acquire(bc->bc_lock);
+	KASSERT(buf->sb_refcount > 0);
+	KASSERT(buf->sb_valid);
+	if (!buf->sb_dirty) {
+		buf->sb_dirty = true;
+		bc->bc_ndirty++;
+	}
+	if (!buf->sb_meta && sfs->sfs_journal != NULL) {
+		buf->sb_meta = true;
+		bc->bc_nmeta++;
+	}
+	lock_release(bc->bc_lock);
+}
+
+/*
+ * Drop a reference to a buffer. Dirty buffers are left for the
+ * syncer; this never fails, but returns int so callers need not
+ * change if that ever stops being true.
+ */
+int
+sfs_buf_release(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+
+	lock_acquire(bc->bc_lock);
+	KASSERT(buf->sb_refcount > 0);
+
+	buf->sb_refcount--;
+	if (buf->sb_refcount == 0) {
+		if (buf->sb_vnode != NULL) {
+			/* Delayed; can't be recycled, so not on the list */
+		}
+		else if (buf->sb_valid) {
+			sfs_lru_addhead(bc, buf);
+		}
+		else {
+			/* Nothing worth keeping; recycle it first */
+			sfs_hash_remove(bc, buf);
+			buf->sb_device = NULL;
+			sfs_lru_addtail(bc, buf);
+		}
+		cv_broadcast(bc->bc_cv, bc->bc_lock);
+	}
+	lock_release(bc->bc_lock);
+	return 0;
+}
+
+/*
+ * Throw away the cached copy of BLOCK, if any, dirty or not. Called
+ * with bc_lock held; waits out I/O in progress on it.
+ */
+static
+void
+sfs_buf_drop(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+
+	KASSERT(lock_do_i_hold(bc->bc_lock));
+
+	buf = sfs_hash_find(bc, sfs->sfs_device, block);
+	while (buf != NULL && buf->sb_busy) {
+		/* The syncer is writing it out; let it finish */
+		cv_wait(bc->bc_cv, bc->bc_lock);
+		buf = sfs_hash_find(bc, sfs->sfs_device, block);
+	}
+	if (buf == NULL) {
+		return;
+	}
+	if (buf->sb_refcount > 0) {
+		panic("sfs: freeing block %u while its buffer is in use\n",
+		      block);
+	}
+	if (buf->sb_dirty) {
+		buf->sb_dirty = false;
+		bc->bc_ndirty--;
+	}
+	if (buf->sb_meta) {
+		buf->sb_meta = false;
+		bc->bc_nmeta--;
+	}
+	buf->sb_valid = false;
+	buf->sb_readahead = false;
+	sfs_hash_remove(bc, buf);
+	buf->sb_device = NULL;
+
+	/* Move it to the cold end so it gets reused first */
+	sfs_lru_remove(bc, buf);
+	sfs_lru_addtail(bc, buf);
+}
+
+/*
+ * Forget about a block that has been freed, so stale contents are
+ * never written over whatever the block gets used for next.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+
+	lock_acquire(bc->bc_lock);
+	sfs_buf_drop(sfs, block);
+	lock_release(bc->bc_lock);
+}
+
+/*
+ * Check whether BLOCK is in the cache (or on its way in or out). This
+ * can be out of date as soon as it returns unless the caller holds a
+ * lock that keeps anyone else from loading the block.
+ */
+bool
+sfs_buf_cached(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	bool ret;
+
+	lock_acquire(bc->bc_lock);
+	buf = sfs_hash_find(bc, sfs->sfs_device, block);
+	ret = buf != NULL && (buf->sb_valid || buf->sb_busy);
+	lock_release(bc->bc_lock);
+	return ret;
+}
+
+/*
+ * Write back every dirty buffer, except metadata waiting for a
+ * journal commit. Buffers somebody is in the middle of using are
+ * waited for, so this is a barrier for every update that was
+ * complete when it was called.
+ */
+int
+sfs_buf_flush(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	unsigned i;
+	int result;
+
+	lock_acquire(bc->bc_lock);
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		buf = &bc->bc_bufs[i];
+		while (buf->sb_dirty && !buf->sb_meta &&
+		       (buf->sb_busy || buf->sb_refcount > 0)) {
+			cv_wait(bc->bc_cv, bc->bc_lock);
+		}
+		if (buf->sb_dirty && !buf->sb_meta) {
+			result = sfs_buf_writeout(sfs, buf);
+			if (result) {
+				lock_release(bc->bc_lock);
+				return result;
+			}
+		}
+	}
+	lock_release(bc->bc_lock);
+	return 0;
+}
+
+/*
+ * Take a reference to every metadata buffer waiting for a commit and
+ * put them in BUFS, which has room for MAX. Returns how many. The
+ * journal calls this when no operation is in progress, so the set
+ * can't grow while it commits them.
+ */
+unsigned
+sfs_buf_metalist(struct sfs_fs *sfs, struct sfs_buf **bufs, unsigned max)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	unsigned i, n;
+
+	lock_acquire(bc->bc_lock);
+	n = 0;
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		buf = &bc->bc_bufs[i];
+		while (buf->sb_busy) {
+			/* Going out early; it won't be sb_meta after */
+			cv_wait(bc->bc_cv, bc->bc_lock);
+		}
+		if (!buf->sb_meta) {
+			continue;
+		}
+		KASSERT(n < max);
+		if (buf->sb_refcount == 0) {
+			sfs_lru_remove(bc, buf);
+		}
+		buf->sb_refcount++;
+		bufs[n++] = buf;
+	}
+	lock_release(bc->bc_lock);
+	return n;
+}
+
+/*
+ * Write a buffer from sfs_buf_metalist to its home block, now that the
+ * journal has committed it, and drop the reference.
+ */
+int
+sfs_buf_checkpoint(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	int result;
+
+	lock_acquire(bc->bc_lock);
+	KASSERT(buf->sb_refcount > 0);
+	KASSERT(!buf->sb_busy);
+	if (buf->sb_meta) {
+		buf->sb_meta = false;
+		bc->bc_nmeta--;
+	}
+	result = 0;
+	if (buf->sb_dirty) {
+		result = sfs_buf_writeout(sfs, buf);
+	}
+	lock_release(bc->bc_lock);
+
+	sfs_buf_release(sfs, buf);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed buffers
+//
+// These are only used under the lock of the vnode that owns them, so
+// they are never busy and only that vnode's thread holds references.
+
+/*
+ * Get the delayed buffer for block FILEBLOCK of SV and take a
+ * reference. If there isn't one and CREATE is set, make one, zero
+ * filled. Hands back NULL if there isn't one, or if there's no room
+ * for a new one: that happens once SFS_DELALLOC_MAX are in use, or
+ * when every buffer is busy or held.
+ */
+int
+sfs_buf_getdelayed(struct sfs_fs *sfs, struct sfs_vnode *sv,
+		   uint32_t fileblock, bool create, struct sfs_buf **ret)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	int result;
+
+	lock_acquire(bc->bc_lock);
+
+	buf = sfs_hash_finddelayed(bc, sv, fileblock);
+	if (buf != NULL) {
+		KASSERT(!buf->sb_busy);
+		buf->sb_refcount++;
+		lock_release(bc->bc_lock);
+		*ret = buf;
+		return 0;
+	}
+	if (!create || bc->bc_ndelayed >= SFS_DELALLOC_MAX) {
+		lock_release(bc->bc_lock);
+		*ret = NULL;
+		return 0;
+	}
+
+	/*
+	 * Recycle a buffer, as sfs_buf_lookup would, but don't wait,
+	 * and don't push metadata out early for this.
+	 */
+	while ((buf = sfs_lru_victim(bc)) != NULL && buf->sb_dirty &&
+	       !buf->sb_meta) {
+		result = sfs_buf_writeout(sfs, buf);
+		if (result) {
+			lock_release(bc->bc_lock);
+			return result;
+		}
+	}
+	if (buf == NULL || buf->sb_meta ||
+	    bc->bc_ndelayed >= SFS_DELALLOC_MAX) {
+		/* (The limit is checked again, as writeout dropped the lock) */
+		lock_release(bc->bc_lock);
+		*ret = NULL;
+		return 0;
+	}
+	KASSERT(buf->sb_refcount == 0);
+	KASSERT(!buf->sb_busy);
+
+	sfs_lru_remove(bc, buf);
+	if (buf->sb_device != NULL) {
+		sfs_hash_remove(bc, buf);
+	}
+	if (buf->sb_readahead) {
+		buf->sb_readahead = false;
+		bc->bc_rawasted++;
+	}
+
+	buf->sb_device = NULL;
+	buf->sb_vnode = sv;
+	buf->sb_block = fileblock;
+	buf->sb_valid = true;
+	buf->sb_refcount = 1;
+	bzero(buf->sb_data, SFS_BLOCKSIZE);
+	sfs_hash_add(bc, buf);
+	bc->bc_ndelayed++;
+
+	lock_release(bc->bc_lock);
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Give a delayed buffer, which the caller holds, its disk block. Any
+ * cached copy of BLOCK (the zeros sfs_balloc put there) is thrown
+ * away. The buffer is dirty from then on, like any other written
+ * buffer.
+ */
+void
+sfs_buf_assign(struct sfs_fs *sfs, struct sfs_buf *buf, uint32_t block)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+
+	lock_acquire(bc->bc_lock);
+	KASSERT(buf->sb_vnode != NULL);
+	KASSERT(buf->sb_refcount > 0);
+
+	sfs_buf_drop(sfs, block);
+
+	sfs_hash_remove(bc, buf);
+	buf->sb_vnode = NULL;
+	buf->sb_device = sfs->sfs_device;
+	buf->sb_block = block;
+	sfs_hash_add(bc, buf);
+	bc->bc_ndelayed--;
+	bc->bc_daassigned++;
+
+	KASSERT(!buf->sb_dirty);
+	buf->sb_dirty = true;
+	bc->bc_ndirty++;
+
+	lock_release(bc->bc_lock);
+}
+
+/*
+ * Put the file block numbers of SV's delayed buffers, in increasing
+ * order, into FILEBLOCKS (which has room for MAX). Returns how many.
+ */
+unsigned
+sfs_buf_delayedlist(struct sfs_fs *sfs, struct sfs_vnode *sv,
+		    uint32_t *fileblocks, unsigned max)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	unsigned i, j, n;
+
+	lock_acquire(bc->bc_lock);
+	n = 0;
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		buf = &bc->bc_bufs[i];
+		if (buf->sb_vnode != sv) {
+			continue;
+		}
+		KASSERT(n < max);
+		/* Insertion sort; there are never many */
+		for (j = n; j > 0 && fileblocks[j-1] > buf->sb_block; j--) {
+			fileblocks[j] = fileblocks[j-1];
+		}
+		fileblocks[j] = buf->sb_block;
+		n++;
+	}
+	lock_release(bc->bc_lock);
+	return n;
+}
+
+/*
+ * Throw away SV's delayed buffers for file blocks FROMBLOCK and up,
+ * because the file was truncated. Returns how many went.
+ */
+unsigned
+sfs_buf_discard(struct sfs_fs *sfs, struct sfs_vnode *sv, uint32_t fromblock)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	unsigned i, n;
+
+	lock_acquire(bc->bc_lock);
+	n = 0;
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		buf = &bc->bc_bufs[i];
+		if (buf->sb_vnode != sv || buf->sb_block < fromblock) {
+			continue;
+		}
+		KASSERT(buf->sb_refcount == 0);
+		sfs_hash_remove(bc, buf);
+		buf->sb_vnode = NULL;
+		buf->sb_valid = false;
+		sfs_lru_addtail(bc, buf);
+		bc->bc_ndelayed--;
+		n++;
+	}
+	if (n > 0) {
+		cv_broadcast(bc->bc_cv, bc->bc_lock);
+	}
+	lock_release(bc->bc_lock);
+	return n;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+/*
+ * Load BLOCK into the cache for the read-ahead thread, unless it is
+ * already there. Called with bc_lock held; drops it during the I/O.
+ *
+ * No reference is held on the buffer: it is marked busy while being
+ * read, so lookups and invalidations of the block wait for it as for
+ * any other I/O, and then it goes on the LRU list like any released
+ * buffer. Read-ahead never writes out a dirty buffer to make room; it
+ * just gives up on the block.
+ */
+static
+void
+sfs_buf_prefetch(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(lock_do_i_hold(bc->bc_lock));
+
+	if (sfs_hash_find(bc, sfs->sfs_device, block) != NULL) {
+		return;
+	}
+	buf = sfs_lru_victim(bc);
+	if (buf == NULL || buf->sb_dirty) {
+		return;
+	}
+	KASSERT(buf->sb_refcount == 0);
+	KASSERT(!buf->sb_busy);
+
+	sfs_lru_remove(bc, buf);
+	if (buf->sb_device != NULL) {
+		sfs_hash_remove(bc, buf);
+	}
+	if (buf->sb_readahead) {
+		bc->bc_rawasted++;
+	}
+
+	buf->sb_device = sfs->sfs_device;
+	buf->sb_block = block;
+	buf->sb_valid = false;
+	buf->sb_readahead = false;
+	buf->sb_busy = true;
+	sfs_hash_add(bc, buf);
+	lock_release(bc->bc_lock);
+
+	result = sfs_rblock(sfs, buf->sb_data, block);
+
+	lock_acquire(bc->bc_lock);
+	buf->sb_busy = false;
+	if (result) {
+		sfs_hash_remove(bc, buf);
+		buf->sb_device = NULL;
+		sfs_lru_addtail(bc, buf);
+	}
+	else {
+		buf->sb_valid = true;
+		buf->sb_readahead = true;
+		bc->bc_reads++;
+		bc->bc_rareads++;
+		sfs_lru_addhead(bc, buf);
+	}
+	cv_broadcast(bc->bc_cv, bc->bc_lock);
+}
+
+/*
+ * Read-ahead thread. One runs per mounted sfs, loading the blocks
+ * queued by sfs_buf_readahead in order. sfs_cache_destroy tells it
+ * to go away by setting bc_raexit, and waits for bc_radone.
+ */
+static
+void
+sfs_readahead_thread(void *data, unsigned long junk)
+{
+	struct sfs_fs *sfs = data;
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	uint32_t block;
+
+	(void)junk;
+
+	lock_acquire(bc->bc_lock);
+	while (1) {
+		while (bc->bc_racount == 0 && !bc->bc_raexit) {
+			cv_wait(bc->bc_racv, bc->bc_lock);
+		}
+		if (bc->bc_raexit) {
+			break;
+		}
+		block = bc->bc_raqueue[bc->bc_rahead];
+		bc->bc_rahead = (bc->bc_rahead + 1) % SFS_RA_QUEUESIZE;
+		bc->bc_racount--;
+
+		sfs_buf_prefetch(sfs, block);
+	}
+	bc->bc_radone = true;
+	cv_broadcast(bc->bc_racv, bc->bc_lock);
+	lock_release(bc->bc_lock);
+}
+
+/*
+ * Ask for BLOCK to be loaded into the cache in the background. This
+ * never waits for I/O. If the queue is full the request is dropped;
+ * read-ahead that falls that far behind is not worth much anyway.
+ */
+void
+sfs_buf_readahead(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+
+	KASSERT(block < sfs->sfs_super.sp_nblocks);
+
+	lock_acquire(bc->bc_lock);
+	if (bc->bc_racount < SFS_RA_QUEUESIZE &&
+	    sfs_hash_find(bc, sfs->sfs_device, block) == NULL) {
+		bc->bc_raqueue[(bc->bc_rahead + bc->bc_racount)
+			       % SFS_RA_QUEUESIZE] = block;
+		bc->bc_racount++;
+		cv_signal(bc->bc_racv, bc->bc_lock);
+	}
+	lock_release(bc->bc_lock);
+}
+
+/*
+ * Print the cache statistics.
+ */
+void
+sfs_cache_printstats(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	unsigned used;
+
+	lock_acquire(bc->bc_lock);
+	kprintf("%s: cache: %u hits, %u misses, %u reads, %u writes\n",
+		sfs->sfs_super.sp_volname, bc->bc_hits, bc->bc_misses,
+		bc->bc_reads, bc->bc_writes);
+	used = bc->bc_rahits + bc->bc_rawasted;
+	kprintf("%s: read-ahead: %u blocks read, %u used, %u wasted "
+		"(%u%% hit rate)\n", sfs->sfs_super.sp_volname,
+		bc->bc_rareads, bc->bc_rahits, bc->bc_rawasted,
+		used > 0 ? bc->bc_rahits * 100 / used : 0);
+	kprintf("%s: delayed allocation: %u blocks waiting, %u placed\n",
+		sfs->sfs_super.sp_volname, bc->bc_ndelayed,
+		bc->bc_daassigned);
+	lock_release(bc->bc_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and teardown
+
+/*
+ * Create the buffer cache for a newly mounted filesystem.
+ */
+int
+sfs_cache_init(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc;
+	struct sfs_buf *buf;
+	unsigned i;
+	int result;
+
+	bc = kmalloc(sizeof(struct sfs_bufcache));
+	if (bc == NULL) {
+		return ENOMEM;
+	}
+	bzero(bc, sizeof(*bc));
+
+	bc->bc_lock = lock_create("sfs cache");
+	if (bc->bc_lock == NULL) {
+		kfree(bc);
+		return ENOMEM;
+	}
+	bc->bc_cv = cv_create("sfs cache");
+	if (bc->bc_cv == NULL) {
+		lock_destroy(bc->bc_lock);
+		kfree(bc);
+		return ENOMEM;
+	}
+	bc->bc_racv = cv_create("sfs readahead");
+	if (bc->bc_racv == NULL) {
+		cv_destroy(bc->bc_cv);
+		lock_destroy(bc->bc_lock);
+		kfree(bc);
+		return ENOMEM;
+	}
+
+	bc->bc_bufs = kmalloc(SFS_CACHE_NBUFS * sizeof(struct sfs_buf));
+	if (bc->bc_bufs == NULL) {
+		goto fail;
+	}
+	bzero(bc->bc_bufs, SFS_CACHE_NBUFS * sizeof(struct sfs_buf));
+
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		buf = &bc->bc_bufs[i];
+		buf->sb_data = kmalloc(SFS_BLOCKSIZE);
+		if (buf->sb_data == NULL) {
+			while (i-- > 0) {
+				kfree(bc->bc_bufs[i].sb_data);
+			}
+			kfree(bc->bc_bufs);
+			goto fail;
+		}
+		sfs_lru_addhead(bc, buf);
+	}
+
+	sfs->sfs_cache = bc;
+
+	result = thread_fork("sfs readahead", sfs_readahead_thread, sfs, 0,
+			     NULL);
+	if (result) {
+		for (i=0; i<SFS_CACHE_NBUFS; i++) {
+			kfree(bc->bc_bufs[i].sb_data);
+		}
+		kfree(bc->bc_bufs);
+		sfs->sfs_cache = NULL;
+		cv_destroy(bc->bc_racv);
+		cv_destroy(bc->bc_cv);
+		lock_destroy(bc->bc_lock);
+		kfree(bc);
+		return result;
+	}
+	return 0;
+
+ fail:
+	cv_destroy(bc->bc_racv);
+	cv_destroy(bc->bc_cv);
+	lock_destroy(bc->bc_lock);
+	kfree(bc);
+	return ENOMEM;
+}
+
+/*
+ * Tear down the buffer cache at unmount time. The filesystem must
+ * already have been synced.
+ */
+void
+sfs_cache_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_bufcache *bc = sfs->sfs_cache;
+	unsigned i;
+
+	/* Stop the read-ahead thread; it may be in the middle of a read */
+	lock_acquire(bc->bc_lock);
+	bc->bc_raexit = true;
+	cv_broadcast(bc->bc_racv, bc->bc_lock);
+	while (!bc->bc_radone) {
+		cv_wait(bc->bc_racv, bc->bc_lock);
+	}
+	lock_release(bc->bc_lock);
+
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		KASSERT(bc->bc_bufs[i].sb_refcount == 0);
+		KASSERT(bc->bc_bufs[i].sb_dirty == false);
+		KASSERT(bc->bc_bufs[i].sb_vnode == NULL);
+		kfree(bc->bc_bufs[i].sb_data);
+	}
+	kfree(bc->bc_bufs);
+	cv_destroy(bc->bc_racv);
+	cv_destroy(bc->bc_cv);
+	lock_destroy(bc->bc_lock);
+	kfree(bc);
+	sfs->sfs_cache = NULL;
+}
@@ -39,6 +39,9 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -49,8 +52,6 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
  *
  * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
  * bits, one bit for each sector on the filesystem. The number of
@@ -63,13 +64,21 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * The bitmap sectors are consecutive both on disk and in memory, so
+ * they move in transfers of up to SFS_MAXRUN sectors. Reading loads
+ * the whole bitmap. Writing only writes the sectors marked in
+ * sfs_mapdirty (the allocator marks them as it changes bits), and
+ * then unmarks them.
  */
 
 static
 int
 sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
-	uint32_t j, mapsize;
+	struct iovec iov;
+	struct uio ku;
+	uint32_t j, n, i, mapsize;
 	char *bitdata;
 	int result;
 
@@ -78,29 +87,86 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 	/* Pointer to our bitmap data in memory. */
 	bitdata = bitmap_getdata(sfs->sfs_freemap);
-	
-	/* For each sector in the bitmap... */
-	for (j=0; j<mapsize; j++) {
-
-		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
 
-		/* and read or write it. The bitmap starts at sector 2. */ 
-		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+	for (j=0; j<mapsize; j+=n) {
+		/* Find a run of sectors to transfer, starting at J */
+		n = 0;
+		while (j+n < mapsize && n < SFS_MAXRUN &&
+		       (rw == UIO_READ ||
+			bitmap_isset(sfs->sfs_mapdirty, j+n))) {
+			n++;
 		}
-		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+		if (n == 0) {
+			/* Clean; skip it */
+			n = 1;
+			continue;
 		}
 
+		/* The bitmap starts at sector 2. */
+		uio_kinit(&iov, &ku, bitdata + j*SFS_BLOCKSIZE,
+			  n*SFS_BLOCKSIZE,
+			  (off_t)(SFS_MAP_LOCATION+j)*SFS_BLOCKSIZE, rw);
+		result = sfs_rwblock(sfs, &ku);
+
 		/* If we failed, stop. */
 		if (result) {
 			return result;
 		}
+
+		if (rw == UIO_WRITE) {
+			for (i=0; i<n; i++) {
+				bitmap_unmark(sfs->sfs_mapdirty, j+i);
+			}
+		}
 	}
 	return 0;
 }
 
+/*
+ * Write out the parts of the freemap that have changed. Call with
+ * sfs_freemaplock held.
+ */
+int
+sfs_mapflush(struct sfs_fs *sfs)
+{
+	int result;
+
+	result = sfs_mapio(sfs, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_freemapdirty = false;
+	return 0;
+}
+
+/*
+ * Count the free blocks in each allocation region, for the allocator
+ * to steer by. Called at mount time, after the bitmap is loaded.
+ */
+static
+int
+sfs_regions_init(struct sfs_fs *sfs)
+{
+	uint32_t nblocks, i;
+
+	nblocks = sfs->sfs_super.sp_nblocks;
+	sfs->sfs_nregions = DIVROUNDUP(nblocks, SFS_REGIONBLOCKS);
+	sfs->sfs_regionfree = kmalloc(sfs->sfs_nregions * sizeof(uint32_t));
+	if (sfs->sfs_regionfree == NULL) {
+		return ENOMEM;
+	}
+	bzero(sfs->sfs_regionfree, sfs->sfs_nregions * sizeof(uint32_t));
+	sfs->sfs_nfree = 0;
+	for (i=0; i<nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_regionfree[i / SFS_REGIONBLOCKS]++;
+			sfs->sfs_nfree++;
+		}
+	}
+	sfs->sfs_nreserved = 0;
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,6 +177,7 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct vnodearray *snap;
 	unsigned i, num;
 	int result;
 
@@ -148,22 +215,74 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Go over the table of loaded vnodes, pushing each one's
+	 * delayed blocks and inode into the buffer cache. Take a
+	 * referenced copy of the table first, so we don't hold the
+	 * vnode table lock while doing it (it takes vnode locks,
+	 * which come before the table lock).
+	 *
+	 * This takes vnode locks with vfs_biglock held, as the other
+	 * vnode operations do. sfs_read and sfs_write hold a vnode
+	 * lock without the biglock while copying to or from user
+	 * memory, which can page; that's safe because swap I/O never
+	 * takes the biglock (see swap_io).
+	 */
+	snap = vnodearray_create();
+	if (snap == NULL) {
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	lock_acquire(sfs->sfs_vnlock);
+	result = vnodearray_setsize(snap, sfs->sfs_nvnodes);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(snap);
+		vfs_biglock_release();
+		return result;
+	}
+	num = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		struct sfs_vnode *sv = sfs->sfs_vnhash[i];
+
+		for (; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_v);
+			vnodearray_set(snap, num++, &sv->sv_v);
+		}
+	}
+	KASSERT(num == sfs->sfs_nvnodes);
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(snap, i);
+		sfs_flushvnode(v);
+		VOP_DECREF(v);
 	}
+	vnodearray_setsize(snap, 0);
+	vnodearray_destroy(snap);
 
-	/* If the free block map needs to be written, write it. */
+	/*
+	 * Write out the modified blocks in the buffer cache. With a
+	 * journal, this commits the metadata (freemap included) and
+	 * writes it home.
+	 */
+	result = sfs_jcommit(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* If the free block map still needs to be written, write it. */
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+		result = sfs_mapflush(sfs);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			vfs_biglock_release();
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
@@ -179,6 +298,85 @@ sfs_sync(struct fs *fs)
 	return 0;
 }
 
+/*
+ * Syncer thread.
+ *
+ * One of these runs per mounted sfs. It wakes up once a second; every
+ * sfs_syncer_interval seconds it syncs the whole filesystem, and in
+ * between it flushes the buffer cache (committing the journal) early
+ * if too many buffers are dirty. Unmount tells it to go away by
+ * setting sy_exit.
+ */
+
+unsigned sfs_syncer_interval = SFS_SYNCER_INTERVAL;
+unsigned sfs_syncer_dirtymax = SFS_SYNCER_DIRTYMAX;
+
+static
+void
+sfs_syncer_thread(void *data, unsigned long junk)
+{
+	struct sfs_syncer *sy = data;
+	struct sfs_fs *sfs;
+	unsigned ticks = 0;
+	int result;
+
+	(void)junk;
+
+	while (1) {
+		clocksleep(1);
+
+		vfs_biglock_acquire();
+		if (sy->sy_exit) {
+			vfs_biglock_release();
+			kfree(sy);
+			return;
+		}
+		sfs = sy->sy_fs;
+
+		ticks++;
+		result = 0;
+		if (ticks >= sfs_syncer_interval) {
+			result = sfs_sync(&sfs->sfs_absfs);
+			ticks = 0;
+		}
+		else if (sfs->sfs_cache->bc_ndirty >= sfs_syncer_dirtymax) {
+			result = sfs_jcommit(sfs);
+		}
+		if (result) {
+			kprintf("sfs: %s: syncer: %s\n",
+				sfs->sfs_super.sp_volname, strerror(result));
+		}
+
+		vfs_biglock_release();
+	}
+}
+
+/*
+ * Start the syncer for a newly mounted filesystem.
+ */
+static
+int
+sfs_syncer_start(struct sfs_fs *sfs)
+{
+	struct sfs_syncer *sy;
+	int result;
+
+	sy = kmalloc(sizeof(struct sfs_syncer));
+	if (sy == NULL) {
+		return ENOMEM;
+	}
+	sy->sy_fs = sfs;
+	sy->sy_exit = false;
+
+	result = thread_fork("sfs syncer", sfs_syncer_thread, sy, 0, NULL);
+	if (result) {
+		kfree(sy);
+		return result;
+	}
+	sfs->sfs_syncer = sy;
+	return 0;
+}
+
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
@@ -212,18 +410,34 @@ sfs_unmount(struct fs *fs)
 	vfs_biglock_acquire();
 	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_nreserved == 0);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+
+	/* Detach the syncer; it frees its own state when it notices. */
+	sfs->sfs_syncer->sy_exit = true;
+	sfs->sfs_syncer->sy_fs = NULL;
+	sfs->sfs_syncer = NULL;
+
+	kfree(sfs->sfs_vnhash);
+	kfree(sfs->sfs_regionfree);
+	bitmap_destroy(sfs->sfs_mapdirty);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	sfs_cache_destroy(sfs);
+	sfs_journal_destroy(sfs);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -254,6 +468,7 @@ static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
+	unsigned i;
 	int result;
 	struct sfs_fs *sfs;
 
@@ -267,6 +482,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 */
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(struct sfs_extinode)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(struct sfs_inlineinode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
@@ -289,9 +506,32 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate vnode table */
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+
+	/* Allocate locks */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		kfree(sfs->sfs_vnhash);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
@@ -303,7 +543,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -316,7 +558,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
@@ -330,18 +574,77 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/* Set up the journal, and replay it if need be */
+	result = sfs_journal_load(sfs);
+	if (result) {
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
-	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+	sfs->sfs_mapdirty = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_mapdirty == NULL) {
+		if (sfs->sfs_freemap != NULL) {
+			bitmap_destroy(sfs->sfs_freemap);
+		}
+		if (sfs->sfs_mapdirty != NULL) {
+			bitmap_destroy(sfs->sfs_mapdirty);
+		}
+		sfs_journal_destroy(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
+	if (result == 0) {
+		result = sfs_regions_init(sfs);
+	}
+	if (result) {
+		bitmap_destroy(sfs->sfs_mapdirty);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_journal_destroy(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* Set up the buffer cache */
+	result = sfs_cache_init(sfs);
+	if (result) {
+		kfree(sfs->sfs_regionfree);
+		bitmap_destroy(sfs->sfs_mapdirty);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_journal_destroy(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* Start writing back dirty blocks in the background */
+	result = sfs_syncer_start(sfs);
 	if (result) {
+		sfs_cache_destroy(sfs);
+		kfree(sfs->sfs_regionfree);
+		bitmap_destroy(sfs->sfs_mapdirty);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_journal_destroy(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		kfree(sfs->sfs_vnhash);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -374,3 +677,35 @@ sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+/*
+ * Print statistics for the sfs mounted on DEVICE. Called from the
+ * kernel menu.
+ */
+int
+sfs_stats(const char *device)
+{
+	struct vnode *root;
+	struct fs *fs;
+	int result;
+
+	vfs_biglock_acquire();
+	result = vfs_getroot(device, &root);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	fs = root->vn_fs;
+	if (fs == NULL || fs->fs_sync != sfs_sync) {
+		kprintf("%s: not an sfs volume\n", device);
+		result = EINVAL;
+	}
+	else {
+		sfs_cache_printstats(fs->fs_data);
+		sfs_journal_printstats(fs->fs_data);
+	}
+	vfs_biglock_release();
+
+	VOP_DECREF(root);
+	return result;
+}
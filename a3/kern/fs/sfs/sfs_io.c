@@ -43,6 +43,9 @@
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
+//
+// These do not need the vfs biglock; callers synchronize on the
+// buffer cache lock, a vnode lock or the freemap lock as needed.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,8 +53,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -0,0 +1,760 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Without a journal a crash can leave metadata half updated: a
+ * directory entry naming an inode that was never written, a block
+ * both free in the bitmap and in use by a file, and so on. With one,
+ * every change to metadata (inodes, indirect and extent blocks,
+ * directory blocks, and the freemap) becomes durable all together.
+ *
+ * This is a physical redo log (see kern/sfs.h for the on-disk
+ * format). Modified metadata buffers are marked sb_meta and stay in
+ * the cache. Now and then the whole batch is committed:
+ *
+ *   1. wait until no operation is in progress;
+ *   2. write out file data, so committed metadata never points at
+ *      blocks that haven't been written;
+ *   3. copy every sb_meta buffer and dirty freemap block into the
+ *      log, followed by a commit record;
+ *   4. write them all to their homes;
+ *   5. bump the sequence number in the log header, emptying it.
+ *
+ * A crash before step 3 finishes loses the batch but leaves the old
+ * state intact; a crash after it is repaired at mount time by
+ * replaying the log. Since each commit covers every operation done
+ * since the last, callers that want one while one is already
+ * pending just wait for it, so the syncer, fsync and other callers
+ * share commits rather than queueing up.
+ *
+ * Every vnode operation that changes metadata runs between
+ * sfs_jbegin and sfs_jend, so a commit never sees one half done.
+ * Blocks freed by an operation are not returned to the freemap until
+ * the commit that covers it; otherwise they could be reused and
+ * overwritten while the committed metadata still points at them.
+ *
+ * A batch too big for the log is written straight to its homes, and
+ * metadata is written early if the cache runs out of other buffers
+ * to recycle. Both cost crash safety only for that batch; sfs_jbegin
+ * commits before too much accumulates so they stay rare.
+ *
+ * Locking: j_lock protects the handle count and commit state. A
+ * handle is taken before any vnode lock (see sfs.h). The commit
+ * itself takes sfs_vnlock, sfs_freemaplock and the cache lock but
+ * never a vnode lock or the vfs biglock, so it can always finish.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <synch.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+
+/* Shortcut for the size macro in kern/sfs.h */
+#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+
+/* Number of blocks listed in each descriptor we write */
+#define SFS_JPERDESC  (SFS_JOURNAL_RUN - 1)
+
+////////////////////////////////////////////////////////////
+//
+// Log I/O
+
+/*
+ * Read or write NBLOCKS blocks of the log, starting POS blocks in.
+ */
+static
+int
+sfs_jio(struct sfs_fs *sfs, void *data, uint32_t pos, uint32_t nblocks,
+	enum uio_rw rw)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(pos + nblocks <= j->j_nblocks);
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  (off_t)(j->j_start + pos) * SFS_BLOCKSIZE, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Fill in a log record. The rest of the block should already be
+ * zeroed (or hold the descriptor's block list).
+ */
+static
+void
+sfs_jrecord(struct sfs_jblock *jb, uint32_t type, uint32_t seq,
+	    uint32_t count)
+{
+	jb->sj_magic = SFS_JMAGIC;
+	jb->sj_type = type;
+	jb->sj_seq = seq;
+	jb->sj_count = count;
+}
+
+/*
+ * Check if a block read from the log is a record of type TYPE from
+ * transaction SEQ.
+ */
+static
+bool
+sfs_jcheck(const struct sfs_jblock *jb, uint32_t type, uint32_t seq)
+{
+	return jb->sj_magic == SFS_JMAGIC && jb->sj_type == type &&
+		jb->sj_seq == seq;
+}
+
+/*
+ * Check that a descriptor only sends blocks to places they could
+ * legitimately have come from.
+ */
+static
+bool
+sfs_jcheckdesc(struct sfs_fs *sfs, const struct sfs_jblock *jb)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t i, home;
+
+	if (jb->sj_count == 0 || jb->sj_count > SFS_JDESCBLOCKS) {
+		return false;
+	}
+	for (i=0; i<jb->sj_count; i++) {
+		home = jb->sj_blocks[i];
+		if (home >= sfs->sfs_super.sp_nblocks ||
+		    home == SFS_SB_LOCATION ||
+		    (home >= j->j_start && home < j->j_start + j->j_nblocks)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Write the log header for transaction SEQ, which empties the log.
+ */
+static
+int
+sfs_jempty(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	bzero(j->j_run, SFS_BLOCKSIZE);
+	sfs_jrecord(j->j_run, SFS_JTYPE_HEADER, seq, 0);
+	return sfs_jio(sfs, j->j_run, 0, 1, UIO_WRITE);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Recovery
+
+/*
+ * Called at mount time, before the freemap is loaded: if the log holds
+ * a committed transaction, copy its blocks home. Either way, move on
+ * to a new sequence number so leftovers are never mistaken for part
+ * of a later transaction.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jblock *jb, *desc;
+	uint32_t seq, pos, total, i, n, k;
+	bool committed;
+	int result;
+
+	jb = j->j_run;
+	result = sfs_jio(sfs, jb, 0, 1, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (jb->sj_magic != SFS_JMAGIC || jb->sj_type != SFS_JTYPE_HEADER) {
+		kprintf("sfs: %s: bad journal header\n",
+			sfs->sfs_super.sp_volname);
+		return EINVAL;
+	}
+	seq = jb->sj_seq;
+
+	/* Pass 1: see if the transaction got as far as its commit record */
+	committed = false;
+	total = 0;
+	pos = 1;
+	while (pos < j->j_nblocks) {
+		result = sfs_jio(sfs, jb, pos, 1, UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (sfs_jcheck(jb, SFS_JTYPE_COMMIT, seq)) {
+			committed = (jb->sj_count == total && total > 0);
+			break;
+		}
+		if (!sfs_jcheck(jb, SFS_JTYPE_DESC, seq) ||
+		    !sfs_jcheckdesc(sfs, jb) ||
+		    pos + 1 + jb->sj_count >= j->j_nblocks) {
+			break;
+		}
+		total += jb->sj_count;
+		pos += 1 + jb->sj_count;
+	}
+
+	/* Pass 2: copy the blocks home */
+	if (committed) {
+		desc = kmalloc(sizeof(*desc));
+		if (desc == NULL) {
+			return ENOMEM;
+		}
+		pos = 1;
+		while (1) {
+			result = sfs_jio(sfs, desc, pos, 1, UIO_READ);
+			if (result) {
+				kfree(desc);
+				return result;
+			}
+			if (desc->sj_type == SFS_JTYPE_COMMIT) {
+				break;
+			}
+			for (i=0; i<desc->sj_count; i+=n) {
+				n = desc->sj_count - i;
+				if (n > SFS_JOURNAL_RUN) {
+					n = SFS_JOURNAL_RUN;
+				}
+				result = sfs_jio(sfs, j->j_run, pos+1+i, n,
+						 UIO_READ);
+				if (result) {
+					kfree(desc);
+					return result;
+				}
+				for (k=0; k<n; k++) {
+					result = sfs_wblock(sfs,
+						(char *)j->j_run + k*SFS_BLOCKSIZE,
+						desc->sj_blocks[i+k]);
+					if (result) {
+						kfree(desc);
+						return result;
+					}
+				}
+			}
+			pos += 1 + desc->sj_count;
+		}
+		kfree(desc);
+		kprintf("sfs: %s: replayed %u blocks from the journal\n",
+			sfs->sfs_super.sp_volname, total);
+	}
+
+	j->j_seq = seq + 1;
+	return sfs_jempty(sfs, j->j_seq);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit
+
+/*
+ * Hand the blocks freed since the last commit back to the freemap.
+ * Call with sfs_freemaplock held.
+ */
+static
+void
+sfs_jfree_release(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t block;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	if (j->j_nfreed == 0) {
+		return;
+	}
+	for (block = j->j_freedlo; block <= j->j_freedhi; block++) {
+		if (bitmap_isset(j->j_freed, block)) {
+			bitmap_unmark(j->j_freed, block);
+			sfs_bunmark(sfs, block);
+		}
+	}
+	j->j_nfreed = 0;
+}
+
+/*
+ * Copy the first NBUFS buffers in j_bufs, then the dirty freemap
+ * blocks, into the log as transaction j_seq, and commit it. Call
+ * with sfs_freemaplock held.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs, unsigned nbufs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jblock *jb = j->j_run;
+	char *mapdata, *data;
+	uint32_t mapsize, map, pos, total, n, home;
+	unsigned b;
+	int result;
+
+	mapdata = bitmap_getdata(sfs->sfs_freemap);
+	mapsize = SFS_FS_BITBLOCKS(sfs);
+	b = 0;
+	map = 0;
+	total = 0;
+	pos = 1;
+
+	while (1) {
+		/* Fill a descriptor and the copies that follow it */
+		bzero(jb, SFS_BLOCKSIZE);
+		for (n=0; n<SFS_JPERDESC; n++) {
+			if (b < nbufs) {
+				home = j->j_bufs[b]->sb_block;
+				data = j->j_bufs[b]->sb_data;
+				b++;
+			}
+			else {
+				while (map < mapsize &&
+				       !bitmap_isset(sfs->sfs_mapdirty, map)) {
+					map++;
+				}
+				if (map == mapsize) {
+					break;
+				}
+				home = SFS_MAP_LOCATION + map;
+				data = mapdata + map * SFS_BLOCKSIZE;
+				map++;
+			}
+			jb->sj_blocks[n] = home;
+			memcpy((char *)j->j_run + (n+1) * SFS_BLOCKSIZE, data,
+			       SFS_BLOCKSIZE);
+		}
+		if (n == 0) {
+			break;
+		}
+		sfs_jrecord(jb, SFS_JTYPE_DESC, j->j_seq, n);
+		result = sfs_jio(sfs, j->j_run, pos, n+1, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		pos += n+1;
+		total += n;
+	}
+
+	bzero(jb, SFS_BLOCKSIZE);
+	sfs_jrecord(jb, SFS_JTYPE_COMMIT, j->j_seq, total);
+	result = sfs_jio(sfs, jb, pos, 1, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	j->j_logged += total;
+	return 0;
+}
+
+/*
+ * Do a commit. No operations are in progress, and none can start
+ * until we're done.
+ */
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned nbufs, i;
+	uint32_t nmap, need;
+	bool logged;
+	int result, result2;
+
+	/* Get the inodes into the cache, then write out file data */
+	result = sfs_sync_inodes(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_buf_flush(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* Blocks freed by the operations being committed are free now */
+	sfs_jfree_release(sfs);
+
+	/* Collect everything that goes in this transaction */
+	nbufs = sfs_buf_metalist(sfs, j->j_bufs, SFS_CACHE_NBUFS);
+	nmap = 0;
+	for (i=0; i<SFS_FS_BITBLOCKS(sfs); i++) {
+		if (bitmap_isset(sfs->sfs_mapdirty, i)) {
+			nmap++;
+		}
+	}
+	if (nbufs + nmap == 0) {
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+
+	/* Log it, if it fits: header, descriptors, copies, commit */
+	need = 1 + DIVROUNDUP(nbufs + nmap, SFS_JPERDESC) + nbufs + nmap + 1;
+	logged = need <= j->j_nblocks;
+	if (logged) {
+		result = sfs_jwrite(sfs, nbufs);
+		if (result) {
+			/* Nothing went home; leave it all for next time */
+			for (i=0; i<nbufs; i++) {
+				sfs_buf_release(sfs, j->j_bufs[i]);
+			}
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+	else {
+		j->j_overflows++;
+	}
+
+	/* Write everything home */
+	for (i=0; i<nbufs; i++) {
+		result2 = sfs_buf_checkpoint(sfs, j->j_bufs[i]);
+		if (result2 && !result) {
+			result = result2;
+		}
+	}
+	if (sfs->sfs_freemapdirty) {
+		result2 = sfs_mapflush(sfs);
+		if (result2 && !result) {
+			result = result2;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/*
+	 * Empty the log. If anything failed to go home, leave it full,
+	 * so the next mount can finish the job.
+	 */
+	if (logged && result == 0) {
+		result = sfs_jempty(sfs, j->j_seq + 1);
+		if (result == 0) {
+			j->j_seq++;
+		}
+	}
+	return result;
+}
+
+/*
+ * Commit everything done so far. If a commit is already pending, it
+ * covers our changes too, so just wait for it.
+ *
+ * Without a journal, this just flushes the buffer cache.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned ncommits;
+	int result;
+
+	if (j == NULL) {
+		return sfs_buf_flush(sfs);
+	}
+
+	lock_acquire(j->j_lock);
+	if (j->j_committing) {
+		ncommits = j->j_ncommits;
+		while (j->j_ncommits == ncommits) {
+			cv_wait(j->j_cv, j->j_lock);
+		}
+		result = j->j_result;
+		lock_release(j->j_lock);
+		return result;
+	}
+	j->j_committing = true;
+	while (j->j_active > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_locked = true;
+	lock_release(j->j_lock);
+
+	result = sfs_jdocommit(sfs);
+
+	lock_acquire(j->j_lock);
+	j->j_committing = false;
+	j->j_locked = false;
+	j->j_ncommits++;
+	j->j_result = result;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Operations
+
+/*
+ * Start an operation that may change metadata. Waits out any commit
+ * in progress or pending, and forces one first if too much of the
+ * cache is already waiting for one.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return;
+	}
+
+	/* (Unlocked peek; being off by a few doesn't matter) */
+	if (sfs->sfs_cache->bc_nmeta >= j->j_pinmax) {
+		result = sfs_jcommit(sfs);
+		if (result) {
+			kprintf("sfs: %s: journal commit: %s\n",
+				sfs->sfs_super.sp_volname, strerror(result));
+		}
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_committing) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_active++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Start an operation that may already be inside another one; used by
+ * reclaim, which can run from the middle of remove or rename. It only
+ * waits for a commit that has actually started, as a pending one is
+ * waiting for the outer operation to finish.
+ */
+void
+sfs_jjoin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_locked) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_active++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Finish an operation.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	j->j_active--;
+	if (j->j_active == 0 && j->j_committing) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Free BLOCK at the next commit rather than now. Returns false if
+ * there's no journal, in which case the caller should free it right
+ * away. Call with sfs_freemaplock held.
+ */
+bool
+sfs_jfree(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	if (j == NULL) {
+		return false;
+	}
+
+	KASSERT(!bitmap_isset(j->j_freed, block));
+	bitmap_mark(j->j_freed, block);
+	if (j->j_nfreed == 0 || block < j->j_freedlo) {
+		j->j_freedlo = block;
+	}
+	if (j->j_nfreed == 0 || block > j->j_freedhi) {
+		j->j_freedhi = block;
+	}
+	j->j_nfreed++;
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and teardown
+
+/*
+ * Set up the journal for a volume being mounted, if it has one, and
+ * replay it. Called after the superblock is read and before anything
+ * else is loaded.
+ */
+int
+sfs_journal_load(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_journal *j;
+	int result;
+
+	sfs->sfs_journal = NULL;
+	if (sp->sp_journalblocks == 0) {
+		return 0;
+	}
+	if (sp->sp_journalstart < SFS_MAP_LOCATION + SFS_FS_BITBLOCKS(sfs) ||
+	    sp->sp_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+	    sp->sp_journalstart + sp->sp_journalblocks > sp->sp_nblocks ||
+	    sp->sp_journalstart + sp->sp_journalblocks < sp->sp_journalstart) {
+		kprintf("sfs: %s: bad journal location %u (%u blocks)\n",
+			sp->sp_volname, sp->sp_journalstart,
+			sp->sp_journalblocks);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(struct sfs_journal));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	bzero(j, sizeof(*j));
+	j->j_start = sp->sp_journalstart;
+	j->j_nblocks = sp->sp_journalblocks;
+
+	/* Don't let more pile up than the log can take in one go */
+	j->j_pinmax = (j->j_nblocks - 1) / 4;
+	if (j->j_pinmax > SFS_JOURNAL_PINMAX) {
+		j->j_pinmax = SFS_JOURNAL_PINMAX;
+	}
+	if (j->j_pinmax == 0) {
+		j->j_pinmax = 1;
+	}
+
+	j->j_bufs = kmalloc(SFS_CACHE_NBUFS * sizeof(struct sfs_buf *));
+	if (j->j_bufs == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	j->j_run = kmalloc(SFS_JOURNAL_RUN * SFS_BLOCKSIZE);
+	if (j->j_run == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	j->j_lock = lock_create("sfs journal");
+	if (j->j_lock == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	j->j_cv = cv_create("sfs journal");
+	if (j->j_cv == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	j->j_freed = bitmap_create(sp->sp_nblocks);
+	if (j->j_freed == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	sfs->sfs_journal = j;
+	result = sfs_jreplay(sfs);
+	if (result) {
+		sfs->sfs_journal = NULL;
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	if (j->j_freed != NULL) {
+		bitmap_destroy(j->j_freed);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j->j_run);
+	kfree(j->j_bufs);
+	kfree(j);
+	return result;
+}
+
+/*
+ * Tear down the journal at unmount time (or when mount fails).
+ */
+void
+sfs_journal_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_active == 0);
+	KASSERT(j->j_nfreed == 0);
+
+	bitmap_destroy(j->j_freed);
+	cv_destroy(j->j_cv);
+	lock_destroy(j->j_lock);
+	kfree(j->j_run);
+	kfree(j->j_bufs);
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
+
+/*
+ * Print journal statistics.
+ */
+void
+sfs_journal_printstats(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		kprintf("%s: no journal\n", sfs->sfs_super.sp_volname);
+		return;
+	}
+	lock_acquire(j->j_lock);
+	kprintf("%s: journal: %u commits, %u blocks logged, %u too big; "
+		"%u blocks written early\n", sfs->sfs_super.sp_volname,
+		j->j_ncommits, j->j_logged, j->j_overflows,
+		sfs->sfs_cache->bc_early);
+	lock_release(j->j_lock);
+}
@@ -49,18 +49,33 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/*
+ * Values of DOALLOC for sfs_bmap and friends. New data blocks are
+ * zeroed unless the caller promises to overwrite them entirely;
+ * indirect blocks and extent blocks always are.
+ */
+#define SFS_ALLOC_ZERO    1	/* fill holes with zeroed blocks */
+#define SFS_ALLOC_NOZERO  2	/* fill holes; caller overwrites them */
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block (in the cache; it is written back later). */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buf->sb_data, SFS_BLOCKSIZE);
+	sfs_buf_markdirty(sfs, buf);
+	return sfs_buf_release(sfs, buf);
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -70,7 +85,21 @@ sfs_sync_inode(struct sfs_vnode *sv)
 {
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct sfs_buf *buf;
+		int result;
+
+		/*
+		 * The inode fills its block, so no need to read it
+		 * first. This only updates the cache; the syncer or
+		 * the next sync writes it to disk.
+		 */
+		result = sfs_buf_get(sfs, sv->sv_ino, &buf);
+		if (result) {
+			return result;
+		}
+		memcpy(buf->sb_data, &sv->sv_i, sizeof(sv->sv_i));
+		sfs_buf_markmeta(sfs, buf);
+		result = sfs_buf_release(sfs, buf);
 		if (result) {
 			return result;
 		}
@@ -79,42 +108,268 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+/*
+ * Note that a buffer of an object's contents was changed. The
+ * contents of a directory are metadata; those of a file are not.
+ */
+static
+void
+sfs_markcontents(struct sfs_vnode *sv, struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_buf_markmeta(sfs, buf);
+	}
+	else {
+		sfs_buf_markdirty(sfs, buf);
+	}
+}
+
+/*
+ * Push every modified inode into the buffer cache. This is for the
+ * journal, which calls it while no operation is in progress: nobody
+ * is changing inodes then, so the vnode locks aren't needed.
+ */
+int
+sfs_sync_inodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			result = sfs_sync_inode(sv);
+			if (result) {
+				lock_release(sfs->sfs_vnlock);
+				return result;
+			}
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
 
 /*
- * Allocate a block.
+ * Account for BLOCK's bit in the freemap having just been set (USED)
+ * or cleared: keep the free counts in step, and remember that the
+ * bitmap block holding the bit needs writing. Call with
+ * sfs_freemaplock held.
+ */
+static
+void
+sfs_bnote(struct sfs_fs *sfs, uint32_t block, bool used)
+{
+	uint32_t mapblock = block / SFS_BLOCKBITS;
+
+	if (used) {
+		KASSERT(sfs->sfs_regionfree[block / SFS_REGIONBLOCKS] > 0);
+		sfs->sfs_regionfree[block / SFS_REGIONBLOCKS]--;
+		sfs->sfs_nfree--;
+	}
+	else {
+		sfs->sfs_regionfree[block / SFS_REGIONBLOCKS]++;
+		sfs->sfs_nfree++;
+	}
+	if (!bitmap_isset(sfs->sfs_mapdirty, mapblock)) {
+		bitmap_mark(sfs->sfs_mapdirty, mapblock);
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Mark or unmark a block in the freemap. Call with sfs_freemaplock
+ * held.
+ */
+static
+void
+sfs_bmark(struct sfs_fs *sfs, uint32_t block)
+{
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs_bnote(sfs, block, true);
+}
+
+void
+sfs_bunmark(struct sfs_fs *sfs, uint32_t block)
+{
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs_bnote(sfs, block, false);
+}
+
+/*
+ * Return the first block of the region with the most free blocks.
+ * Call with sfs_freemaplock held.
+ */
+static
+uint32_t
+sfs_region_emptiest(struct sfs_fs *sfs)
+{
+	unsigned i, best;
+
+	best = 0;
+	for (i=1; i<sfs->sfs_nregions; i++) {
+		if (sfs->sfs_regionfree[i] > sfs->sfs_regionfree[best]) {
+			best = i;
+		}
+	}
+	return best * SFS_REGIONBLOCKS;
+}
+
+/*
+ * Allocate a run of up to WANT consecutive blocks. Start at the first
+ * free block at or after GOAL; GOAL 0 means no preference, and picks
+ * the emptiest region. Regions with nothing free are skipped without
+ * touching the bitmap. Then take as many of the blocks after the
+ * first as are free, up to WANT. Hands back the first block and the
+ * number allocated, which is at least one.
+ *
+ * If CLEAR is set the blocks are zeroed. Otherwise they hold whatever
+ * was on disk, and the caller must overwrite all of them.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc_run(struct sfs_fs *sfs, uint32_t goal, uint32_t want, bool clear,
+	       uint32_t *diskblock, uint32_t *count)
 {
+	uint32_t start, n, i;
+	unsigned region, tries;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	KASSERT(want > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	/* Blocks reserved for delayed buffers are spoken for */
+	if (sfs->sfs_nfree <= sfs->sfs_nreserved) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	if (want > sfs->sfs_nfree - sfs->sfs_nreserved) {
+		want = sfs->sfs_nfree - sfs->sfs_nreserved;
+	}
+	if (goal == 0 || goal >= sfs->sfs_super.sp_nblocks) {
+		goal = sfs_region_emptiest(sfs);
+	}
+	region = goal / SFS_REGIONBLOCKS;
+	for (tries = 0; sfs->sfs_regionfree[region] == 0; tries++) {
+		if (tries == sfs->sfs_nregions) {
+			lock_release(sfs->sfs_freemaplock);
+			return ENOSPC;
+		}
+		region = (region + 1) % sfs->sfs_nregions;
+		goal = region * SFS_REGIONBLOCKS;
+	}
+	result = bitmap_alloc_from(sfs->sfs_freemap, goal, &start);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	if (start >= sfs->sfs_super.sp_nblocks) {
+		panic("sfs: balloc: invalid block %u\n", start);
+	}
+	/* bitmap_alloc_from marked it already */
+	sfs_bnote(sfs, start, true);
+	n = 1;
+	while (n < want && start + n < sfs->sfs_super.sp_nblocks &&
+	       !bitmap_isset(sfs->sfs_freemap, start + n)) {
+		sfs_bmark(sfs, start + n);
+		n++;
+	}
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
-		panic("sfs: balloc: invalid block %u\n", *diskblock);
+	/* Clear the blocks before returning them */
+	for (i=0; clear && i<n; i++) {
+		result = sfs_clearblock(sfs, start + i);
+		if (result) {
+			/* Give them all back, as sfs_bfree would */
+			for (i=0; i<n; i++) {
+				sfs_buf_invalidate(sfs, start + i);
+			}
+			lock_acquire(sfs->sfs_freemaplock);
+			for (i=0; i<n; i++) {
+				sfs_bunmark(sfs, start + i);
+			}
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
 	}
 
-	/* Clear block before returning it */
-	return sfs_clearblock(sfs, *diskblock);
+	*diskblock = start;
+	*count = n;
+	return 0;
+}
+
+/*
+ * Allocate a block, as close after GOAL as possible, zeroed if CLEAR
+ * is set.
+ */
+static
+int
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, bool clear, uint32_t *diskblock)
+{
+	uint32_t count;
+
+	return sfs_balloc_run(sfs, goal, 1, clear, diskblock, &count);
 }
 
 /*
- * Free a block.
+ * Free a block. With a journal it only becomes allocatable again at
+ * the next commit (see sfs_jfree).
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	/*
+	 * Drop any cached copy before the block becomes allocatable
+	 * again, so a new owner never sees the stale buffer.
+	 */
+	sfs_buf_invalidate(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (!sfs_jfree(sfs, diskblock)) {
+		sfs_bunmark(sfs, diskblock);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Reserve N blocks for delayed buffers, so they are sure to get disk
+ * blocks later. Unless FORCE is set, this refuses once the free
+ * space not already reserved is down to SFS_DELALLOC_SLACK.
+ */
+static
+bool
+sfs_reserve(struct sfs_fs *sfs, uint32_t n, bool force)
+{
+	bool ok;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ok = force ||
+		sfs->sfs_nfree >= sfs->sfs_nreserved + n + SFS_DELALLOC_SLACK;
+	if (ok) {
+		sfs->sfs_nreserved += n;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return ok;
+}
+
+/*
+ * Give back N reserved blocks.
+ */
+static
+void
+sfs_unreserve(struct sfs_fs *sfs, uint32_t n)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_nreserved >= n);
+	sfs->sfs_nreserved -= n;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,169 +379,1216 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
-// Block mapping/inode maintenance
+// Extent mapping
+//
+// The extents of an extent-mapped file are kept in a list of
+// containers: the inode itself, then the extent blocks chained from
+// sfx_overflow. All of these must be called with the vnode lock held.
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * One container of extents, and what's needed to put it back.
+ */
+struct sfs_extlist {
+	struct sfs_buf *el_buf;         /* buffer, or NULL for the inode */
+	struct sfs_extent *el_ext;      /* the extents */
+	uint32_t *el_count;             /* number in use */
+	uint32_t el_max;                /* room for this many */
+	uint32_t *el_next;              /* link to the next extent block */
+};
+
+/*
+ * Load the container at BLOCK, or the inode if BLOCK is 0.
  */
 static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+sfs_extlist_get(struct sfs_vnode *sv, uint32_t block, struct sfs_extlist *el)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct sfs_extblock *eb;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(struct sfs_extblock) == SFS_BLOCKSIZE);
 
-	/*
-	 * If the block we want is one of the direct blocks...
-	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
+	if (block == 0) {
+		el->el_buf = NULL;
+		el->el_ext = sv->sv_x.sfx_extents;
+		el->el_count = &sv->sv_x.sfx_nextents;
+		el->el_max = SFS_NIEXTENTS;
+		el->el_next = &sv->sv_x.sfx_overflow;
+	}
+	else {
+		result = sfs_buf_read(sfs, block, &el->el_buf);
+		if (result) {
+			return result;
+		}
+		eb = el->el_buf->sb_data;
+		el->el_ext = eb->sfeb_extents;
+		el->el_count = &eb->sfeb_nextents;
+		el->el_max = SFS_NBEXTENTS;
+		el->el_next = &eb->sfeb_next;
+	}
 
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
-			}
+	if (*el->el_count > el->el_max) {
+		panic("sfs: Inode %u: %u extents in extent list at block %u\n",
+		      sv->sv_ino, *el->el_count, block);
+	}
+	return 0;
+}
 
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
-		}
+/*
+ * Done with a container; DIRTY says whether it was changed.
+ */
+static
+void
+sfs_extlist_put(struct sfs_vnode *sv, struct sfs_extlist *el, bool dirty)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
+	if (el->el_buf == NULL) {
+		if (dirty) {
+			sv->sv_dirty = true;
 		}
-		*diskblock = block;
-		return 0;
+		return;
 	}
+	if (dirty) {
+		sfs_buf_markmeta(sfs, el->el_buf);
+	}
+	sfs_buf_release(sfs, el->el_buf);
+	el->el_buf = NULL;
+}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
+/*
+ * Look up FILEBLOCK. Hands back its disk block (0 for a hole) and
+ * how many blocks from there on, up to WANT, are consecutive on disk
+ * (or are all hole).
+ */
+static
+int
+sfs_ext_find(struct sfs_vnode *sv, uint32_t fileblock, uint32_t want,
+	     uint32_t *diskblock, uint32_t *run)
+{
+	struct sfs_extlist el;
+	struct sfs_extent *e;
+	uint32_t block, i, n;
+	int result;
+
+	block = 0;
+	do {
+		result = sfs_extlist_get(sv, block, &el);
+		if (result) {
+			return result;
+		}
+		for (i=0; i<*el.el_count; i++) {
+			e = &el.el_ext[i];
+			if (fileblock < e->sfe_fileblock) {
+				/* In the hole before this extent */
+				*diskblock = 0;
+				n = e->sfe_fileblock - fileblock;
+				goto found;
+			}
+			if (fileblock - e->sfe_fileblock < e->sfe_len) {
+				n = fileblock - e->sfe_fileblock;
+				*diskblock = e->sfe_diskblock + n;
+				n = e->sfe_len - n;
+				goto found;
+			}
+		}
+		block = *el.el_next;
+		sfs_extlist_put(sv, &el, false);
+	} while (block != 0);
 
-	fileblock -= SFS_NDIRECT;
+	/* Past the last extent */
+	*diskblock = 0;
+	*run = want;
+	return 0;
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+ found:
+	sfs_extlist_put(sv, &el, false);
+	*run = n < want ? n : want;
+	return 0;
+}
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
-		return EFBIG;
-	}
+/*
+ * Insert extent NEWEXT at index IDX of the container EL. If EL is
+ * full, its last extent (or NEWEXT itself, if that goes last) moves
+ * to the front of the next extent block, or of a new one chained in
+ * after EL if the next one is full too. On success the caller must
+ * put EL back dirty.
+ */
+static
+int
+sfs_ext_insert(struct sfs_vnode *sv, struct sfs_extlist *el, uint32_t idx,
+	       const struct sfs_extent *newext)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extlist next;
+	struct sfs_extent spill;
+	uint32_t newblock, i;
+	bool havenext;
+	int result;
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	KASSERT(idx <= *el->el_count);
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
+	if (*el->el_count < el->el_max) {
+		for (i = *el->el_count; i > idx; i--) {
+			el->el_ext[i] = el->el_ext[i-1];
+		}
+		el->el_ext[idx] = *newext;
+		(*el->el_count)++;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+
+	/* Full. Find a block to take the overflow. */
+	havenext = false;
+	if (*el->el_next != 0) {
+		result = sfs_extlist_get(sv, *el->el_next, &next);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		if (*next.el_count < next.el_max) {
+			havenext = true;
+		}
+		else {
+			sfs_extlist_put(sv, &next, false);
+		}
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+	if (!havenext) {
+		result = sfs_balloc(sfs, sv->sv_ino + 1, true, &newblock);
+		if (result) {
+			return result;
+		}
+		result = sfs_extlist_get(sv, newblock, &next);
 		if (result) {
+			sfs_bfree(sfs, newblock);
 			return result;
 		}
+		/* It comes back zeroed, so it's already an empty list */
+		*next.el_next = *el->el_next;
+		*el->el_next = newblock;
+	}
+
+	if (idx == *el->el_count) {
+		spill = *newext;
+	}
+	else {
+		spill = el->el_ext[*el->el_count - 1];
+		for (i = *el->el_count - 1; i > idx; i--) {
+			el->el_ext[i] = el->el_ext[i-1];
+		}
+		el->el_ext[idx] = *newext;
+	}
+
+	for (i = *next.el_count; i > 0; i--) {
+		next.el_ext[i] = next.el_ext[i-1];
+	}
+	next.el_ext[0] = spill;
+	(*next.el_count)++;
+	sfs_extlist_put(sv, &next, true);
+
+	return 0;
+}
+
+/*
+ * Allocate up to WANT blocks for the hole at FILEBLOCK, as a single
+ * run on disk. If the extent before the hole ends right at FILEBLOCK
+ * and the disk blocks after it are free, it just gets longer;
+ * otherwise the run becomes a new extent. The first block of the run
+ * is placed after the previous extent's blocks, or after the inode.
+ * Hands back the first disk block and the number allocated.
+ */
+static
+int
+sfs_ext_alloc(struct sfs_vnode *sv, uint32_t fileblock, uint32_t want,
+	      bool clear, uint32_t *diskblock, uint32_t *count)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extlist el, next;
+	struct sfs_extent *prev, newext;
+	uint32_t idx, goal, start, n, i;
+	int result;
+
+	/*
+	 * The new extent goes in the last container whose first
+	 * extent starts before FILEBLOCK, or in the inode if none
+	 * does; that keeps the list sorted.
+	 */
+	result = sfs_extlist_get(sv, 0, &el);
+	if (result) {
+		return result;
+	}
+	while (*el.el_next != 0) {
+		result = sfs_extlist_get(sv, *el.el_next, &next);
+		if (result) {
+			sfs_extlist_put(sv, &el, false);
+			return result;
+		}
+		if (*next.el_count > 0 &&
+		    next.el_ext[0].sfe_fileblock > fileblock) {
+			sfs_extlist_put(sv, &next, false);
+			break;
+		}
+		sfs_extlist_put(sv, &el, false);
+		el = next;
+	}
+
+	idx = 0;
+	while (idx < *el.el_count &&
+	       el.el_ext[idx].sfe_fileblock < fileblock) {
+		idx++;
+	}
+	prev = idx > 0 ? &el.el_ext[idx-1] : NULL;
+	KASSERT(prev == NULL ||
+		prev->sfe_fileblock + prev->sfe_len <= fileblock);
+
+	if (prev != NULL) {
+		goal = prev->sfe_diskblock + (fileblock - prev->sfe_fileblock);
+	}
+	else {
+		goal = sv->sv_ino + 1;
+	}
+
+	result = sfs_balloc_run(sfs, goal, want, clear, &start, &n);
+	if (result) {
+		sfs_extlist_put(sv, &el, false);
+		return result;
+	}
+
+	if (prev != NULL &&
+	    prev->sfe_fileblock + prev->sfe_len == fileblock &&
+	    prev->sfe_diskblock + prev->sfe_len == start) {
+		prev->sfe_len += n;
+	}
+	else {
+		newext.sfe_fileblock = fileblock;
+		newext.sfe_diskblock = start;
+		newext.sfe_len = n;
+		result = sfs_ext_insert(sv, &el, idx, &newext);
+		if (result) {
+			sfs_extlist_put(sv, &el, false);
+			for (i=0; i<n; i++) {
+				sfs_bfree(sfs, start + i);
+			}
+			return result;
+		}
+	}
+	sfs_extlist_put(sv, &el, true);
+
+	*diskblock = start;
+	*count = n;
+	return 0;
+}
+
+/*
+ * Map FILEBLOCK of an extent-mapped file, allocating if DOALLOC is
+ * set and it's a hole. Like sfs_ext_find, also hands back how many
+ * blocks from FILEBLOCK on (up to WANT) continue the same way.
+ */
+static
+int
+sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, uint32_t want,
+	     int doalloc, uint32_t *diskblock, uint32_t *run)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result;
+
+	KASSERT(want > 0);
+
+	if (fileblock >= SFS_MAXEXTFILEBLOCKS) {
+		return EFBIG;
+	}
+	if (want > SFS_MAXEXTFILEBLOCKS - fileblock) {
+		want = SFS_MAXEXTFILEBLOCKS - fileblock;
+	}
+
+	result = sfs_ext_find(sv, fileblock, want, diskblock, run);
+	if (result) {
+		return result;
+	}
+
+	if (*diskblock == 0 && doalloc) {
+		result = sfs_ext_alloc(sv, fileblock, *run,
+				       doalloc != SFS_ALLOC_NOZERO,
+				       diskblock, run);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (*diskblock != 0 && !sfs_bused(sfs, *diskblock)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      *diskblock, fileblock, sv->sv_ino);
+	}
+	return 0;
+}
+
+/*
+ * Free the blocks of EL's extents that are at or past file block
+ * BLOCKLEN, shortening or dropping extents to match. Returns true if
+ * anything changed.
+ */
+static
+bool
+sfs_ext_trim(struct sfs_vnode *sv, struct sfs_extlist *el, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extent *e;
+	uint32_t i, b, keep, newlen;
+	bool changed = false;
+
+	/* The list is sorted, so the extents that survive come first */
+	keep = 0;
+	for (i=0; i<*el->el_count; i++) {
+		e = &el->el_ext[i];
+		if (e->sfe_fileblock >= blocklen) {
+			newlen = 0;
+		}
+		else if (e->sfe_len > blocklen - e->sfe_fileblock) {
+			newlen = blocklen - e->sfe_fileblock;
+		}
+		else {
+			keep++;
+			continue;
+		}
+
+		for (b=newlen; b<e->sfe_len; b++) {
+			sfs_bfree(sfs, e->sfe_diskblock + b);
+		}
+		e->sfe_len = newlen;
+		if (newlen > 0) {
+			keep++;
+		}
+		changed = true;
+	}
+
+	if (changed) {
+		bzero(&el->el_ext[keep],
+		      (*el->el_count - keep) * sizeof(struct sfs_extent));
+		*el->el_count = keep;
+	}
+	return changed;
+}
+
+/*
+ * Discard everything past file block BLOCKLEN of an extent-mapped
+ * file, including extent blocks that end up empty.
+ */
+static
+int
+sfs_ext_truncate(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extlist el, next;
+	uint32_t block;
+	bool dirty, nextdirty;
+	int result;
+
+	result = sfs_extlist_get(sv, 0, &el);
+	if (result) {
+		return result;
+	}
+	dirty = sfs_ext_trim(sv, &el, blocklen);
+
+	while (*el.el_next != 0) {
+		block = *el.el_next;
+		result = sfs_extlist_get(sv, block, &next);
+		if (result) {
+			sfs_extlist_put(sv, &el, dirty);
+			return result;
+		}
+		nextdirty = sfs_ext_trim(sv, &next, blocklen);
+
+		if (*next.el_count == 0) {
+			/* Nothing left in it; unlink and free it */
+			*el.el_next = *next.el_next;
+			dirty = true;
+			sfs_extlist_put(sv, &next, false);
+			sfs_bfree(sfs, block);
+		}
+		else {
+			sfs_extlist_put(sv, &el, dirty);
+			el = next;
+			dirty = nextdirty;
+		}
+	}
+	sfs_extlist_put(sv, &el, dirty);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Block mapping/inode maintenance
+
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated: zeroed for SFS_ALLOC_ZERO, left as is for
+ * SFS_ALLOC_NOZERO.
+ */
+static
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	 uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *idroot;
+	uint32_t block;
+	uint32_t idblock;
+	uint32_t idnum, idoff;
+	uint32_t stride, run;
+	uint32_t goal;
+	int levels, i;
+	int result;
+
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_ext_bmap(sv, fileblock, 1, doalloc, diskblock, &run);
+	}
+
+	/*
+	 * If the block we want is one of the direct blocks...
+	 */
+	if (fileblock < SFS_NDIRECT) {
+		/*
+		 * Get the block number
+		 */
+		block = sv->sv_i.sfi_direct[fileblock];
+
+		/*
+		 * Do we need to allocate?
+		 */
+		if (block==0 && doalloc) {
+			/* Try to follow the block before it */
+			goal = sv->sv_ino + 1;
+			if (fileblock > 0 &&
+			    sv->sv_i.sfi_direct[fileblock-1] != 0) {
+				goal = sv->sv_i.sfi_direct[fileblock-1] + 1;
+			}
+			result = sfs_balloc(sfs, goal,
+					    doalloc != SFS_ALLOC_NOZERO, &block);
+			if (result) {
+				return result;
+			}
+
+			/* Remember what we allocated; mark inode dirty */
+			sv->sv_i.sfi_direct[fileblock] = block;
+			sv->sv_dirty = true;
+		}
+
+		/*
+		 * Hand back the block
+		 */
+		if (block != 0 && !sfs_bused(sfs, block)) {
+			panic("sfs: Data block %u (block %u of file %u) "
+			      "marked free\n", block, fileblock, sv->sv_ino);
+		}
+		*diskblock = block;
+		return 0;
+	}
+
+	/*
+	 * It's not a direct block; it must be under the indirect,
+	 * double indirect, or triple indirect block. Subtract off the
+	 * blocks mapped by the levels before, so IDOFF is the offset
+	 * into the space mapped by the one it's under.
+	 */
+	idoff = fileblock - SFS_NDIRECT;
+	if (idoff < SFS_DBPERIDB) {
+		idroot = &sv->sv_i.sfi_indirect;
+		levels = 1;
+	}
+	else if ((idoff -= SFS_DBPERIDB) < SFS_DBPERIDB * SFS_DBPERIDB) {
+		idroot = &sv->sv_i.sfi_dindirect;
+		levels = 2;
+	}
+	else if ((idoff -= SFS_DBPERIDB * SFS_DBPERIDB) <
+		 SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB) {
+		idroot = &sv->sv_i.sfi_tindirect;
+		levels = 3;
+	}
+	else {
+		/* Past what even the triple indirect block can map */
+		return EFBIG;
+	}
+
+	/* Get the disk block number of the top indirect block. */
+	idblock = *idroot;
+
+	if (idblock==0 && !doalloc) {
+		/*
+		 * There's no indirect block allocated. We weren't
+		 * asked to allocate anything, so pretend the indirect
+		 * block was filled with all zeros.
+		 */
+		*diskblock = 0;
+		return 0;
+	}
+	else if (idblock==0) {
+		/*
+		 * There's no indirect block allocated, but we need to
+		 * allocate a block whose number needs to be stored in
+		 * the indirect block. Thus, we need to allocate an
+		 * indirect block.
+		 */
+		goal = sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+		goal = goal != 0 ? goal + 1 : sv->sv_ino + 1;
+		result = sfs_balloc(sfs, goal, true, &idblock);
+		if (result) {
+			return result;
+		}
+
+		/* Remember the block we just allocated */
+		*idroot = idblock;
+
+		/* Mark the inode dirty */
+		sv->sv_dirty = true;
+	}
+
+	/*
+	 * Walk down one indirect block per level. Each comes from the
+	 * buffer cache. (Any we just allocated, sfs_balloc left
+	 * zeroed in the cache.)
+	 */
+	for (stride = 1, i = 1; i < levels; i++) {
+		stride *= SFS_DBPERIDB;
+	}
+	for (; levels > 0; levels--, stride /= SFS_DBPERIDB) {
+		idnum = idoff / stride;
+		idoff %= stride;
+
+		result = sfs_buf_read(sfs, idblock, &idbuf);
+		if (result) {
+			return result;
+		}
+		iddata = idbuf->sb_data;
+
+		/* Get the next block out of the indirect block buffer */
+		block = iddata[idnum];
+
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			/*
+			 * Follow the previous entry, or the indirect
+			 * block. Anything but the data block itself is
+			 * another indirect block, and must be zeroed.
+			 */
+			goal = idnum > 0 && iddata[idnum-1] != 0 ?
+				iddata[idnum-1] + 1 : idblock + 1;
+			result = sfs_balloc(sfs, goal,
+					    levels > 1 ||
+					    doalloc != SFS_ALLOC_NOZERO,
+					    &block);
+			if (result) {
+				sfs_buf_release(sfs, idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			iddata[idnum] = block;
+
+			/* The indirect block is now dirty */
+			sfs_buf_markmeta(sfs, idbuf);
+		}
+
+		result = sfs_buf_release(sfs, idbuf);
+		if (result) {
+			return result;
+		}
+
+		if (block == 0) {
+			/* A hole, and we weren't asked to fill it */
+			break;
+		}
+		idblock = block;
+	}
+
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Like sfs_bmap, but also hand back how many blocks starting at
+ * FILEBLOCK, up to WANT, are consecutive on disk (or all hole), so
+ * the caller can move them in one transfer. When allocating, as many
+ * of them as possible are allocated together. Only extent-mapped
+ * files ever report more than one.
+ */
+static
+int
+sfs_bmaprange(struct sfs_vnode *sv, uint32_t fileblock, uint32_t want,
+	      int doalloc, uint32_t *diskblock, uint32_t *run)
+{
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		return sfs_ext_bmap(sv, fileblock, want, doalloc,
+				    diskblock, run);
+	}
+	*run = 1;
+	return sfs_bmap(sv, fileblock, doalloc, diskblock);
+}
+
+/*
+ * Free everything under the indirect block *IDBLOCKP (which has
+ * LEVELS levels of indirection, and maps file blocks from BASEBLOCK
+ * on) that is at or past file block BLOCKLEN. Subtrees wholly before
+ * BLOCKLEN, and empty entries, are not looked at. If the indirect
+ * block ends up empty, it is freed and *IDBLOCKP is set to 0.
+ */
+static
+int
+sfs_truncate_indirect(struct sfs_vnode *sv, uint32_t *idblockp, int levels,
+		      uint32_t baseblock, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t stride, subbase, j;
+	int i, result;
+	bool hasnonzero, iddirty;
+
+	if (*idblockp == 0) {
+		return 0;
+	}
+
+	/* Number of file blocks mapped by each entry */
+	for (stride = 1, i = 1; i < levels; i++) {
+		stride *= SFS_DBPERIDB;
+	}
+
+	if (blocklen >= baseblock + stride * SFS_DBPERIDB) {
+		/* All of it is before the new EOF */
+		return 0;
+	}
+
+	result = sfs_buf_read(sfs, *idblockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = idbuf->sb_data;
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		subbase = baseblock + j * stride;
+		if (iddata[j] != 0 && blocklen < subbase + stride) {
+			if (levels == 1) {
+				/* A data block past the new EOF */
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
+				iddirty = true;
+			}
+			else {
+				uint32_t old = iddata[j];
+
+				result = sfs_truncate_indirect(sv, &iddata[j],
+							       levels - 1,
+							       subbase,
+							       blocklen);
+				if (iddata[j] != old) {
+					iddirty = true;
+				}
+				if (result) {
+					if (iddirty) {
+						sfs_buf_markmeta(sfs, idbuf);
+					}
+					sfs_buf_release(sfs, idbuf);
+					return result;
+				}
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	/*
+	 * If the indirect block is dirty, it needs to go back to disk
+	 * -- unless it's about to be freed anyway.
+	 */
+	if (iddirty && hasnonzero) {
+		sfs_buf_markmeta(sfs, idbuf);
+	}
+	result = sfs_buf_release(sfs, idbuf);
+	if (result) {
+		return result;
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+	}
+	return 0;
+}
+
+/*
+ * Move the contents of an inline object out into a data block, and
+ * switch it to ordinary block mapping (extents, for a file). Called
+ * before the object grows past SFS_INLINED_BYTES.
+ */
+static
+int
+sfs_inline_out(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	uint32_t block = 0, count;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+	KASSERT(sv->sv_i.sfi_size <= SFS_INLINED_BYTES);
+
+	if (sv->sv_i.sfi_size > 0) {
+		/* Put it right after the inode if possible */
+		result = sfs_balloc_run(sfs, sv->sv_ino + 1, 1, true,
+					&block, &count);
+		if (result) {
+			return result;
+		}
+		/* New blocks come back zeroed */
+		result = sfs_buf_get(sfs, block, &buf);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+		memcpy(buf->sb_data, sv->sv_n.sfn_data, sv->sv_i.sfi_size);
+		sfs_markcontents(sv, buf);
+		sfs_buf_release(sfs, buf);
+	}
+
+	/* The block pointers live where the data was */
+	bzero(sv->sv_n.sfn_data, sizeof(sv->sv_n.sfn_data));
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+	if (sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		sv->sv_i.sfi_flags |= SFS_IFLAG_EXTENTS;
+		if (block != 0) {
+			sv->sv_x.sfx_nextents = 1;
+			sv->sv_x.sfx_extents[0].sfe_fileblock = 0;
+			sv->sv_x.sfx_extents[0].sfe_diskblock = block;
+			sv->sv_x.sfx_extents[0].sfe_len = 1;
+		}
+	}
+	else {
+		sv->sv_i.sfi_direct[0] = block;
+	}
+	sv->sv_dirty = true;
+	return 0;
+}
+
+/*
+ * Move an object that has been cut down to at most SFS_INLINED_BYTES
+ * (so that at most its first block is still mapped) back into its
+ * inode, and free the data block.
+ */
+static
+int
+sfs_inline_in(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf = NULL;
+	uint32_t size = sv->sv_i.sfi_size;
+	uint32_t block;
+	int result;
+
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
+	KASSERT(size <= SFS_INLINED_BYTES);
+
+	/* Only the first block can be left */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		KASSERT(sv->sv_x.sfx_overflow == 0);
+		KASSERT(sv->sv_x.sfx_nextents <= 1);
+	}
+	else {
+		KASSERT(sv->sv_i.sfi_indirect == 0);
+	}
+
+	result = sfs_bmap(sv, 0, 0, &block);
+	if (result) {
+		return result;
+	}
+	if (block != 0) {
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+	}
+
+	bzero(sv->sv_n.sfn_data, sizeof(sv->sv_n.sfn_data));
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_EXTENTS;
+	sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+	if (buf != NULL) {
+		memcpy(sv->sv_n.sfn_data, buf->sb_data, size);
+		sfs_buf_release(sfs, buf);
+		sfs_bfree(sfs, block);
+	}
+	sv->sv_dirty = true;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+//
+// A write into a hole in a file doesn't allocate a block right away.
+// The data goes into a delayed buffer in the cache instead, with a
+// block reserved for it, and gets a disk block when the file is
+// synced, its delayed buffers are needed elsewhere, or the vnode is
+// reclaimed. By then a file written in small pieces has all its new
+// blocks lined up, and they are allocated together as one run.
+//
+// A file block never has both a disk block and a delayed buffer:
+// anything that allocates blocks for a file flushes its delayed
+// buffers first.
+
+/*
+ * Get a delayed buffer for FILEBLOCK of a file, which must be a hole.
+ * If there isn't one and CREATE is set, try to make one; if it can't
+ * be done (not a plain file, no room in the cache, or the disk is
+ * nearly full) hand back NULL, and the caller allocates a block.
+ */
+static
+int
+sfs_delayed_get(struct sfs_vnode *sv, uint32_t fileblock, bool create,
+		struct sfs_buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	*ret = NULL;
+	if (sv->sv_i.sfi_type != SFS_TYPE_FILE) {
+		return 0;
+	}
+	if (sv->sv_ndelayed > 0) {
+		result = sfs_buf_getdelayed(sfs, sv, fileblock, false, ret);
+		if (result || *ret != NULL || !create) {
+			return result;
+		}
+	}
+	if (!create || !sfs_reserve(sfs, 1, false)) {
+		return 0;
+	}
+	result = sfs_buf_getdelayed(sfs, sv, fileblock, true, ret);
+	if (result || *ret == NULL) {
+		sfs_unreserve(sfs, 1);
+		return result;
+	}
+	sv->sv_ndelayed++;
+	return 0;
+}
+
+/*
+ * Allocate disk blocks for all of a file's delayed buffers. Each
+ * stretch of consecutive file blocks is allocated as one run if the
+ * free space allows.
+ */
+static
+int
+sfs_delalloc_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblocks[SFS_DELALLOC_MAX];
+	struct sfs_buf *buf;
+	uint32_t diskblock, run, len, i, j, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_ndelayed == 0) {
+		return 0;
+	}
+	n = sfs_buf_delayedlist(sfs, sv, fileblocks, SFS_DELALLOC_MAX);
+	KASSERT(n == sv->sv_ndelayed);
+
+	for (i=0; i<n; i+=run) {
+		len = 1;
+		while (i + len < n && fileblocks[i+len] == fileblocks[i]+len) {
+			len++;
+		}
+
+		/*
+		 * Release the reservation so the allocator can have
+		 * the space, and take back whatever it didn't use.
+		 */
+		sfs_unreserve(sfs, len);
+		result = sfs_bmaprange(sv, fileblocks[i], len,
+				       SFS_ALLOC_NOZERO, &diskblock, &run);
+		if (result) {
+			sfs_reserve(sfs, len, true);
+			return result;
+		}
+		KASSERT(run > 0 && run <= len);
+		sfs_reserve(sfs, len - run, true);
+
+		for (j=0; j<run; j++) {
+			result = sfs_buf_getdelayed(sfs, sv, fileblocks[i]+j,
+						    false, &buf);
+			KASSERT(result == 0 && buf != NULL);
+			sfs_buf_assign(sfs, buf, diskblock + j);
+			sfs_buf_release(sfs, buf);
+			sv->sv_ndelayed--;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Truncate (or extend, sparsely) a file to LEN bytes. The caller
+ * must hold the vnode lock.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t *idroots[3] = {
+		&sv->sv_i.sfi_indirect,
+		&sv->sv_i.sfi_dindirect,
+		&sv->sv_i.sfi_tindirect,
+	};
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	uint32_t i, block;
+	uint32_t idblock, baseblock, span = SFS_DBPERIDB;
+	unsigned ndropped;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * Delayed blocks past the new end just go away. The rest get
+	 * real blocks, so the code below sees the whole file.
+	 */
+	if (sv->sv_ndelayed > 0) {
+		ndropped = sfs_buf_discard(sfs, sv, blocklen);
+		sv->sv_ndelayed -= ndropped;
+		sfs_unreserve(sfs, ndropped);
+		result = sfs_delalloc_flush(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (len <= SFS_INLINED_BYTES) {
+			/* Keep the bytes past EOF zero */
+			if (len < sv->sv_i.sfi_size) {
+				bzero(sv->sv_n.sfn_data + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sv->sv_dirty = true;
+			return 0;
+		}
+		result = sfs_inline_out(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_EXTENTS) {
+		if (len > (off_t)SFS_MAXEXTFILEBLOCKS * SFS_BLOCKSIZE) {
+			return EFBIG;
+		}
+		result = sfs_ext_truncate(sv, blocklen);
+		if (result) {
+			return result;
+		}
+		sv->sv_i.sfi_size = len;
+		sv->sv_dirty = true;
+		goto shrunk;
+	}
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_bfree(sfs, block);
+			sv->sv_i.sfi_direct[i] = 0;
+			sv->sv_dirty = true;
+		}
+	}
+
+	/*
+	 * Then the indirect, double indirect, and triple indirect
+	 * blocks, each mapping the file blocks after the one before.
+	 */
+	baseblock = SFS_NDIRECT;
+	for (i=0; i<3; i++) {
+		idblock = *idroots[i];
+		result = sfs_truncate_indirect(sv, idroots[i], i+1,
+					       baseblock, blocklen);
+		if (result) {
+			return result;
+		}
+		if (*idroots[i] != idblock) {
+			sv->sv_dirty = true;
+		}
+		baseblock += span;
+		span *= SFS_DBPERIDB;
+	}
+
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
+
+ shrunk:
+	/* Small enough to go back into the inode? (Not if hashed.) */
+	if (len <= SFS_INLINED_BYTES &&
+	    (sv->sv_i.sfi_flags & SFS_IFLAG_HASHDIR) == 0) {
+		return sfs_inline_in(sv);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Vnode table
+//
+// Loaded vnodes are kept in a hash table keyed by inode number.
+// Inode numbers are block numbers, which are dense, so the low bits
+// make a fine hash. All of these must be called with sfs_vnlock held.
+
+static
+unsigned
+sfs_vnhash_bucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+/*
+ * Find a loaded vnode by inode number; NULL if not loaded.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnhash[sfs_vnhash_bucket(sfs, ino)];
+	while (sv != NULL && sv->sv_ino != ino) {
+		sv = sv->sv_hashnext;
+	}
+	return sv;
+}
+
+/*
+ * Double the number of chains. If we can't get the memory, just
+ * keep the old table; it still works, only with longer chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **oldhash, **newhash;
+	struct sfs_vnode *sv, *next;
+	unsigned oldsize, i, b;
+
+	oldhash = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashsize;
+
+	newhash = kmalloc(2 * oldsize * sizeof(struct sfs_vnode *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<2*oldsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = 2 * oldsize;
+
+	for (i=0; i<oldsize; i++) {
+		for (sv = oldhash[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			b = sfs_vnhash_bucket(sfs, sv->sv_ino);
+			sv->sv_hashnext = newhash[b];
+			newhash[b] = sv;
+		}
+	}
+	kfree(oldhash);
+}
+
+/*
+ * Add a newly loaded vnode.
+ */
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	b = sfs_vnhash_bucket(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[b];
+	sfs->sfs_vnhash[b] = sv;
+	sfs->sfs_nvnodes++;
+}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
-		}
+/*
+ * Remove a vnode that is being reclaimed.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+	svp = &sfs->sfs_vnhash[sfs_vnhash_bucket(sfs, sv->sv_ino)];
+	while (*svp != NULL && *svp != sv) {
+		svp = &(*svp)->sv_hashnext;
 	}
-
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
+	if (*svp == NULL) {
+		panic("sfs: reclaim vnode %u not in vnode pool\n",
+		      sv->sv_ino);
 	}
-	*diskblock = block;
-	return 0;
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
 }
 
 ////////////////////////////////////////////////////////////
@@ -308,21 +1610,13 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
-	
-	/* Allocate missing blocks if and only if we're writing */
+
+	/* Fill holes if and only if we're writing */
 	int doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
@@ -331,24 +1625,45 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	iobuf = NULL;
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Use its delayed buffer if it has one, or make one
+		 * if writing.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		result = sfs_delayed_get(sv, fileblock, doalloc, &iobuf);
+		if (result) {
+			return result;
+		}
+		if (iobuf == NULL && !doalloc) {
+			/* Read zeros. */
+			return uiomovezeros(len, uio);
+		}
 	}
-	else {
+
+	if (iobuf == NULL) {
+		if (diskblock == 0) {
+			/* No delayed buffer to be had; allocate now */
+			result = sfs_delalloc_flush(sv);
+			if (result) {
+				return result;
+			}
+			result = sfs_bmap(sv, fileblock, SFS_ALLOC_ZERO, &diskblock);
+			if (result) {
+				return result;
+			}
+		}
+
 		/*
-		 * Read the block.
+		 * Get the block from the buffer cache.
 		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
+		result = sfs_buf_read(sfs, diskblock, &iobuf);
 		if (result) {
 			return result;
 		}
@@ -357,87 +1672,240 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = uiomove((char *)iobuf->sb_data + skipstart, len, uio);
 	if (result) {
+		sfs_buf_release(sfs, iobuf);
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer now needs to go back to disk
+	 * eventually.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_markcontents(sv, iobuf);
 	}
 
-	return 0;
+	return sfs_buf_release(sfs, iobuf);
+}
+
+/*
+ * Move NBLOCKS whole blocks between the uio and the disk, starting at
+ * DISKBLOCK, in a single device transfer that bypasses the buffer
+ * cache. The caller has dealt with any cached copies of the blocks,
+ * and the uio's current iovec must cover the whole transfer.
+ */
+static
+int
+sfs_runio(struct sfs_vnode *sv, struct uio *uio, uint32_t diskblock,
+	  uint32_t nblocks)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct iovec *iov = uio->uio_iov;
+	struct iovec runiov;
+	struct uio runuio;
+	size_t len = nblocks * SFS_BLOCKSIZE;
+	size_t done;
+	int result;
+
+	KASSERT(iov->iov_len >= len);
+	KASSERT(uio->uio_resid >= len);
+
+	runiov.iov_kbase = iov->iov_kbase;
+	runiov.iov_len = len;
+	runuio.uio_iov = &runiov;
+	runuio.uio_iovcnt = 1;
+	runuio.uio_offset = (off_t)diskblock * SFS_BLOCKSIZE;
+	runuio.uio_resid = len;
+	runuio.uio_segflg = uio->uio_segflg;
+	runuio.uio_rw = uio->uio_rw;
+	runuio.uio_space = uio->uio_space;
+
+	result = sfs_rwblock(sfs, &runuio);
+
+	/* Advance the caller's uio past whatever was moved */
+	done = len - runuio.uio_resid;
+	iov->iov_kbase = (char *)iov->iov_kbase + done;
+	iov->iov_len -= done;
+	uio->uio_offset += done;
+	uio->uio_resid -= done;
+
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of whole blocks: at least one, and
+ * up to MAXBLOCKS if they are consecutive on disk.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	uint32_t run, i;
+	off_t startpos;
+	bool fresh = false;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+
+	KASSERT(maxblocks > 0);
+	if (maxblocks > SFS_MAXRUN) {
+		maxblocks = SFS_MAXRUN;
+	}
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Look up the disk block number, and how far it goes on */
+	result = sfs_bmaprange(sv, fileblock, maxblocks, 0,
+			       &diskblock, &run);
 	if (result) {
 		return result;
 	}
 
-	if (diskblock == 0) {
+	if (diskblock == 0 && (uio->uio_rw == UIO_READ || maxblocks == 1)) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * A hole. Blocks in it may have delayed buffers; the
+		 * rest read as zeros. A write of a single block gets a
+		 * delayed buffer if it can.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		result = sfs_delayed_get(sv, fileblock,
+					 uio->uio_rw == UIO_WRITE, &iobuf);
+		if (result) {
+			return result;
+		}
+		if (iobuf != NULL) {
+			KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+			result = uiomove(iobuf->sb_data, SFS_BLOCKSIZE, uio);
+			sfs_buf_release(sfs, iobuf);
+			return result;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			for (i=1; i<run; i++) {
+				if (sv->sv_ndelayed == 0) {
+					continue;
+				}
+				result = sfs_delayed_get(sv, fileblock + i,
+							 false, &iobuf);
+				if (result) {
+					return result;
+				}
+				if (iobuf != NULL) {
+					sfs_buf_release(sfs, iobuf);
+					break;
+				}
+			}
+			return uiomovezeros(i * SFS_BLOCKSIZE, uio);
+		}
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * A run of blocks goes straight between the disk and the
+	 * caller's buffer, as long as it fits in the current iovec.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	while (uio->uio_iov->iov_len == 0 && uio->uio_iovcnt > 1) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+	}
+	if (run > uio->uio_iov->iov_len / SFS_BLOCKSIZE) {
+		run = uio->uio_iov->iov_len / SFS_BLOCKSIZE;
+	}
+
+	if (diskblock == 0) {
+		/*
+		 * Writing into a hole, and not delaying: allocate
+		 * blocks now, as many together as we can. They're
+		 * about to be overwritten, so they aren't zeroed
+		 * first; take no more than this call will write.
+		 */
+		result = sfs_delalloc_flush(sv);
+		if (result) {
+			return result;
+		}
+		result = sfs_bmaprange(sv, fileblock, run > 0 ? run : 1,
+				       SFS_ALLOC_NOZERO, &diskblock, &run);
+		if (result) {
+			return result;
+		}
+		fresh = true;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * A read has to stop at the first block with a cached copy,
+	 * which may be newer than the disk; a write replaces the
+	 * blocks entirely, so it just throws cached copies away.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		for (i=0; i<run; i++) {
+			if (sfs_buf_cached(sfs, diskblock + i)) {
+				break;
+			}
+		}
+		run = i;
+	}
+	if (run > 1) {
+		if (uio->uio_rw == UIO_WRITE) {
+			for (i=0; i<run; i++) {
+				sfs_buf_invalidate(sfs, diskblock + i);
+			}
+		}
+		startpos = uio->uio_offset;
+		result = sfs_runio(sv, uio, diskblock, run);
+		if (uio->uio_rw == UIO_WRITE) {
+			/*
+			 * The read-ahead thread doesn't take sv_lock, so
+			 * it may have loaded one of these blocks from the
+			 * old disk contents while the write was going on.
+			 * Drop any such copy now that the disk is current.
+			 */
+			for (i=0; i<run; i++) {
+				sfs_buf_invalidate(sfs, diskblock + i);
+			}
+		}
+		if (result && fresh) {
+			/* Don't leave old disk contents in the file */
+			i = (uio->uio_offset - startpos) / SFS_BLOCKSIZE;
+			for (; i<run; i++) {
+				sfs_clearblock(sfs, diskblock + i);
+			}
+		}
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * Go through the buffer cache so that cached copies of the
+	 * block stay coherent. A write covers the whole block, so
+	 * there's no need to read the old contents first.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_buf_read(sfs, diskblock, &iobuf);
+	}
+	else {
+		result = sfs_buf_get(sfs, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	return result;
+	result = uiomove(iobuf->sb_data, SFS_BLOCKSIZE, uio);
+	if (result) {
+		if (fresh) {
+			/* Don't leave old disk contents in the file */
+			bzero(iobuf->sb_data, SFS_BLOCKSIZE);
+			sfs_markcontents(sv, iobuf);
+		}
+		sfs_buf_release(sfs, iobuf);
+		return result;
+	}
+
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_markcontents(sv, iobuf);
+	}
+
+	return sfs_buf_release(sfs, iobuf);
 }
 
 /*
@@ -448,7 +1916,6 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -473,6 +1940,23 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * Inline objects are read and written right in the inode,
+	 * until a write would run past the space there.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (uio->uio_offset + uio->uio_resid <= SFS_INLINED_BYTES) {
+			result = uiomove(sv->sv_n.sfn_data + uio->uio_offset,
+					 uio->uio_resid, uio);
+			goto out;
+		}
+		KASSERT(uio->uio_rw == UIO_WRITE);
+		result = sfs_inline_out(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -505,9 +1989,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	while (uio->uio_resid >= SFS_BLOCKSIZE) {
+		result = sfs_blockio(sv, uio, uio->uio_resid / SFS_BLOCKSIZE);
 		if (result) {
 			goto out;
 		}
@@ -546,37 +2029,28 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 // Directory I/O
 
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Get block FILEBLOCK of a directory from the buffer cache, so its
+ * entries can be scanned in place. Hands back NULL for a hole, which
+ * reads as all free entries.
  */
 static
 int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_dir_getblock(struct sfs_vnode *sv, uint32_t fileblock,
+		 struct sfs_buf **ret)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t diskblock;
 	int result;
 
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
-
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
-
-	/* do it */
-	result = sfs_io(sv, &ku);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
-
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	if (diskblock == 0) {
+		*ret = NULL;
+		return 0;
 	}
-
-	/* Done */
-	return 0;
+	return sfs_buf_read(sfs, diskblock, ret);
 }
 
 /*
@@ -609,83 +2083,379 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 	if (ku.uio_resid > 0) {
 		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
 	}
-
-	/* Done */
-	return 0;
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Hash a directory entry name. See kern/sfs.h. Stops at SFS_NAMELEN
+ * characters, so it can be used on names straight off the disk.
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+	unsigned i;
+
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = SFS_DIRHASH_STEP(h, name[i]);
+	}
+	return h;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * In a hashed directory only the blocks the name hashes to are
+ * searched, so the empty slot returned is one the name may go in.
+ */
+
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_dir *dirdata, *tsd;
+	int found = 0;
+	int nentries;
+	size_t namelen;
+	uint32_t nblocks, first, nscan, k, b;
+	unsigned j;
+	int i, result;
+	uint32_t foundino = SFS_NOINO;
+	int foundslot = -1;
+
+	/* Try the name cache first. */
+	switch (vfs_nc_lookup(&sv->sv_v, name, &foundino, &foundslot)) {
+	    case VFS_NC_HIT:
+		if (slot != NULL) {
+			*slot = foundslot;
+		}
+		if (ino != NULL) {
+			*ino = foundino;
+		}
+		return 0;
+	    case VFS_NC_NEGATIVE:
+		/* Still have to search if the caller wants a free slot */
+		if (emptyslot == NULL) {
+			return ENOENT;
+		}
+		break;
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	nblocks = DIVROUNDUP(nentries, SFS_DIRPERBLOCK);
+
+	/* Figure out which blocks to look in */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_HASHDIR) {
+		KASSERT(nblocks > 0);
+		first = sfs_dirhash(name) % nblocks;
+		nscan = nblocks < SFS_DIRHASH_PROBE ?
+			nblocks : SFS_DIRHASH_PROBE;
+	}
+	else {
+		first = 0;
+		nscan = nblocks;
+	}
+
+	/*
+	 * We compare in place in the cache buffer, so rather than
+	 * null-terminating the entry, only let strcmp look as far as
+	 * the end of NAME.
+	 */
+	namelen = strlen(name);
+
+	/* For each block, and each slot in it... */
+	for (k=0; k<nscan; k++) {
+		b = (first + k) % nblocks;
+
+		if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+			/* All the entries are in the inode */
+			KASSERT(b == 0);
+			buf = NULL;
+			dirdata = (struct sfs_dir *)sv->sv_n.sfn_data;
+		}
+		else {
+			result = sfs_dir_getblock(sv, b, &buf);
+			if (result) {
+				return result;
+			}
+			dirdata = buf ? buf->sb_data : NULL;
+		}
+
+		for (j=0; j<SFS_DIRPERBLOCK; j++) {
+			i = b*SFS_DIRPERBLOCK + j;
+			if (i >= nentries) {
+				break;
+			}
+			tsd = dirdata ? dirdata + j : NULL;
+
+			if (tsd == NULL || tsd->sfd_ino == SFS_NOINO) {
+				/* Free slot - report it back if requested */
+				if (emptyslot != NULL && *emptyslot < 0) {
+					*emptyslot = i;
+				}
+			}
+			else if (namelen < sizeof(tsd->sfd_name) &&
+				 tsd->sfd_name[namelen] == 0 &&
+				 !strcmp(tsd->sfd_name, name)) {
+
+				/* Each name may legally appear only once... */
+				KASSERT(found==0);
+
+				found = 1;
+				foundslot = i;
+				foundino = tsd->sfd_ino;
+			}
+		}
+
+		if (buf != NULL) {
+			sfs_buf_release(sfs, buf);
+		}
+	}
+
+	if (!found) {
+		vfs_nc_enter_negative(&sv->sv_v, name);
+		return ENOENT;
+	}
+
+	vfs_nc_enter(&sv->sv_v, name, foundino, foundslot);
+	if (slot != NULL) {
+		*slot = foundslot;
+	}
+	if (ino != NULL) {
+		*ino = foundino;
+	}
+	return 0;
+}
+
+/*
+ * Put directory entry SD into the hashed table of NBLOCKS blocks that
+ * starts at block BASE of the directory. Returns EAGAIN if all the
+ * blocks it may go in are full.
+ */
+static
+int
+sfs_dir_hashplace(struct sfs_vnode *sv, uint32_t base, uint32_t nblocks,
+		  const struct sfs_dir *sd)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_dir *td;
+	uint32_t first, k;
+	unsigned j;
+	int result;
+
+	first = sfs_dirhash(sd->sfd_name) % nblocks;
+	for (k=0; k<SFS_DIRHASH_PROBE && k<nblocks; k++) {
+		result = sfs_dir_getblock(sv, base + (first+k) % nblocks, &buf);
+		if (result) {
+			return result;
+		}
+		/* The new table is fully allocated */
+		KASSERT(buf != NULL);
+
+		td = buf->sb_data;
+		for (j=0; j<SFS_DIRPERBLOCK; j++) {
+			if (td[j].sfd_ino == SFS_NOINO) {
+				td[j] = *sd;
+				sfs_buf_markmeta(sfs, buf);
+				return sfs_buf_release(sfs, buf);
+			}
+		}
+		sfs_buf_release(sfs, buf);
+	}
+	return EAGAIN;
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * Rebuild a directory as a hashed directory of NEWNBLOCKS blocks.
+ *
+ * The new table is built in fresh blocks past the current end of the
+ * directory, copied down over the old entries, and then the file is
+ * cut back to the new size. Nothing in the old directory changes
+ * until the new table is complete, so if building it fails we only
+ * have to throw the new blocks away. Returns EAGAIN if some entry
+ * didn't fit, in which case more blocks are needed.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_dir_rehash(struct sfs_vnode *sv, uint32_t newnblocks)
 {
-	off_t size;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *oldbuf, *newbuf;
+	struct sfs_dir *od;
+	off_t oldsize = sv->sv_i.sfi_size;
+	int nentries = sfs_dir_nentries(sv);
+	uint32_t base, b, diskblock;
+	unsigned j;
+	int result;
 
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	base = DIVROUNDUP(nentries, SFS_DIRPERBLOCK);
+	KASSERT(base > 0);
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	/* Allocate the new table. New blocks come back zeroed (free). */
+	for (b=0; b<newnblocks; b++) {
+		result = sfs_bmap(sv, base+b, SFS_ALLOC_ZERO, &diskblock);
+		if (result) {
+			goto fail;
+		}
 	}
 
-	return size / sizeof(struct sfs_dir);
+	/* Move each entry into place in the new table */
+	for (b=0; b<base; b++) {
+		result = sfs_dir_getblock(sv, b, &oldbuf);
+		if (result) {
+			goto fail;
+		}
+		if (oldbuf == NULL) {
+			continue;
+		}
+		od = oldbuf->sb_data;
+		for (j=0; j<SFS_DIRPERBLOCK; j++) {
+			if (b*SFS_DIRPERBLOCK + j >= (unsigned)nentries) {
+				break;
+			}
+			if (od[j].sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			result = sfs_dir_hashplace(sv, base, newnblocks,
+						   &od[j]);
+			if (result) {
+				sfs_buf_release(sfs, oldbuf);
+				goto fail;
+			}
+		}
+		sfs_buf_release(sfs, oldbuf);
+	}
+
+	/*
+	 * Copy the new table down to the start of the directory. An
+	 * error here is a disk error in the middle of updating the
+	 * directory, same as one in sfs_writedir.
+	 */
+	for (b=0; b<newnblocks; b++) {
+		result = sfs_dir_getblock(sv, base+b, &newbuf);
+		if (result) {
+			return result;
+		}
+		result = sfs_bmap(sv, b, SFS_ALLOC_ZERO, &diskblock);
+		if (result) {
+			sfs_buf_release(sfs, newbuf);
+			return result;
+		}
+		result = sfs_buf_get(sfs, diskblock, &oldbuf);
+		if (result) {
+			sfs_buf_release(sfs, newbuf);
+			return result;
+		}
+		memcpy(oldbuf->sb_data, newbuf->sb_data, SFS_BLOCKSIZE);
+		sfs_buf_markmeta(sfs, oldbuf);
+		sfs_buf_release(sfs, oldbuf);
+		sfs_buf_release(sfs, newbuf);
+	}
+
+	/* Entries have moved, so the cached slots are stale */
+	vfs_nc_purgedir(&sv->sv_v);
+
+	sv->sv_i.sfi_flags |= SFS_IFLAG_HASHDIR;
+	sv->sv_dirty = true;
+
+	/* Drop the scratch copy */
+	return sfs_dotruncate(sv, newnblocks * SFS_BLOCKSIZE);
+
+ fail:
+	sfs_dotruncate(sv, oldsize);
+	return result;
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Find room for NAME in a directory that has no free slot for it.
+ *
+ * Small unhashed directories just get one entry longer. Once a
+ * directory reaches SFS_DIRHASH_MINENTRIES, or if it is already
+ * hashed, it is rebuilt as a hashed directory with about twice the
+ * space it needs. If that can't be done (the file would get too big,
+ * or the disk is full) the directory reverts to being unhashed and
+ * the entry goes on the end.
  */
-
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_makeroom(struct sfs_vnode *sv, const char *name, int *emptyslot)
 {
-	struct sfs_dir tsd;
-	int found = 0;
 	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	uint32_t oldnblocks, newnblocks;
+	int tries, result;
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	oldnblocks = DIVROUNDUP(nentries, SFS_DIRPERBLOCK);
+	newnblocks = 2 * DIVROUNDUP(nentries + 1, SFS_DIRPERBLOCK);
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
-		if (result) {
-			return result;
+	if ((sv->sv_i.sfi_flags & SFS_IFLAG_HASHDIR) == 0 &&
+	    nentries < (int)SFS_DIRHASH_MINENTRIES) {
+		*emptyslot = nentries;
+		return 0;
+	}
+
+	for (tries=0; tries<3; tries++) {
+		/* The old and new tables have to fit at once */
+		if (oldnblocks + newnblocks > SFS_MAXFILEBLOCKS) {
+			break;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
+		result = sfs_dir_rehash(sv, newnblocks);
+		if (result == 0) {
+			result = sfs_dir_findname(sv, name, NULL, NULL,
+						  emptyslot);
+			if (result != ENOENT) {
+				/* We know it's not there */
+				KASSERT(result != 0);
+				return result;
 			}
-		}
-		else {
-			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
-
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
+			if (*emptyslot >= 0) {
+				return 0;
 			}
+			oldnblocks = newnblocks;
 		}
+		else if (result != EAGAIN) {
+			break;
+		}
+		newnblocks *= 2;
 	}
 
-	return found ? 0 : ENOENT;
+	/* Give up on hashing; any hashed directory is a valid flat one */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_HASHDIR) {
+		sv->sv_i.sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		sv->sv_dirty = true;
+	}
+	*emptyslot = sfs_dir_nentries(sv);
+	return 0;
 }
 
 /*
@@ -713,9 +2483,12 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/* If we didn't get an empty slot, make one. */
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		result = sfs_dir_makeroom(sv, name, &emptyslot);
+		if (result) {
+			return result;
+		}
 	}
 
 	/* Set up the entry. */
@@ -729,19 +2502,28 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		vfs_nc_remove(&sv->sv_v, name);
+		return result;
+	}
+
+	vfs_nc_enter(&sv->sv_v, name, ino, emptyslot);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME must be the name
+ * in that slot; it is dropped from the name cache.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
 	struct sfs_dir sd;
 
+	vfs_nc_remove(&sv->sv_v, name);
+
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
@@ -787,21 +2569,36 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. NEAR is
+ * the inode it should be placed close to, normally its directory's.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t near,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
+	/*
+	 * If the region around NEAR is nearly full, the new object
+	 * would have no room to grow there; start it in the emptiest
+	 * region instead.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	if (near >= sfs->sfs_super.sp_nblocks ||
+	    sfs->sfs_regionfree[near / SFS_REGIONBLOCKS] <
+	    SFS_REGION_MINFREE) {
+		near = 0;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode 
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, near, true, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +2672,21 @@ static
 int
 sfs_lastclose(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	/*
+	 * Push the inode into the buffer cache. Don't force the
+	 * file's blocks out to disk; the syncer will get to them.
+	 */
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
 }
 
 /*
@@ -890,39 +2700,62 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * This may run inside another operation that dropped the last
+	 * reference, so join its transaction rather than waiting for a
+	 * commit that would wait for it.
+	 */
+	sfs_jjoin(sfs);
+
+	/*
+	 * Holding the vnode table lock keeps sfs_loadvnode from handing
+	 * out new references while we decide.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	lock_acquire(sv->sv_lock);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it. (Not through VOP_TRUNCATE: that would take the vfs
+	 * biglock while we hold a journal handle.)
+	 */
+	result = 0;
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+		result = sfs_dotruncate(sv, 0);
 	}
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
+	/* Place any delayed blocks, and sync the inode to disk */
+	if (result == 0) {
+		result = sfs_delalloc_flush(sv);
+	}
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -932,25 +2765,13 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
-	VOP_CLEANUP(&sv->sv_v);
+	lock_release(sfs->sfs_vnlock);
+	sfs_jend(sfs);
 
-	vfs_biglock_release();
+	VOP_CLEANUP(&sv->sv_v);
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -971,10 +2792,58 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
+/*
+ * Called for read-ahead hints. Look up the disk blocks under the
+ * range, stopping at EOF and skipping holes, and queue them for the
+ * cache's read-ahead thread.
+ */
+static
+int
+sfs_readahead(struct vnode *v, off_t pos, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t fileblock, endblock, diskblock, run, i;
+	off_t endpos;
+	int result = 0;
+
+	lock_acquire(sv->sv_lock);
+
+	/* Inline data came in with the inode */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		lock_release(sv->sv_lock);
+		return 0;
+	}
+
+	endpos = pos + len;
+	if (endpos > sv->sv_i.sfi_size) {
+		endpos = sv->sv_i.sfi_size;
+	}
+	fileblock = pos / SFS_BLOCKSIZE;
+	endblock = pos < endpos ? DIVROUNDUP(endpos, SFS_BLOCKSIZE) : 0;
+
+	while (fileblock < endblock) {
+		result = sfs_bmaprange(sv, fileblock, endblock - fileblock,
+				       0, &diskblock, &run);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			for (i=0; i<run; i++) {
+				sfs_buf_readahead(sfs, diskblock + i);
+			}
+		}
+		fileblock += run;
+	}
 
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -986,13 +2855,16 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	return result;
 }
@@ -1033,7 +2905,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1091,20 +2965,50 @@ sfs_tryseek(struct vnode *v, off_t pos)
 	return 0;
 }
 
+/*
+ * Place a file's delayed blocks and push its inode into the buffer
+ * cache. This is fsync without the commit; sfs_sync does it to every
+ * file and then commits once.
+ */
+int
+sfs_flushvnode(struct vnode *v)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_delalloc_flush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
+}
+
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
+ *
+ * The buffer cache doesn't know which blocks belong to which file,
+ * so after writing the inode this commits everything. That is more
+ * than necessary but never less, and a commit already in progress
+ * is shared rather than repeated.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
-	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	result = sfs_flushvnode(v);
+	if (result == 0) {
+		result = sfs_jcommit(sfs);
+	}
 
 	return result;
 }
@@ -1121,107 +3025,23 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate().
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
-
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
-		}
-	}
-
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
-	}
-
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
-
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1260,16 +3080,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	int result;
 
 	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return EEXIST;
 	}
@@ -1278,17 +3104,23 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return result;
 	}
@@ -1300,18 +3132,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	vfs_biglock_release();
 	return 0;
 }
@@ -1325,6 +3163,7 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
@@ -1332,18 +3171,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	KASSERT(file->vn_fs == dir->vn_fs);
 
 	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	vfs_biglock_release();
 	return 0;
 }
@@ -1355,32 +3202,41 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
 	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	vfs_biglock_release();
 	return result;
 }
@@ -1396,12 +3252,15 @@ int
 sfs_rename(struct vnode *d1, const char *n1, 
 	   struct vnode *d2, const char *n2)
 {
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
 	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
@@ -1409,6 +3268,8 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		vfs_biglock_release();
 		return result;
 	}
@@ -1430,11 +3291,19 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	/* Linking may have rebuilt a hashed directory; find n1 again */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1443,13 +3312,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	vfs_biglock_release();
 	return 0;
 
@@ -1457,17 +3330,21 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	vfs_biglock_release();
 	return result;
 }
@@ -1521,20 +3398,24 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	int result;
 
 	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
+		lock_release(sv->sv_lock);
 		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
+	lock_release(sv->sv_lock);
 	vfs_biglock_release();
 	return 0;
 }
@@ -1583,6 +3464,7 @@ static const struct vnode_ops sfs_fileops = {
 	sfs_reclaim,
 
 	sfs_read,
+	sfs_readahead,
 	NOTDIR,  /* readlink */
 	NOTDIR,  /* getdirentry */
 	sfs_write,
@@ -1618,6 +3500,7 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_reclaim,
 	
 	ISDIR,   /* read */
+	ISDIR,   /* readahead */
 	ISDIR,   /* readlink */
 	UNIMP,   /* getdirentry */
 	ISDIR,   /* write */
@@ -1651,42 +3534,36 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,14 +3574,18 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_buf_read(sfs, ino, &buf);
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, buf->sb_data, sizeof(sv->sv_i));
+	sfs_buf_release(sfs, buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_ndelayed = 0;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -1715,6 +3596,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
 		sv->sv_dirty = true;
+
+		/* New objects start out with their contents inline */
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
 	}
 
 	/*
@@ -1737,20 +3621,25 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
 		VOP_CLEANUP(&sv->sv_v);
 		kfree(sv);
-		return result;
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
 	}
 
+	/* Add it to our table */
+	sfs_vnhash_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -32,9 +32,21 @@ struct ft_entry{
 	int f_flags;
 	off_t offset;
 	int numopen;
-	
+
+	/* sequential read detection, for read-ahead */
+	off_t f_ranext;		/* where the next sequential read starts */
+	off_t f_raend;		/* end of the read-ahead asked for so far */
+	off_t f_rawindow;	/* bytes to read ahead; 0 if not sequential */
 };
 
+/*
+ * Read-ahead window limits, in bytes. The window starts at
+ * FILE_RA_MIN on the first sequential read and doubles with each one
+ * after that, up to FILE_RA_MAX.
+ */
+#define FILE_RA_MIN  (4 * 1024)
+#define FILE_RA_MAX  (32 * 1024)
+
 /* these all have an implicit arg of the curthread's filetable */
 int filetable_init(void);
 void filetable_destroy(struct filetable *ft);
@@ -52,6 +64,9 @@ int file_close(int fd);
 int filetable_getfd(void);
 int file_dup(int oldfd, int newfd, int *retval);
 
+/* notes a read of [pos, endpos) for read-ahead */
+void file_readahead(struct ft_entry *fte, off_t pos, off_t endpos);
+
 #endif /* _FILE_H_ */
 
 /* END A3 SETUP */
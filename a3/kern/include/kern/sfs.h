@@ -47,6 +47,10 @@
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/* The inode has double and triple indirect blocks (for sfsck) */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
 
@@ -64,15 +68,77 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
-/* A3 - Amount of file data that can be stored in inode block 
- * For simplicity, this is just set to a constant. It is calculated 
- * to be the largest multiple of the sizeof(struct sfs_direntry) 
- * (which is 64 bytes) that can fit in the leftover space not used
- * by the actual inode metadata (which is 512-60=452 bytes). 
- * If we changed other parts of the inode structure or the directory 
- * entry structure, this constant would have to change too.
+/* Inode flags for sfi_flags */
+#define SFS_IFLAG_HASHDIR 0x1     /* Directory entries placed by hash */
+#define SFS_IFLAG_EXTENTS 0x2     /* File blocks mapped by extents */
+#define SFS_IFLAG_INLINE  0x4     /* Contents stored in the inode */
+
+/*
+ * Hashed directories.
+ *
+ * A hashed directory is an ordinary array of struct sfs_dir, but its
+ * size is a whole number of blocks and each entry lives in a block
+ * chosen from its name: block (hash % nblocks), or one of the next
+ * SFS_DIRHASH_PROBE-1 blocks after it (wrapping around). Lookups
+ * only need to look at those blocks. Any hashed directory is also a
+ * valid unhashed one, so clearing SFS_IFLAG_HASHDIR is always safe.
+ *
+ * The hash is h = SFS_DIRHASH_INIT, then h = SFS_DIRHASH_STEP(h, c)
+ * for each character c of the name, in 32-bit unsigned arithmetic.
+ */
+#define SFS_DIRHASH_PROBE      3
+#define SFS_DIRHASH_INIT       5381
+#define SFS_DIRHASH_STEP(h, c) ((h)*33 + (unsigned char)(c))
+
+/*
+ * Extent-mapped files.
+ *
+ * A file with SFS_IFLAG_EXTENTS set maps its blocks with runs of
+ * consecutive disk blocks instead of block pointers, and its inode is
+ * read as a struct sfs_extinode. The first SFS_NIEXTENTS extents live
+ * in the inode; any more are in a chain of extent blocks starting at
+ * sfx_overflow. Extents are sorted by file block across the inode and
+ * the whole chain, and do not overlap. File blocks that no extent
+ * covers are holes.
+ */
+#define SFS_NIEXTENTS     40      /* # of extents in an inode */
+#define SFS_NBEXTENTS     42      /* # of extents in an extent block */
+
+/*
+ * Inline data. A file or directory no bigger than SFS_INLINED_BYTES
+ * may keep its contents in the inode instead of in data blocks; it
+ * then has SFS_IFLAG_INLINE set and is read as a struct
+ * sfs_inlineinode, with the data where the block pointers would be.
+ * Bytes of sfn_data past the size are zero. 448 is the largest
+ * multiple of sizeof(struct sfs_dir) (64) that fits, so an inline
+ * directory holds 7 entries.
  */
 #define SFS_INLINED_BYTES 448
+
+/*
+ * Metadata journal.
+ *
+ * A volume may set aside sp_journalblocks consecutive blocks, starting
+ * at sp_journalstart, as a write-ahead log for metadata (0 blocks
+ * means it has none). It holds struct sfs_jblock records and copies
+ * of other blocks.
+ *
+ * The first block is the log header record; its sj_seq is the sequence
+ * number of the next transaction. A transaction is written after it
+ * as one or more descriptor blocks, each followed by copies of the
+ * sj_count blocks it lists in sj_blocks, and then a commit block
+ * whose sj_count is the total number of blocks copied. All of them
+ * carry the transaction's sequence number. Once the copies have been
+ * written to their homes, the header's sj_seq is bumped, which
+ * empties the log. A log that ends in a commit block is replayed at
+ * mount time; one that doesn't is ignored.
+ */
+#define SFS_JMAGIC        0x4a524e4c    /* "JRNL" */
+#define SFS_JTYPE_HEADER  1
+#define SFS_JTYPE_DESC    2
+#define SFS_JTYPE_COMMIT  3
+#define SFS_JDESCBLOCKS   124           /* # of blocks in a descriptor */
+#define SFS_JOURNAL_MINBLOCKS 8         /* smallest usable journal */
 /*
  * On-disk superblock
  */
@@ -80,7 +146,9 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_journalstart;		/* First block of the journal */
+	uint32_t sp_journalblocks;		/* Size of it (0 for none) */
+	uint32_t reserved[116];
 };
 
 /*
@@ -92,7 +160,47 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* above */
+};
+
+/*
+ * On-disk extent, and the inode and extent block forms that hold them;
+ * and the inline-data form of the inode. The inode forms all have the
+ * same size, header and flags word as struct sfs_inode.
+ */
+struct sfs_extent {
+	uint32_t sfe_fileblock;			/* First file block covered */
+	uint32_t sfe_diskblock;			/* Where it is on disk */
+	uint32_t sfe_len;			/* Length in blocks */
+};
+
+struct sfs_extinode {
+	uint32_t sfx_size;			/* Size of this file (bytes) */
+	uint16_t sfx_type;			/* Always SFS_TYPE_FILE */
+	uint16_t sfx_linkcount;			/* # hard links to this file */
+	uint32_t sfx_nextents;			/* # of sfx_extents in use */
+	uint32_t sfx_overflow;			/* First extent block, or 0 */
+	struct sfs_extent sfx_extents[SFS_NIEXTENTS];
+	uint32_t sfx_waste[128-5-3*SFS_NIEXTENTS]; /* unused, set to 0 */
+	uint32_t sfx_flags;			/* SFS_IFLAG_* above */
+};
+
+struct sfs_extblock {
+	uint32_t sfeb_next;			/* Next extent block, or 0 */
+	uint32_t sfeb_nextents;			/* # of sfeb_extents in use */
+	struct sfs_extent sfeb_extents[SFS_NBEXTENTS];
+};
+
+struct sfs_inlineinode {
+	uint32_t sfn_size;			/* Size of this file (bytes) */
+	uint16_t sfn_type;			/* One of SFS_TYPE_* above */
+	uint16_t sfn_linkcount;			/* # hard links to this file */
+	char sfn_data[SFS_INLINED_BYTES];	/* The contents */
+	uint32_t sfn_waste[128-3-SFS_INLINED_BYTES/4]; /* unused, set to 0 */
+	uint32_t sfn_flags;			/* SFS_IFLAG_* above */
 };
 
 /*
@@ -103,5 +211,16 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Journal record (header, descriptor or commit block)
+ */
+struct sfs_jblock {
+	uint32_t sj_magic;			/* SFS_JMAGIC */
+	uint32_t sj_type;			/* One of SFS_JTYPE_* above */
+	uint32_t sj_seq;			/* Transaction sequence number */
+	uint32_t sj_count;			/* # of blocks (see above) */
+	uint32_t sj_blocks[SFS_JDESCBLOCKS];	/* Homes of the copies */
+};
+
 
 #endif /* _KERN_SFS_H_ */
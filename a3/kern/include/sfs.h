@@ -48,11 +48,126 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking. Directory operations still run under the vfs biglock;
+ * everything else uses these locks, taken in this order:
+ *
+ *     journal handle (sfs_jbegin; see sfs_journal.c)
+ *     sv_lock of the directory
+ *     sv_lock of a file
+ *     sfs_vnlock
+ *     sfs_freemaplock
+ *     bc_lock (never held across I/O)
+ *
+ * sfs_reclaim takes sfs_vnlock and then the dying vnode's sv_lock;
+ * this is safe because nobody else holds a reference to it.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
-	struct sfs_inode sv_i;		/* on-disk inode */
+	union {
+		struct sfs_inode sv_i;		/* on-disk inode */
+		struct sfs_extinode sv_x;	/* ...if SFS_IFLAG_EXTENTS */
+		struct sfs_inlineinode sv_n;	/* ...if SFS_IFLAG_INLINE */
+	};
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	unsigned sv_ndelayed;           /* buffers awaiting disk blocks */
+	struct lock *sv_lock;           /* protects the three above */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+};
+
+/*
+ * Block buffer cache.
+ *
+ * Buffers are found by (device, block) through a hash table. Buffers
+ * that nobody holds a reference to sit on an LRU list and are
+ * recycled from the cold end when a miss needs a buffer.
+ *
+ * A delayed buffer holds file data that has no disk block yet. It is
+ * found by (vnode, file block) instead, has sb_vnode set and
+ * sb_device NULL, and stays off the LRU list until it is assigned a
+ * disk block, since memory is the only place its contents exist.
+ */
+struct sfs_buf {
+	struct sfs_buf *sb_hashnext;    /* next buffer in hash chain */
+	struct sfs_buf *sb_lrunext;     /* LRU list (unreferenced only) */
+	struct sfs_buf *sb_lruprev;
+	struct device *sb_device;       /* device the block lives on */
+	struct sfs_vnode *sb_vnode;     /* file, if delayed */
+	uint32_t sb_block;              /* block (file block if delayed) */
+	unsigned sb_refcount;           /* number of active users */
+	bool sb_valid;                  /* true if sb_data holds the block */
+	bool sb_dirty;                  /* true if sb_data modified */
+	bool sb_busy;                   /* true while I/O is in progress */
+	bool sb_readahead;              /* read ahead, and not used yet */
+	bool sb_meta;                   /* metadata waiting for a commit */
+	void *sb_data;                  /* SFS_BLOCKSIZE bytes of data */
+};
+
+#define SFS_CACHE_NBUFS     128         /* number of buffers */
+#define SFS_CACHE_NBUCKETS  61          /* number of hash chains */
+#define SFS_RA_QUEUESIZE    32          /* read-ahead blocks waiting */
+
+struct sfs_bufcache {
+	struct lock *bc_lock;           /* protects everything here */
+	struct cv *bc_cv;               /* for waiting on busy buffers */
+	struct sfs_buf *bc_bufs;                        /* all buffers */
+	struct sfs_buf *bc_hash[SFS_CACHE_NBUCKETS];    /* hash chains */
+	struct sfs_buf *bc_lruhead;     /* most recently released */
+	struct sfs_buf *bc_lrutail;     /* next victim */
+
+	unsigned bc_ndirty;             /* number of dirty buffers */
+	unsigned bc_ndelayed;           /* number of delayed buffers */
+	unsigned bc_nmeta;              /* number of sb_meta buffers */
+
+	/* read-ahead thread and its queue of blocks to load */
+	struct cv *bc_racv;             /* for waking the thread */
+	uint32_t bc_raqueue[SFS_RA_QUEUESIZE];
+	unsigned bc_rahead;             /* next block to load */
+	unsigned bc_racount;            /* number of blocks queued */
+	bool bc_raexit;                 /* set at unmount */
+	bool bc_radone;                 /* set by the thread in reply */
+
+	/* statistics */
+	unsigned bc_hits;
+	unsigned bc_misses;
+	unsigned bc_reads;
+	unsigned bc_writes;
+	unsigned bc_rareads;            /* blocks loaded by read-ahead */
+	unsigned bc_rahits;             /* ...and then used */
+	unsigned bc_rawasted;           /* ...and recycled unused */
+	unsigned bc_daassigned;         /* delayed blocks given disk blocks */
+	unsigned bc_early;              /* metadata written before commit */
+};
+
+/*
+ * Metadata journal (see sfs_journal.c).
+ */
+struct sfs_journal {
+	uint32_t j_start;               /* first block of the log */
+	uint32_t j_nblocks;             /* size of the log */
+	uint32_t j_seq;                 /* sequence number of next commit */
+	unsigned j_pinmax;              /* commit early past this many */
+	struct sfs_buf **j_bufs;        /* buffers being committed */
+	void *j_run;                    /* SFS_JOURNAL_RUN blocks of space */
+
+	struct lock *j_lock;            /* protects the six below */
+	struct cv *j_cv;
+	unsigned j_active;              /* operations in progress */
+	bool j_committing;              /* a commit is waiting or running */
+	bool j_locked;                  /* ...and is running */
+	unsigned j_ncommits;            /* commits finished */
+	int j_result;                   /* ...and how the last one went */
+
+	/* blocks freed since the last commit (under sfs_freemaplock) */
+	struct bitmap *j_freed;
+	uint32_t j_freedlo, j_freedhi;  /* bounds of the marked range */
+	unsigned j_nfreed;
+
+	/* statistics */
+	unsigned j_logged;              /* blocks copied into the log */
+	unsigned j_overflows;           /* commits too big for the log */
 };
 
 struct sfs_fs {
@@ -60,16 +175,105 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* loaded vnodes, hashed by ino */
+	unsigned sfs_vnhashsize;        /* number of chains (power of 2) */
+	unsigned sfs_nvnodes;           /* number of loaded vnodes */
+	struct lock *sfs_vnlock;        /* protects the three above */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_mapdirty;    /* ...which blocks of it */
+	uint32_t *sfs_regionfree;       /* free blocks in each region */
+	unsigned sfs_nregions;          /* number of allocation regions */
+	uint32_t sfs_nfree;             /* free blocks in all */
+	uint32_t sfs_nreserved;         /* ...promised to delayed buffers */
+	struct lock *sfs_freemaplock;   /* protects the eight above */
+	struct sfs_bufcache *sfs_cache; /* block buffer cache */
+	struct sfs_syncer *sfs_syncer;  /* background flush thread */
+	struct sfs_journal *sfs_journal; /* metadata log, or NULL */
+};
+
+/* Number of directory entries in a block */
+#define SFS_DIRPERBLOCK  (SFS_BLOCKSIZE / sizeof(struct sfs_dir))
+
+/* Largest file mapped by block pointers, in blocks */
+#define SFS_MAXFILEBLOCKS  (SFS_NDIRECT + SFS_DBPERIDB + \
+			    SFS_DBPERIDB * SFS_DBPERIDB + \
+			    SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+
+/* Largest extent-mapped file, in blocks (sfi_size is 32 bits) */
+#define SFS_MAXEXTFILEBLOCKS  (0xffffffffU / SFS_BLOCKSIZE)
+
+/* Longest run sfs_io moves in one device transfer, in blocks */
+#define SFS_MAXRUN  64
+
+/*
+ * The allocator divides the disk into regions of this many blocks and
+ * keeps a free count for each. New objects avoid starting in a region
+ * with less than SFS_REGION_MINFREE blocks left.
+ */
+#define SFS_REGIONBLOCKS    1024
+#define SFS_REGION_MINFREE  (SFS_REGIONBLOCKS / 8)
+
+/*
+ * Delayed allocation. At most SFS_DELALLOC_MAX buffers of file data
+ * wait in the cache for disk blocks at once. Each has a block
+ * reserved for it, and no more are taken once fewer than
+ * SFS_DELALLOC_SLACK unreserved blocks are free, leaving room for
+ * the indirect and extent blocks their allocation may need.
+ */
+#define SFS_DELALLOC_MAX    (SFS_CACHE_NBUFS / 4)
+#define SFS_DELALLOC_SLACK  64
+
+/*
+ * Journal tuning. The log is written in transfers of up to
+ * SFS_JOURNAL_RUN blocks. An operation starting while more than
+ * SFS_JOURNAL_PINMAX metadata buffers wait for a commit forces one
+ * first, so the cache doesn't fill up with buffers it can't evict.
+ */
+#define SFS_JOURNAL_RUN      16
+#define SFS_JOURNAL_PINMAX   (SFS_CACHE_NBUFS / 4)
+
+/* Directories with this many entries get hashed once they fill up */
+#define SFS_DIRHASH_MINENTRIES  (8 * SFS_DIRPERBLOCK)
+
+/*
+ * The vnode table starts with this many hash chains and doubles
+ * whenever the average chain gets longer than two.
+ */
+#define SFS_VNHASH_INITSIZE  32
+
+/*
+ * State shared with the syncer thread. It is separate from struct
+ * sfs_fs so unmount can detach from the thread without waiting for
+ * it: unmount sets sy_exit, and the syncer frees this when it sees
+ * it. Both sides only look at it under the vfs biglock.
+ */
+struct sfs_syncer {
+	struct sfs_fs *sy_fs;           /* filesystem to flush */
+	bool sy_exit;                   /* set by unmount */
 };
 
+/*
+ * Syncer tuning. Dirty blocks are written back every
+ * sfs_syncer_interval seconds, or sooner once more than
+ * sfs_syncer_dirtymax buffers are dirty. Set from the kernel menu.
+ */
+#define SFS_SYNCER_INTERVAL   5
+#define SFS_SYNCER_DIRTYMAX   (SFS_CACHE_NBUFS / 2)
+extern unsigned sfs_syncer_interval;
+extern unsigned sfs_syncer_dirtymax;
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print buffer cache and read-ahead statistics for the sfs mounted
+ * on DEVICE.
+ */
+int sfs_stats(const char *device);
+
 
 /*
  * Internal functions
@@ -84,6 +288,46 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Buffer cache (sfs_cache.c) */
+int sfs_cache_init(struct sfs_fs *sfs);
+void sfs_cache_destroy(struct sfs_fs *sfs);
+int sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void sfs_buf_markdirty(struct sfs_fs *sfs, struct sfs_buf *buf);
+void sfs_buf_markmeta(struct sfs_fs *sfs, struct sfs_buf *buf);
+int sfs_buf_release(struct sfs_fs *sfs, struct sfs_buf *buf);
+void sfs_buf_invalidate(struct sfs_fs *sfs, uint32_t block);
+int sfs_buf_getdelayed(struct sfs_fs *sfs, struct sfs_vnode *sv,
+		       uint32_t fileblock, bool create, struct sfs_buf **ret);
+void sfs_buf_assign(struct sfs_fs *sfs, struct sfs_buf *buf, uint32_t block);
+unsigned sfs_buf_delayedlist(struct sfs_fs *sfs, struct sfs_vnode *sv,
+			     uint32_t *fileblocks, unsigned max);
+unsigned sfs_buf_discard(struct sfs_fs *sfs, struct sfs_vnode *sv,
+			 uint32_t fromblock);
+bool sfs_buf_cached(struct sfs_fs *sfs, uint32_t block);
+void sfs_buf_readahead(struct sfs_fs *sfs, uint32_t block);
+void sfs_cache_printstats(struct sfs_fs *sfs);
+int sfs_buf_flush(struct sfs_fs *sfs);
+unsigned sfs_buf_metalist(struct sfs_fs *sfs, struct sfs_buf **bufs,
+			  unsigned max);
+int sfs_buf_checkpoint(struct sfs_fs *sfs, struct sfs_buf *buf);
+
+/* Metadata journal (sfs_journal.c) */
+int sfs_journal_load(struct sfs_fs *sfs);
+void sfs_journal_destroy(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jjoin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+bool sfs_jfree(struct sfs_fs *sfs, uint32_t block);
+void sfs_journal_printstats(struct sfs_fs *sfs);
+
+/* Hooks into sfs_fsops.c and sfs_vnops.c for the journal */
+int sfs_mapflush(struct sfs_fs *sfs);
+void sfs_bunmark(struct sfs_fs *sfs, uint32_t block);
+int sfs_sync_inodes(struct sfs_fs *sfs);
+int sfs_flushvnode(struct vnode *v);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -67,6 +67,11 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int printfile(int, char **);
 int inlinetest(int, char **);
+int lookuptest(int, char **);
+int bigiotest(int, char **);
+
+/* device tests */
+int diskbench(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
@@ -81,6 +81,33 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Directory name lookup cache. Filesystems call these from their
+ * directory code; see vfsnamecache.c. COOKIE is for the filesystem's
+ * use (e.g. where in the directory the name was found).
+ *
+ *    vfs_nc_lookup   - Look up NAME in DIR. Returns VFS_NC_HIT and
+ *                      sets INO and COOKIE, VFS_NC_NEGATIVE if NAME
+ *                      is known not to exist, or VFS_NC_MISS.
+ *    vfs_nc_enter    - Record that NAME in DIR is INO, at COOKIE.
+ *    vfs_nc_enter_negative - Record that NAME does not exist in DIR.
+ *    vfs_nc_remove   - Forget NAME in DIR.
+ *    vfs_nc_purgedir - Forget everything in DIR. Must be called
+ *                      before DIR is freed (vnode_cleanup does it).
+ */
+
+#define VFS_NC_MISS      0
+#define VFS_NC_HIT       1
+#define VFS_NC_NEGATIVE  2
+
+int vfs_nc_lookup(struct vnode *dir, const char *name,
+		  uint32_t *ino, int *cookie);
+void vfs_nc_enter(struct vnode *dir, const char *name,
+		  uint32_t ino, int cookie);
+void vfs_nc_enter_negative(struct vnode *dir, const char *name);
+void vfs_nc_remove(struct vnode *dir, const char *name);
+void vfs_nc_purgedir(struct vnode *dir);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because namei may destroy pathnames, these all may too.
@@ -120,6 +147,8 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_bootstrap - Call during system initialization to allocate 
  *                    structures.
  *
+ *    vfs_nc_bootstrap - Set up the name cache; called by vfs_bootstrap.
+ *
  *    vfs_setbootfs - Set the filesystem that paths beginning with a
  *                    slash are sent to. If not set, these paths fail
  *                    with ENOENT. The argument should be the device
@@ -160,6 +189,7 @@ int vfs_getcwd(struct uio *buf);
  */
 
 void vfs_bootstrap(void);
+void vfs_nc_bootstrap(void);
 
 int vfs_setbootfs(const char *fsname);
 void vfs_clearbootfs(void);
@@ -74,54 +74,76 @@ struct addrspace;
  * to hold flags.
  *
  *     LPF_DIRTY    is set if the page has been modified.
- *     LPF_PINNED   is set if the page is in transit to/from disk.
+ *     LPF_BUSY     is set while the page is being read in from swap.
+ *                  Anyone else who wants the page waits for it to
+ *                  clear (lpage_lock_resident). A page being written
+ *                  out is instead held pinned in the coremap.
  *
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * After fork, parent and child share their lpages copy-on-write;
+ * lp_refcount counts the vm_object slots referring to the lpage. A
+ * shared page is only ever mapped read-only, and the first write to
+ * it from either side makes a private copy (lpage_unshare).
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
 	off_t lp_swapaddr;
+	unsigned lp_refcount;		/* protected by lp_spinlock */
 	struct spinlock lp_spinlock;
 };
 
 /* lpage flags */
 #define LPF_DIRTY		0x1
-#define LPF_MASK		0x1	// mask for the above
+#define LPF_BUSY		0x2
+#define LPF_MASK		0x3	// mask for the above
 
 #define LP_ISDIRTY(lp)		((lp)->lp_paddr & LPF_DIRTY)
+#define LP_ISBUSY(lp)		((lp)->lp_paddr & LPF_BUSY)
 
-#define LP_SET(am, bit)		((lp)->lp_paddr |= (bit))
-#define LP_CLEAR(am, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
+#define LP_SET(lp, bit)		((lp)->lp_paddr |= (bit))
+#define LP_CLEAR(lp, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
 
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - set up at boot
  *    lpage_create - create a blank, non-materialized lpage structure.
- *    lpage_destroy - destroy an lpage
+ *    lpage_destroy - drop a reference to an lpage; destroy it if last
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
- *    lpage_copy - clone an lpage, including the contents
+ *    lpage_share - add a copy-on-write reference to an lpage
+ *    lpage_unshare - get a private copy of an lpage for writing
  *    lpage_zerofill - materialize an lpage and zero-fill it
- *    lpage_fault - handle a fault on an lpage
+ *    lpage_fault - handle a fault on an lpage, reading in the
+ *                  lpages after it along with it if they're in swap
  *    lpage_evict - evict an lpage
+ *    lpage_evict_cluster - evict several lpages, writing out dirty
+ *                  ones that are adjacent in swap together
+ *
+ * Functions that create lpages take a swap address to try to put the
+ * new page at (see vm_object_swaphint), or INVALID_SWAPADDR.
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
-int	              lpage_copy(struct lpage *from, struct lpage **toret);
-int               lpage_zerofill(struct lpage **lpret);
-int               lpage_fault(struct lpage *lp, struct addrspace *,
+void              lpage_share(struct lpage *lp);
+int               lpage_unshare(struct lpage *lp, struct lpage **lpret,
+					off_t swaphint);
+int               lpage_zerofill(struct lpage **lpret, off_t swaphint);
+int               lpage_fault(struct lpage *lp, struct lpage *const *ahead,
+					  unsigned nahead, struct addrspace *,
 			                  int faulttype, vaddr_t va);
 void              lpage_evict(struct lpage *victim);
+void              lpage_evict_cluster(struct lpage *const *victims,
+					  unsigned n);
 
 ////////////////////////////////////////////////////////////
 //
@@ -153,17 +175,23 @@ struct vm_object {
  * vm_object_copy:    clone a vm_object, as at fork time.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
  * vm_object_destroy: frees all the mapping entries and swap space.
+ * vm_object_swaphint: pick a swap address for a new page next to its
+ *                    neighbours' swap pages.
+ * vm_object_swapnext: collect the lpages following one in a vm_object
+ *                    whose swap pages follow its swap page.
  *
  */
 struct vm_object 	*vm_object_create(size_t npages);
 int			        vm_object_copy(struct vm_object *vmo,
-					               struct addrspace *newas,
 					               struct vm_object **newvmo_ret);
 int                 vm_object_setsize(struct addrspace *as,
 					                  struct vm_object *vmo,
 					                  unsigned newnpages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
+off_t			 vm_object_swaphint(struct vm_object *vmo, unsigned index);
+unsigned		 vm_object_swapnext(struct vm_object *vmo, unsigned index,
+					    struct lpage **ahead, unsigned max);
 
 ////////////////////////////////////////////////////////////
 //
@@ -178,7 +206,8 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_shutdown:    closes the swapfile vnode. Declared in vm.h.
  * 
- * swap_alloc:       finds a free swap page and marks it as used.
+ * swap_alloc:       finds a free swap page and marks it as used,
+ *                   preferring the one given as a hint if it's free.
  *                   A page should have been previously reserved.
  *
  * swap_free:        unmarks a swap page.
@@ -192,9 +221,18 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_pageout:     Writes a page to the requested swap address 
  *                   from the requested physical page.
+ *
+ * swap_pagein_cluster/swap_pageout_cluster:
+ *                   Same, for up to SWAP_CLUSTER pages that live in
+ *                   consecutive swap pages, with one I/O.
+ *
+ * swap_printstats:  print swap I/O counts.
  */
 
-off_t	 	swap_alloc(void);
+/* Most pages moved to or from swap in one I/O. */
+#define SWAP_CLUSTER	8
+
+off_t	 	swap_alloc(off_t hint);
 void 		swap_free(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
@@ -202,6 +240,11 @@ void		swap_unreserve(unsigned long npages);
 
 void 		swap_pagein(paddr_t paddr, off_t swapaddr);
 void 		swap_pageout(paddr_t paddr, off_t swapaddr);
+void		swap_pagein_cluster(const paddr_t *paddrs, unsigned npages,
+				    off_t swapaddr);
+void		swap_pageout_cluster(const paddr_t *paddrs, unsigned npages,
+				     off_t swapaddr);
+void		swap_printstats(void);
 
 /*
  * Special disk address:
@@ -209,13 +252,6 @@ void 		swap_pageout(paddr_t paddr, off_t swapaddr);
  */
 #define INVALID_SWAPADDR	(0)
 
-/*
- * Global lock for paging. Only one page can be in transit at a time
- * (at least under current circumstances) so we get this at a fairly
- * high level to try to improve paging decisions.
- */
-extern struct lock *global_paging_lock;
-
 ////////////////////////////////////////////////////////////
 //
 // other bits
@@ -31,6 +31,8 @@
 #define _VNODE_H_
 
 
+#include <spinlock.h>
+
 struct uio;
 struct stat;
 
@@ -50,9 +52,13 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_refcount is protected by vn_countlock, so that references can
+ * be taken and dropped without the vfs biglock.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
+	struct spinlock vn_countlock;   /* Lock for vn_refcount */
 	int vn_opencount;
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
@@ -98,6 +104,11 @@ struct vnode {
  *                      amount read, and updating uio_offset to match.
  *                      Not allowed on directories or symlinks.
  *
+ *    vop_readahead   - Hint that the LEN bytes of the file at POS are
+ *                      likely to be read soon. The filesystem may start
+ *                      loading them in the background, or ignore the
+ *                      hint; it should not wait for any I/O.
+ *
  *    vop_readlink    - Read the contents of a symlink into a uio.
  *                      Not allowed on other types of object.
  *
@@ -201,6 +212,7 @@ struct vnode_ops {
 
 
 	int (*vop_read)(struct vnode *file, struct uio *uio);
+	int (*vop_readahead)(struct vnode *file, off_t pos, off_t len);
 	int (*vop_readlink)(struct vnode *link, struct uio *uio);
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
@@ -246,6 +258,7 @@ struct vnode_ops {
 #define VOP_RECLAIM(vn)                 (__VOP(vn, reclaim)(vn))
 
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
+#define VOP_READAHEAD(vn, pos, len)     (__VOP(vn, readahead)(vn, pos, len))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
@@ -95,31 +95,88 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the first word in [IX, LIMIT) that isn't full, or LIMIT if
+ * there isn't one. Full stretches are skipped four words at a time,
+ * testing them together with one comparison.
+ */
+static
+unsigned
+bitmap_skipfull(const struct bitmap *b, unsigned ix, unsigned limit)
+{
+        const WORD_TYPE *v = b->v;
+
+        while (ix + 4 <= limit &&
+               (v[ix] & v[ix+1] & v[ix+2] & v[ix+3]) == WORD_ALLBITS) {
+                ix += 4;
+        }
+        while (ix < limit && v[ix] == WORD_ALLBITS) {
+                ix++;
+        }
+        return ix;
+}
+
+/*
+ * Set and return the first clear bit in word IX at or after bit
+ * FIRSTBIT, if there is one.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_takebit(struct bitmap *b, unsigned ix, unsigned firstbit,
+               unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
         unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        for (offset = firstbit; offset < BITS_PER_WORD; offset++) {
+                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = (ix*BITS_PER_WORD)+offset;
+                        KASSERT(*index < b->nbits);
+                        return 0;
                 }
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc_from(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned hintix, ix;
+
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        hintix = hint / BITS_PER_WORD;
+
+        /* The rest of the word the hint is in */
+        if (bitmap_takebit(b, hintix, hint % BITS_PER_WORD, index) == 0) {
+                return 0;
+        }
+
+        /* Then on to the end, then around from the start */
+        ix = bitmap_skipfull(b, hintix + 1, maxix);
+        if (ix == maxix) {
+                ix = bitmap_skipfull(b, 0, hintix + 1);
+                if (ix == hintix + 1) {
+                        return ENOSPC;
+                }
+        }
+        if (bitmap_takebit(b, ix, 0, index) == 0) {
+                return 0;
+        }
+        KASSERT(0);
+        return ENOSPC;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_from(b, 0, index);
+}
+
 static
 inline
 void
@@ -39,6 +39,7 @@
 #include <thread.h>
 #include <vfs.h>
 #include <syscall.h>
+#include <vm.h>
 #include <test.h>
 
 /* BEGIN A3 SETUP */
@@ -492,6 +493,67 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/* BEGIN A3 SETUP */
+#if OPT_SFS
+/*
+ * Command for tuning the sfs syncer: how often it writes dirty
+ * blocks back, and how many dirty buffers trigger an early flush.
+ */
+static
+int
+cmd_syncer(int nargs, char **args)
+{
+	int interval, dirtymax;
+
+	if (nargs == 1) {
+		kprintf("sfs syncer: every %u seconds, or at %u dirty "
+			"buffers\n", sfs_syncer_interval, sfs_syncer_dirtymax);
+		return 0;
+	}
+	if (nargs != 3) {
+		kprintf("Usage: syncer [seconds dirtybuffers]\n");
+		return EINVAL;
+	}
+
+	interval = atoi(args[1]);
+	dirtymax = atoi(args[2]);
+	if (interval < 1 || dirtymax < 1 || dirtymax > SFS_CACHE_NBUFS) {
+		kprintf("syncer: need seconds >= 1 and "
+			"1 <= dirtybuffers <= %d\n", SFS_CACHE_NBUFS);
+		return EINVAL;
+	}
+	sfs_syncer_interval = interval;
+	sfs_syncer_dirtymax = dirtymax;
+
+	return 0;
+}
+
+/*
+ * Command for printing sfs buffer cache and read-ahead statistics.
+ */
+static
+int
+cmd_sfsstat(int nargs, char **args)
+{
+	char *device;
+
+	if (nargs != 2) {
+		kprintf("Usage: sfsstat device:\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	return sfs_stats(device);
+}
+#endif
+/* END A3 SETUP */
+
 /*
  * Command to set the "boot fs". 
  *
@@ -533,6 +595,23 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+/*
+ * Command for printing VM counters (faults, evictions, replacement).
+ */
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -573,6 +652,10 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+#if OPT_SFS
+	"[syncer]  Tune sfs syncer           ",
+	"[sfsstat] Sfs cache statistics      ",
+#endif
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -610,6 +693,9 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS long stress        (4)     ",
+	"[fs7] Vnode lookup timing   (4)     ",
+	"[fs8] Large file I/O        (4)     ",
+	"[db]  Disk throughput benchmark     ",
 	NULL
 };
 
@@ -634,6 +720,9 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+#if !OPT_DUMBVM
+	"[vm] VM system stats                ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -675,6 +764,10 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+#if OPT_SFS
+	{ "syncer",	cmd_syncer },
+	{ "sfsstat",	cmd_sfsstat },
+#endif
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -682,6 +775,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -720,6 +816,11 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
         { "fs6",        inlinetest },
+	{ "fs7",	lookuptest },
+	{ "fs8",	bigiotest },
+
+	/* device benchmarks */
+	{ "db",		diskbench },
 
 	{ NULL, NULL }
 };
@@ -63,6 +63,9 @@ file_open(char *filename, int flags, int mode, int *retfd)
 	fte->f_name = filename;
 	fte->offset = 0;
 	fte->numopen = 1;
+	fte->f_ranext = 0;
+	fte->f_raend = 0;
+	fte->f_rawindow = 0;
 	fte->f_lock = lock_create("file lock");
 	fileLocation = filetable_getfd();
 
@@ -135,6 +138,46 @@ file_close(int fd)
 	return 0;
 }
 
+/*
+ * file_readahead
+ * Called with the entry's lock held after each read of [POS, ENDPOS)
+ * through FTE. A read that starts where the last one ended is
+ * sequential: the read-ahead window grows, and the filesystem is
+ * asked to start loading the window past ENDPOS (less whatever it
+ * was already asked for). Any other read collapses the window.
+ */
+void
+file_readahead(struct ft_entry *fte, off_t pos, off_t endpos)
+{
+	off_t start, end;
+
+	if (pos != fte->f_ranext) {
+		// Seek - not sequential (any more)
+		fte->f_rawindow = 0;
+		fte->f_raend = 0;
+	}
+	else if (fte->f_rawindow == 0) {
+		fte->f_rawindow = FILE_RA_MIN;
+	}
+	else if (fte->f_rawindow < FILE_RA_MAX) {
+		fte->f_rawindow *= 2;
+	}
+	fte->f_ranext = endpos;
+
+	// Nothing to do if not sequential, or at EOF
+	if (fte->f_rawindow == 0 || endpos == pos) {
+		return;
+	}
+
+	start = fte->f_raend > endpos ? fte->f_raend : endpos;
+	end = endpos + fte->f_rawindow;
+	if (start < end) {
+		// Only a hint, so errors don't matter
+		(void)VOP_READAHEAD(fte->f_vnode, start, end - start);
+		fte->f_raend = end;
+	}
+}
+
 /*** filetable functions ***/
 
 /* 
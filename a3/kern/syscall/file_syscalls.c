@@ -201,6 +201,9 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 		lock_release(cur_fte->f_lock);
 		return result;
 	}
+	// Start reading ahead if this looks sequential
+	file_readahead(cur_fte, cur_fte->offset, user_uio.uio_offset);
+
 	// Change the default offset to file table entry offset
 	cur_fte->offset = user_uio.uio_offset;
 	lock_release(cur_fte->f_lock);
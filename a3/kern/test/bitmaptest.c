@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,15 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Allocating from a hint goes forward, then wraps around */
+	bitmap_unmark(b, 17);
+	bitmap_unmark(b, 300);
+	KASSERT(bitmap_alloc_from(b, 18, &x)==0);
+	KASSERT(x == 300);
+	KASSERT(bitmap_alloc_from(b, 301, &x)==0);
+	KASSERT(x == 17);
+	KASSERT(bitmap_alloc_from(b, 0, &x)==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disk throughput benchmark.
+ *
+ * Reads from the raw device in requests of 1, 8, and 64 sectors and
+ * reports the throughput for each size. Only reads, so it is safe to
+ * run on a disk with a filesystem on it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <stat.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define SECTSIZE     512
+#define MAXSECTS     64
+#define BENCHBYTES   (256*1024)
+
+static const unsigned benchsizes[] = { 1, 8, MAXSECTS };
+
+/*
+ * Read BENCHBYTES in requests of NSECT sectors, wrapping around at
+ * the end of the disk, and print the throughput.
+ */
+static
+int
+diskbench_run(struct vnode *vn, off_t disksize, char *buf, unsigned nsect)
+{
+	struct iovec iov;
+	struct uio ku;
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t usecs;
+	size_t reqsize = nsect * SECTSIZE;
+	off_t pos = 0;
+	unsigned done, kbps;
+	int result;
+
+	gettime(&s1, &ns1);
+	for (done = 0; done < BENCHBYTES; done += reqsize) {
+		if (pos + reqsize > disksize) {
+			pos = 0;
+		}
+		uio_kinit(&iov, &ku, buf, reqsize, pos, UIO_READ);
+		result = VOP_READ(vn, &ku);
+		if (result) {
+			kprintf("diskbench: read at %llu: %s\n", pos,
+				strerror(result));
+			return result;
+		}
+		pos += reqsize;
+	}
+	gettime(&s2, &ns2);
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kbps = (uint64_t)done * 1000000 / 1024 / usecs;
+
+	kprintf("  %2u sectors/request: %u KB in %lu.%06lu s = "
+		"%u.%02u MB/s\n", nsect, done/1024, (unsigned long)secs,
+		(unsigned long)(nsecs/1000), kbps/1024, (kbps%1024)*100/1024);
+	return 0;
+}
+
+int
+diskbench(int nargs, char **args)
+{
+	char path[32];
+	char *device;
+	struct vnode *vn;
+	struct stat st;
+	char *buf;
+	unsigned i;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: db disk (e.g. db lhd0)\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device name */
+	device = args[1];
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	/* Go through the raw device so no filesystem gets involved */
+	snprintf(path, sizeof(path), "%sraw:", device);
+	result = vfs_open(path, O_RDONLY, 0, &vn);
+	if (result) {
+		kprintf("diskbench: %s: %s\n", path, strerror(result));
+		return result;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result == 0 && st.st_size < MAXSECTS * SECTSIZE) {
+		kprintf("diskbench: %s: disk too small\n", path);
+		result = EINVAL;
+	}
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+
+	buf = kmalloc(MAXSECTS * SECTSIZE);
+	if (buf == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
+
+	kprintf("Disk read throughput for %s:\n", device);
+	for (i=0; i<sizeof(benchsizes)/sizeof(benchsizes[0]); i++) {
+		result = diskbench_run(vn, st.st_size, buf, benchsizes[i]);
+		if (result) {
+			break;
+		}
+	}
+
+	kfree(buf);
+	vfs_close(vn);
+	return result;
+}
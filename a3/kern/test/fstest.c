@@ -42,6 +42,7 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <clock.h>
 #include <uio.h>
 #include <thread.h>
 #include <synch.h>
@@ -720,6 +721,207 @@ doinlinetest(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Vnode lookup timing: create and hold open LOOKUP_NFILES files, so
+ * all their vnodes stay loaded, then time repeated lookups of them.
+ */
+
+#define LOOKUP_NFILES   256
+#define LOOKUP_NPASSES  8
+
+static
+void
+dolookuptest(const char *filesys)
+{
+	struct vnode **vns;
+	struct vnode *vn;
+	char name[32];
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t usecs;
+	unsigned i, pass, nopen, nlookups;
+	int err;
+
+	kprintf("*** Starting vnode lookup test on %s:\n", filesys);
+
+	vns = kmalloc(LOOKUP_NFILES * sizeof(struct vnode *));
+	if (vns == NULL) {
+		kprintf("*** Out of memory\n");
+		return;
+	}
+
+	for (nopen=0; nopen<LOOKUP_NFILES; nopen++) {
+		/* vfs_open destroys the string it's passed */
+		snprintf(name, sizeof(name), "%s:lookup%u", filesys, nopen);
+		err = vfs_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664,
+			       &vns[nopen]);
+		if (err) {
+			kprintf("Could not create file %u: %s\n", nopen,
+				strerror(err));
+			goto cleanup;
+		}
+	}
+
+	nlookups = 0;
+	gettime(&s1, &ns1);
+	for (pass=0; pass<LOOKUP_NPASSES; pass++) {
+		for (i=0; i<nopen; i++) {
+			snprintf(name, sizeof(name), "%s:lookup%u",
+				 filesys, i);
+			err = vfs_lookup(name, &vn);
+			if (err) {
+				kprintf("Lookup of file %u failed: %s\n", i,
+					strerror(err));
+				goto cleanup;
+			}
+			KASSERT(vn == vns[i]);
+			VOP_DECREF(vn);
+			nlookups++;
+		}
+	}
+	gettime(&s2, &ns2);
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	kprintf("%u lookups with %u vnodes loaded: %lu.%06lu s, "
+		"%lu us/lookup\n", nlookups, nopen, (unsigned long)secs,
+		(unsigned long)(nsecs/1000),
+		(unsigned long)(usecs / nlookups));
+
+ cleanup:
+	for (i=0; i<nopen; i++) {
+		vfs_close(vns[i]);
+		snprintf(name, sizeof(name), "%s:lookup%u", filesys, i);
+		vfs_remove(name);
+	}
+	kfree(vns);
+
+	kprintf("*** Vnode lookup test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Large file I/O: write a file much bigger than the direct and
+ * indirect blocks of an inode can map, in big sequential requests,
+ * then read it back, check it, and report how long each took.
+ */
+
+#define BIGIO_FILESIZE  (1024*1024)
+#define BIGIO_CHUNK     (32*1024)
+
+/* Time from (s1,ns1) until now, in microseconds (at least 1) */
+static
+uint64_t
+bigio_usecs(time_t s1, uint32_t ns1)
+{
+	time_t s2, secs;
+	uint32_t ns2, nsecs;
+	uint64_t usecs;
+
+	gettime(&s2, &ns2);
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	return usecs > 0 ? usecs : 1;
+}
+
+static
+int
+bigio_pass(struct vnode *vn, char *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	time_t s1;
+	uint32_t ns1, j;
+	uint64_t usecs;
+	off_t pos;
+	int err;
+
+	gettime(&s1, &ns1);
+	for (pos = 0; pos < BIGIO_FILESIZE; pos += BIGIO_CHUNK) {
+		if (rw == UIO_WRITE) {
+			for (j=0; j<BIGIO_CHUNK; j+=sizeof(uint32_t)) {
+				*(uint32_t *)(buf + j) = pos + j;
+			}
+		}
+		uio_kinit(&iov, &ku, buf, BIGIO_CHUNK, pos, rw);
+		err = rw == UIO_WRITE ? VOP_WRITE(vn, &ku) : VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s at %llu: %s\n",
+				rw == UIO_WRITE ? "Write" : "Read", pos,
+				strerror(err));
+			return err;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("Short %s at %llu\n",
+				rw == UIO_WRITE ? "write" : "read", pos);
+			return EIO;
+		}
+		if (rw == UIO_READ) {
+			for (j=0; j<BIGIO_CHUNK; j+=sizeof(uint32_t)) {
+				if (*(uint32_t *)(buf + j) != pos + j) {
+					kprintf("Bad data at %llu\n", pos + j);
+					return EIO;
+				}
+			}
+		}
+	}
+	usecs = bigio_usecs(s1, ns1);
+
+	kprintf("%s %u KB in %lu us: %lu KB/s\n",
+		rw == UIO_WRITE ? "Wrote" : "Read", BIGIO_FILESIZE/1024,
+		(unsigned long)usecs,
+		(unsigned long)((uint64_t)BIGIO_FILESIZE * 1000000 / 1024 /
+				usecs));
+	return 0;
+}
+
+static
+void
+dobigiotest(const char *filesys)
+{
+	struct vnode *vn;
+	char name[32];
+	char *buf;
+	int err;
+
+	kprintf("*** Starting large file I/O test on %s:\n", filesys);
+
+	buf = kmalloc(BIGIO_CHUNK);
+	if (buf == NULL) {
+		kprintf("*** Out of memory\n");
+		return;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	snprintf(name, sizeof(name), "%s:bigio.tmp", filesys);
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kfree(buf);
+		return;
+	}
+
+	err = bigio_pass(vn, buf, UIO_WRITE);
+	if (!err) {
+		/* Push it to disk so the read comes from the device */
+		err = VOP_FSYNC(vn);
+	}
+	if (!err) {
+		err = bigio_pass(vn, buf, UIO_READ);
+	}
+	kprintf("%s\n", err ? "FAILED" : "PASSED");
+
+	vfs_close(vn);
+	snprintf(name, sizeof(name), "%s:bigio.tmp", filesys);
+	vfs_remove(name);
+	kfree(buf);
+
+	kprintf("*** Large file I/O test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -727,7 +929,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[12345678] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -760,6 +962,8 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(inlinetest);
+DEFTEST(lookuptest);
+DEFTEST(bigiotest);
 
 ////////////////////////////////////////////////////////////
 
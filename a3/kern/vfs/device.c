@@ -98,6 +98,19 @@ dev_read(struct vnode *v, struct uio *uio)
 	return d->d_io(d, uio);
 }
 
+/*
+ * Called for readahead. Devices do their own buffering, if any.
+ */
+static
+int
+dev_readahead(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return 0;
+}
+
 /*
  * Used for several functions with the same type signature that are
  * not meaningful on devices.
@@ -419,6 +432,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	dev_close,
 	dev_reclaim,
 	dev_read,
+	dev_readahead,
 	null_io,      /* readlink */
 	null_io,      /* getdirentry */
 	dev_write,
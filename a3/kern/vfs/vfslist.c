@@ -109,6 +109,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_nc_bootstrap();
+
 	devnull_create();
 }
 
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Directory name lookup cache.
+ *
+ * Maps (directory vnode, name) to whatever the filesystem uses to
+ * find the file: an inode number and a cookie (for sfs, the slot the
+ * entry lives in). Names known not to exist are cached too, as
+ * negative entries.
+ *
+ * The cache doesn't know anything about directory contents; the
+ * filesystem must enter and remove names as it changes directories,
+ * while holding whatever lock protects the directory, and must purge
+ * a directory's entries before its vnode is freed. vnode_cleanup
+ * does the latter.
+ *
+ * There is a fixed pool of entries, recycled in LRU order.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+
+/* Longer names are simply not cached. */
+#define NC_NAMELEN   31
+
+#define NC_NENTRIES  256
+#define NC_NBUCKETS  61
+
+struct nc_entry {
+	struct nc_entry *nc_hashnext;   /* next in hash chain */
+	struct nc_entry *nc_lrunext;    /* LRU list */
+	struct nc_entry *nc_lruprev;
+	struct vnode *nc_dir;           /* directory; NULL if unused */
+	uint32_t nc_ino;                /* file found there */
+	int nc_cookie;                  /* filesystem's position hint */
+	bool nc_negative;               /* true if NAME doesn't exist */
+	char nc_name[NC_NAMELEN+1];
+};
+
+static struct nc_entry nc_entries[NC_NENTRIES];
+static struct nc_entry *nc_hash[NC_NBUCKETS];
+static struct nc_entry *nc_lruhead;     /* most recently used */
+static struct nc_entry *nc_lrutail;     /* next to be recycled */
+static struct spinlock nc_lock;
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU lists
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % NC_NBUCKETS;
+}
+
+static
+void
+nc_lru_remove(struct nc_entry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lrunext = nc->nc_lruprev = NULL;
+}
+
+static
+void
+nc_lru_addhead(struct nc_entry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+static
+void
+nc_lru_addtail(struct nc_entry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+static
+struct nc_entry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct nc_entry *nc;
+
+	nc = nc_hash[nc_hashfunc(dir, name)];
+	while (nc != NULL) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+		nc = nc->nc_hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of the hash table and make it the next one to
+ * be recycled.
+ */
+static
+void
+nc_discard(struct nc_entry *nc)
+{
+	struct nc_entry **ncp;
+
+	ncp = &nc_hash[nc_hashfunc(nc->nc_dir, nc->nc_name)];
+	while (*ncp != nc) {
+		KASSERT(*ncp != NULL);
+		ncp = &(*ncp)->nc_hashnext;
+	}
+	*ncp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+	nc->nc_dir = NULL;
+
+	nc_lru_remove(nc);
+	nc_lru_addtail(nc);
+}
+
+/*
+ * Common code for the two enter functions.
+ */
+static
+void
+nc_enter(struct vnode *dir, const char *name, bool negative,
+	 uint32_t ino, int cookie)
+{
+	struct nc_entry *nc;
+	unsigned b;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		/* Recycle the least recently used entry */
+		nc = nc_lrutail;
+		if (nc->nc_dir != NULL) {
+			nc_discard(nc);
+		}
+		nc->nc_dir = dir;
+		strcpy(nc->nc_name, name);
+		b = nc_hashfunc(dir, name);
+		nc->nc_hashnext = nc_hash[b];
+		nc_hash[b] = nc;
+	}
+	nc->nc_negative = negative;
+	nc->nc_ino = ino;
+	nc->nc_cookie = cookie;
+
+	nc_lru_remove(nc);
+	nc_lru_addhead(nc);
+
+	spinlock_release(&nc_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Look up NAME in DIR.
+ */
+int
+vfs_nc_lookup(struct vnode *dir, const char *name,
+	      uint32_t *ino, int *cookie)
+{
+	struct nc_entry *nc;
+	int ret;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return VFS_NC_MISS;
+	}
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		ret = VFS_NC_MISS;
+	}
+	else {
+		if (nc->nc_negative) {
+			ret = VFS_NC_NEGATIVE;
+		}
+		else {
+			*ino = nc->nc_ino;
+			*cookie = nc->nc_cookie;
+			ret = VFS_NC_HIT;
+		}
+		nc_lru_remove(nc);
+		nc_lru_addhead(nc);
+	}
+	spinlock_release(&nc_lock);
+
+	return ret;
+}
+
+/*
+ * Record that NAME in DIR refers to INO, found at COOKIE.
+ */
+void
+vfs_nc_enter(struct vnode *dir, const char *name, uint32_t ino, int cookie)
+{
+	nc_enter(dir, name, false, ino, cookie);
+}
+
+/*
+ * Record that NAME does not exist in DIR.
+ */
+void
+vfs_nc_enter_negative(struct vnode *dir, const char *name)
+{
+	nc_enter(dir, name, true, 0, 0);
+}
+
+/*
+ * Forget anything we know about NAME in DIR.
+ */
+void
+vfs_nc_remove(struct vnode *dir, const char *name)
+{
+	struct nc_entry *nc;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+	nc = nc_find(dir, name);
+	if (nc != NULL) {
+		nc_discard(nc);
+	}
+	spinlock_release(&nc_lock);
+}
+
+/*
+ * Forget everything about DIR.
+ */
+void
+vfs_nc_purgedir(struct vnode *dir)
+{
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	for (i=0; i<NC_NENTRIES; i++) {
+		if (nc_entries[i].nc_dir == dir) {
+			nc_discard(&nc_entries[i]);
+		}
+	}
+	spinlock_release(&nc_lock);
+}
+
+/*
+ * Set up the cache. Called from vfs_bootstrap.
+ */
+void
+vfs_nc_bootstrap(void)
+{
+	unsigned i;
+
+	spinlock_init(&nc_lock);
+	for (i=0; i<NC_NBUCKETS; i++) {
+		nc_hash[i] = NULL;
+	}
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_NENTRIES; i++) {
+		bzero(&nc_entries[i], sizeof(nc_entries[i]));
+		nc_lru_addtail(&nc_entries[i]);
+	}
+}
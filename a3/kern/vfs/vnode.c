@@ -50,6 +50,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_opencount = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
@@ -66,8 +67,12 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+	/* Make sure no cached names point into a freed directory */
+	vfs_nc_purgedir(vn);
+
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
+	spinlock_cleanup(&vn->vn_countlock);
 	vn->vn_opencount = 0;
 	vn->vn_fs = NULL;
 	vn->vn_data = NULL;
@@ -83,32 +88,40 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
  * Calls VOP_RECLAIM if the refcount hits zero.
+ *
+ * The last reference is not dropped here; VOP_RECLAIM must check
+ * again (under its own locks) that nobody picked the vnode up in the
+ * meantime, and if so consume the reference and return EBUSY.
  */
 void
 vnode_decref(struct vnode *vn)
 {
+	bool destroy;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_refcount>0);
 	if (vn->vn_refcount>1) {
 		vn->vn_refcount--;
+		destroy = false;
 	}
 	else {
+		destroy = true;
+	}
+	spinlock_release(&vn->vn_countlock);
+
+	if (destroy) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +129,6 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
-
-	vfs_biglock_release();
 }
 
 /*
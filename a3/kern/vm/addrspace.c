@@ -114,7 +114,7 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 
-		result = vm_object_copy(vmo, newas, &newvmo);
+		result = vm_object_copy(vmo, &newvmo);
 		if (result) {
 			goto fail;
 		}
@@ -138,16 +138,26 @@ fail:
  * as_fault: fault handling. Handle a fault on an address space, of
  * specified type, at specified address.
  *
+ * A write to a page still shared with another address space after
+ * fork gets a private copy of the page first.
+ *
+ * New pages are put in swap next to their neighbours where possible,
+ * and if the page has been paged out, the following pages that are
+ * next to it in swap are offered to lpage_fault to read in with it.
+ *
  * Synchronization: none. We assume the address space is not shared,
- * so we don't lock it.
+ * so we don't lock it. Peeking at lp_refcount without the lpage lock
+ * is safe here: only fork of this address space can raise it, so if
+ * it reads as 1 it stays 1; otherwise lpage_unshare checks again.
  */
 int
 as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 {
 	struct vm_object *faultobj = NULL;
-	struct lpage *lp;
+	struct lpage *lp, *newlp;
+	struct lpage *ahead[SWAP_CLUSTER - 1];
 	vaddr_t bot=0, top;
-	unsigned i, index;
+	unsigned i, index, nahead;
 	int result;
 
 	/* Find the vm_object concerned */
@@ -174,15 +184,34 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 
 	if (lp == NULL) {
 		/* zerofill page */
-		result = lpage_zerofill(&lp);
+		result = lpage_zerofill(&lp,
+			vm_object_swaphint(faultobj, index));
 		if (result) {
 			kprintf("vm: zerofill fault at 0x%x failed\n", va);
 			return result;
 		}
 		lpage_array_set(faultobj->vmo_lpages, index, lp);
 	}
+	else if (faulttype != VM_FAULT_READ && lp->lp_refcount > 1) {
+		/* copy-on-write */
+		result = lpage_unshare(lp, &newlp,
+			vm_object_swaphint(faultobj, index));
+		if (result) {
+			kprintf("vm: copy-on-write fault at 0x%x failed\n", va);
+			return result;
+		}
+		lp = newlp;
+		lpage_array_set(faultobj->vmo_lpages, index, lp);
+	}
+
+	/* An unlocked peek; lpage_fault checks properly. */
+	nahead = 0;
+	if ((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR) {
+		nahead = vm_object_swapnext(faultobj, index, ahead,
+					    SWAP_CLUSTER - 1);
+	}
 	
-	return lpage_fault(lp, as, faulttype, va);
+	return lpage_fault(lp, ahead, nahead, as, faulttype, va);
 }
 
 /*
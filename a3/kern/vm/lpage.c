@@ -33,6 +33,7 @@
 #include <spinlock.h>
 #include <synch.h>
 #include <thread.h>
+#include <wchan.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
@@ -48,12 +49,30 @@ static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
+static volatile uint32_t ct_cow_shares;
+static volatile uint32_t ct_cow_copies;
+static volatile uint32_t ct_prefetched;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
+/* Waiting for pages being read in from swap; see lpage_transit_wait */
+static struct wchan *lpage_transitchan;
+
+/*
+ * lpage_bootstrap: set up at boot.
+ */
+void
+lpage_bootstrap(void)
+{
+	lpage_transitchan = wchan_create("lpagein");
+	if (lpage_transitchan == NULL) {
+		panic("Failed allocating lpage wchan\n");
+	}
+}
+
 void
 vm_printstats(void)
 {
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, mn, mj, de, we, te, cs, cc, pf;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
@@ -61,14 +80,22 @@ vm_printstats(void)
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cs = ct_cow_shares;
+	cc = ct_cow_copies;
+	pf = ct_prefetched;
 	spinlock_release(&stats_spinlock);
 
 	te = de+we;
 
-	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
-		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
+	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults "
+		"(%lu pages read ahead)\n",
+		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj,
+		(unsigned long) pf);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu pages shared on fork, %lu copied on write\n",
+		(unsigned long) cs, (unsigned long) cc);
+	swap_printstats();
 	vm_printmdstats();
 }
 
@@ -88,21 +115,29 @@ lpage_create(void)
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
+	lp->lp_refcount = 1;
 	spinlock_init(&lp->lp_spinlock);
 
 	return lp;
 }
 
 /*
- * lpage_destroy: deallocates a logical page. Releases any RAM or swap
- * pages involved.
+ * lpage_destroy: drops a reference to a logical page. When the last
+ * one goes, deallocates it and releases any RAM or swap pages
+ * involved.
+ *
+ * A page shared copy-on-write stands for one swap page per
+ * reference: the one it has allocated, plus one still reserved for
+ * each other sharer in case they need a copy. So dropping a
+ * reference that isn't the last gives back a reservation.
  *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. So lock and pin
- * together.
+ * together; and decide whether this is the last reference only once
+ * both are held, since lpage_unshare holds the page pinned while
+ * it drops its reference.
  *
- * We assume that lpages are not shared between address spaces and
- * address spaces are not shared between threads.
+ * We assume that address spaces are not shared between threads.
  */
 void 					
 lpage_destroy(struct lpage *lp)
@@ -114,10 +149,26 @@ lpage_destroy(struct lpage *lp)
 	lpage_lock_and_pin(lp);
 
 	pa = lp->lp_paddr & PAGE_FRAME;
+	KASSERT(lp->lp_refcount > 0);
+	if (lp->lp_refcount > 1) {
+		lp->lp_refcount--;
+		lpage_unlock(lp);
+		if (pa != INVALID_PADDR) {
+			coremap_unpin(pa);
+		}
+		swap_unreserve(1);
+		return;
+	}
+
+	/* Only someone holding a reference can be reading it in. */
+	KASSERT(!LP_ISBUSY(lp));
+
 	if (pa != INVALID_PADDR) {
 		DEBUG(DB_VM, "lpage_destroy: freeing paddr 0x%x\n", pa);
 		lp->lp_paddr = INVALID_PADDR;
 		lpage_unlock(lp);
+		/* A former sharer may still have it mapped on another CPU. */
+		mmu_unmap_page(pa);
 		coremap_free(pa, false /* iskern */);
 		coremap_unpin(pa);
 	}
@@ -212,14 +263,14 @@ lpage_lock_and_pin(struct lpage *lp)
 		/*
 		 * If what we just got out of the lpage is *now*
 		 * invalid, because the page was paged out on us,
-		 * we're done. The page can't be paged in again behind
-		 * our back, so assert it hasn't after regrabbing the
-		 * lpage lock.
+		 * we're done -- unless an address space sharing it
+		 * paged it in again behind our back, in which case
+		 * go around again.
 		 */
 		if (pa == INVALID_PADDR) {
+			pinned = INVALID_PADDR;
 			lpage_lock(lp);
-			KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-			break;
+			continue;
 		}
 		/* Pin what we got and try again. */
 		coremap_pin(pa);
@@ -232,12 +283,16 @@ lpage_lock_and_pin(struct lpage *lp)
  * lpage_materialize: create a new lpage and allocate swap and RAM for it.
  * Do not do anything with the page contents though.
  *
+ * The RAM is taken first so that if it can't be had, the caller's
+ * swap reservation is left untouched and the caller can back out.
+ * The swap page goes at SWAPHINT if that's free.
+ *
  * Returns the lpage locked and the physical page pinned.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(struct lpage **lpret, paddr_t *paret, off_t swaphint)
 {
 	struct lpage *lp;
 	paddr_t pa;
@@ -248,19 +303,20 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 		return ENOMEM;
 	}
 
-	swa = swap_alloc();
-	if (swa == INVALID_SWAPADDR) {
+	pa = coremap_allocuser(lp);
+	if (pa == INVALID_PADDR) {
 		lpage_destroy(lp);
 		return ENOSPC;
 	}
-	lp->lp_swapaddr = swa;
 
-	pa = coremap_allocuser(lp);
-	if (pa == INVALID_PADDR) {
-		/* lpage_destroy will clean up the swap */
+	swa = swap_alloc(swaphint);
+	if (swa == INVALID_SWAPADDR) {
+		coremap_free(pa, false /* iskern */);
+		coremap_unpin(pa);
 		lpage_destroy(lp);
 		return ENOSPC;
 	}
+	lp->lp_swapaddr = swa;
 
 	lpage_lock(lp);
 
@@ -274,84 +330,243 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 }
 
 /*
- * lpage_copy: create a new lpage and copy data from another lpage.
+ * lpage_transit_wait: wait for a page that someone else is reading in
+ * from swap. Call with the lpage locked and LPF_BUSY set; returns with
+ * it unlocked. The reader wakes everyone when it's done, so check
+ * again afterwards.
+ *
+ * There is one wchan for all lpages, as for coremap pins: there
+ * shouldn't be much waiting, and a wchan per lpage would be costly.
+ */
+static
+void
+lpage_transit_wait(struct lpage *lp)
+{
+	KASSERT(LP_ISBUSY(lp));
+
+	wchan_lock(lpage_transitchan);
+	lpage_unlock(lp);
+	wchan_sleep(lpage_transitchan);
+}
+
+/*
+ * lpage_lock_resident: lock an lpage and make sure its page is in
+ * RAM, paging it in if necessary. Returns with the lpage locked and
+ * the physical page pinned; *majorret says whether we had to go to
+ * swap.
  *
- * The synchronization for this is kind of unpleasant. We do it like
- * this:
+ * AHEAD is the NAHEAD lpages that come after this one in its
+ * vm_object. When we have to page in, those of them that sit right
+ * after it in swap, and that there is spare memory for, are read in
+ * with it in the same I/O (but left unlocked and unpinned).
  *
- *      1. Create newlp.
- *      2. Materialize a page for newlp, so it's locked and pinned.
- *      3. Lock and pin oldlp.
- *      4. Extract the physical address and swap address.
- *      5. If oldlp wasn't present,
- *      5a.    Unlock oldlp.
- *      5b.    Page in.
- *      5c.    This pins the page in the coremap.
- *      5d.    Leave the page pinned and relock oldlp.
- *      5e.    Assert nobody else paged the page in.
- *      6. Copy.
- *      7. Unlock the lpages first, so we can enter the coremap.
- *      8. Unpin the physical pages.
- *      
+ * Synchronization: while reading from swap the lpage is unlocked and
+ * marked LPF_BUSY; another address space sharing it that faults on it
+ * meanwhile waits for us rather than reading it too. The same goes
+ * for the pages read ahead. Nothing else is held during the I/O, so
+ * faults by other threads, on other pages, carry on.
+ *
+ * Counts the major fault if we had to page in.
  */
+static
 int
-lpage_copy(struct lpage *oldlp, struct lpage **lpret)
+lpage_lock_resident(struct lpage *lp, struct lpage *const *ahead,
+		    unsigned nahead, paddr_t *paret, int *majorret)
 {
-	struct lpage *newlp;
-	paddr_t newpa, oldpa;
+	paddr_t pa, pas[SWAP_CLUSTER];
 	off_t swa;
-	int result;
+	unsigned i, n;
+	bool claimed;
 
-	result = lpage_materialize(&newlp, &newpa);
-	if (result) {
-		return result;
+	if (nahead > SWAP_CLUSTER - 1) {
+		nahead = SWAP_CLUSTER - 1;
 	}
-	KASSERT(coremap_pageispinned(newpa));
 
-	/* Pin the physical page and lock the lpage. */
-	lpage_lock_and_pin(oldlp);
-	oldpa = oldlp->lp_paddr & PAGE_FRAME;
-
-	/*
-	 * If there is no physical page, we allocate one, which pins
-	 * it, and then (re)lock the lpage. Since we are single-
-	 * threaded (if we weren't, we'd hold the address space lock
-	 * to exclude sibling threads) nobody else should have paged
-	 * the page in behind our back.
-	 */
-	if (oldpa == INVALID_PADDR) {
+	*majorret = 0;
+	while (1) {
+		/* Pin the physical page and lock the lpage. */
+		lpage_lock_and_pin(lp);
+		pa = lp->lp_paddr & PAGE_FRAME;
+		if (pa != INVALID_PADDR) {
+			break;
+		}
+		if (LP_ISBUSY(lp)) {
+			lpage_transit_wait(lp);
+			continue;
+		}
+
+		swa = lp->lp_swapaddr;
+		KASSERT(swa != INVALID_SWAPADDR);
+		LP_SET(lp, LPF_BUSY);
+		lpage_unlock(lp);
+
+		/* This pins the new page. */
+		pa = coremap_allocuser(lp);
+		if (pa == INVALID_PADDR) {
+			lpage_lock(lp);
+			LP_CLEAR(lp, LPF_BUSY);
+			lpage_unlock(lp);
+			wchan_wakeall(lpage_transitchan);
+			return ENOMEM;
+		}
+		KASSERT(coremap_pageispinned(pa));
+
 		/*
-		 * XXX this is mostly copied from lpage_fault
+		 * Find the run of pages to read ahead, and mark them
+		 * busy. Their swap addresses are set when they're
+		 * created and never change, so they can be looked at
+		 * unlocked.
 		 */
-		swa = oldlp->lp_swapaddr;
-		lpage_unlock(oldlp);
-		oldpa = coremap_allocuser(oldlp);
-		if (oldpa == INVALID_PADDR) {
-			coremap_unpin(newlp->lp_paddr & PAGE_FRAME);
-			lpage_destroy(newlp);
-			return ENOMEM;
+		pas[0] = pa;
+		for (n=1; n<=nahead; n++) {
+			if (ahead[n-1]->lp_swapaddr != swa + n*PAGE_SIZE) {
+				break;
+			}
+			lpage_lock(ahead[n-1]);
+			claimed = (ahead[n-1]->lp_paddr & PAGE_FRAME) ==
+				INVALID_PADDR && !LP_ISBUSY(ahead[n-1]);
+			if (claimed) {
+				LP_SET(ahead[n-1], LPF_BUSY);
+			}
+			lpage_unlock(ahead[n-1]);
+			if (!claimed) {
+				break;
+			}
+			pas[n] = coremap_allocspare(ahead[n-1]);
+			if (pas[n] == INVALID_PADDR) {
+				lpage_lock(ahead[n-1]);
+				LP_CLEAR(ahead[n-1], LPF_BUSY);
+				lpage_unlock(ahead[n-1]);
+				break;
+			}
 		}
-		KASSERT(coremap_pageispinned(oldpa));
-		lock_acquire(global_paging_lock);
-		swap_pagein(oldpa, swa);
-		lpage_lock(oldlp);
-		lock_release(global_paging_lock);
-		/* Assert nobody else did the pagein. */
-		KASSERT((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		oldlp->lp_paddr = oldpa;
+
+		swap_pagein_cluster(pas, n, swa);
+
+		for (i=1; i<n; i++) {
+			lpage_lock(ahead[i-1]);
+			KASSERT((ahead[i-1]->lp_paddr & PAGE_FRAME) ==
+				INVALID_PADDR);
+			KASSERT(LP_ISBUSY(ahead[i-1]));
+			/* clean, so it can be discarded unused */
+			ahead[i-1]->lp_paddr = pas[i];
+			lpage_unlock(ahead[i-1]);
+			coremap_unpin(pas[i]);
+		}
+
+		lpage_lock(lp);
+		KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+		KASSERT(LP_ISBUSY(lp));
+		lp->lp_paddr = pa;
+		*majorret = 1;
+
+		wchan_wakeall(lpage_transitchan);
+
+		spinlock_acquire(&stats_spinlock);
+		ct_majfaults++;
+		ct_prefetched += n - 1;
+		spinlock_release(&stats_spinlock);
+		break;
 	}
 
-	KASSERT(coremap_pageispinned(oldpa));
+	KASSERT(coremap_pageispinned(pa));
+	*paret = pa;
+	return 0;
+}
+
+/*
+ * lpage_share: add a reference to an lpage, for fork. The page
+ * becomes copy-on-write: nobody may map it writable again until
+ * lpage_unshare gives them their own copy. So if it's currently
+ * mapped anywhere (possibly writable) remove that mapping.
+ *
+ * The new reference's swap page comes out of the reservation the
+ * caller made for the slot it's being put in; see lpage_destroy.
+ *
+ * Synchronization: lock and pin, then unlock before calling into the
+ * MMU code, which may need to wait for a TLB shootdown.
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	paddr_t pa;
 
-	coremap_copy_page(oldpa, newpa);
+	lpage_lock_and_pin(lp);
+	KASSERT(lp->lp_refcount > 0);
+	lp->lp_refcount++;
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
 
-	KASSERT(LP_ISDIRTY(newlp));
+	if (pa != INVALID_PADDR) {
+		mmu_unmap_page(pa);
+		coremap_unpin(pa);
+	}
 
-	lpage_unlock(oldlp);
+	spinlock_acquire(&stats_spinlock);
+	ct_cow_shares++;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_unshare: get a private copy of an lpage so it can be written.
+ * If the page isn't shared, that's the page itself. Otherwise make a
+ * new lpage, copy the contents, and drop our reference to the old
+ * one. The caller replaces the old lpage with the new one, and says
+ * where in swap the copy would best go.
+ *
+ * Synchronization: we hold the old page resident and pinned until
+ * the copy is done. Our reference is dropped first (without giving
+ * back its swap reservation, which the copy then uses) so that if the
+ * other sharers go away meanwhile, the last of them frees the page
+ * once we unpin it rather than it being left to us. If we can't get
+ * memory for the copy, the reference is put back; that's safe
+ * because lpage_destroy waits for the pin before deciding anything.
+ */
+int
+lpage_unshare(struct lpage *lp, struct lpage **lpret, off_t swaphint)
+{
+	struct lpage *newlp;
+	paddr_t pa, newpa;
+	int major, result;
+
+	result = lpage_lock_resident(lp, NULL, 0, &pa, &major);
+	if (result) {
+		return result;
+	}
+
+	KASSERT(lp->lp_refcount > 0);
+	if (lp->lp_refcount == 1) {
+		lpage_unlock(lp);
+		coremap_unpin(pa);
+		*lpret = lp;
+		return 0;
+	}
+	lp->lp_refcount--;
+	lpage_unlock(lp);
+
+	result = lpage_materialize(&newlp, &newpa, swaphint);
+	if (result) {
+		lpage_lock(lp);
+		lp->lp_refcount++;
+		lpage_unlock(lp);
+		coremap_unpin(pa);
+		return result;
+	}
+	KASSERT(coremap_pageispinned(newpa));
+
+	coremap_copy_page(pa, newpa);
+	KASSERT(LP_ISDIRTY(newlp));
 	lpage_unlock(newlp);
 
+	/* Whoever else has the old page mapped must refault on it. */
+	mmu_unmap_page(pa);
+
 	coremap_unpin(newpa);
-	coremap_unpin(oldpa);
+	coremap_unpin(pa);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_cow_copies++;
+	spinlock_release(&stats_spinlock);
 
 	*lpret = newlp;
 	return 0;
@@ -370,13 +585,13 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
  * unpinning, so it's safe to take the coremap spinlock.
  */
 int
-lpage_zerofill(struct lpage **lpret)
+lpage_zerofill(struct lpage **lpret, off_t swaphint)
 {
 	struct lpage *lp;
 	paddr_t pa;
 	int result;
 
-	result = lpage_materialize(&lp, &pa);
+	result = lpage_materialize(&lp, &pa, swaphint);
 	if (result) {
 		return result;
 	}
@@ -401,41 +616,158 @@ lpage_zerofill(struct lpage **lpret)
 
 /*
  * lpage_fault - handle a fault on a specific lpage. If the page is
- * not resident, get a physical page from coremap and swap it in.
- * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
+ * not resident, get a physical page from coremap and swap it in,
+ * along with whichever of the NAHEAD lpages following it (AHEAD)
+ * come right after it in swap.
+ *
+ * Clean pages are mapped read-only, so that the first write to one
+ * faults (VM_FAULT_READONLY) and we can mark it dirty. That way pages
+ * that were never written can be evicted without writing them out.
+ * Shared pages are always mapped read-only; the caller must have
+ * used lpage_unshare before handling a write fault.
  *
  * Synchronization: Lock the lpage while checking if it's in memory. 
  * If it's not, unlock the page while allocting space and loading the
- * page in. This only works because lpages are not currently sharable.
- * The page should be locked again as soon as it is loaded, but be 
- * careful of interactions with other locks while modifying the coremap.
+ * page in (see lpage_lock_resident). The page should be locked again
+ * as soon as it is loaded, but be careful of interactions with other
+ * locks while modifying the coremap.
  *
  * After it has been loaded, the page must be pinned so that it is not
  * evicted while changes are made to the TLB. It can be unpinned as soon
  * as the TLB is updated. 
  */
 int
-lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
+lpage_fault(struct lpage *lp, struct lpage *const *ahead, unsigned nahead,
+	    struct addrspace *as, int faulttype, vaddr_t va)
 {
-	(void)lp;	// suppress compiler warning until code gets written
-	(void)as;	// suppress compiler warning until code gets written
-	(void)faulttype;// suppress compiler warning until code gets written
-	(void)va;	// suppress compiler warning until code gets written
-	return EUNIMP;	// suppress compiler warning until code gets written
+	paddr_t pa;
+	int major, writable, result;
+
+	result = lpage_lock_resident(lp, ahead, nahead, &pa, &major);
+	if (result) {
+		return result;
+	}
+
+	if (!major) {
+		spinlock_acquire(&stats_spinlock);
+		ct_minfaults++;
+		spinlock_release(&stats_spinlock);
+	}
+
+	KASSERT(coremap_pageispinned(pa));
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_WRITE:
+		/* Only our own fork could share it again, and we're here. */
+		KASSERT(lp->lp_refcount == 1);
+		LP_SET(lp, LPF_DIRTY);
+		writable = 1;
+		break;
+	    case VM_FAULT_READ:
+		writable = LP_ISDIRTY(lp) != 0 && lp->lp_refcount == 1;
+		break;
+	    default:
+		panic("lpage_fault: bad fault type %d\n", faulttype);
+	}
+
+	lpage_unlock(lp);
+
+	/* This unpins the page. */
+	mmu_map(as, va, pa, writable);
+	return 0;
+}
+
+/*
+ * lpage_evict_cluster: Evict some lpages from physical memory. Dirty
+ * ones are written out; where several have consecutive swap pages,
+ * they're written with one I/O. Clean ones are just dropped.
+ *
+ * Synchronization: we come here from the coremap, which has pinned
+ * the physical pages and taken them out of the TLB, so their owners
+ * can't touch them meanwhile. Lock each lpage only while looking at
+ * it or updating it; they're all unlocked during the writes.
+ */
+void
+lpage_evict_cluster(struct lpage *const *victims, unsigned n)
+{
+	struct lpage *sorted[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	struct lpage *lp;
+	paddr_t pa;
+	off_t swa;
+	unsigned i, j, ndirty, run;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+
+	/* Pick out the dirty ones, in swap order (insertion sort). */
+	ndirty = 0;
+	for (i=0; i<n; i++) {
+		lp = victims[i];
+		KASSERT(lp != NULL);
+
+		lpage_lock(lp);
+		pa = lp->lp_paddr & PAGE_FRAME;
+		swa = lp->lp_swapaddr;
+		KASSERT(pa != INVALID_PADDR);
+		KASSERT(swa != INVALID_SWAPADDR);
+		KASSERT(coremap_pageispinned(pa));
+
+		if (!LP_ISDIRTY(lp)) {
+			lpage_unlock(lp);
+			continue;
+		}
+		lpage_unlock(lp);
+
+		for (j=ndirty; j>0 && sorted[j-1]->lp_swapaddr > swa; j--) {
+			sorted[j] = sorted[j-1];
+			pas[j] = pas[j-1];
+		}
+		sorted[j] = lp;
+		pas[j] = pa;
+		ndirty++;
+	}
+
+	/* Write each run of consecutive swap pages at once. */
+	for (i=0; i<ndirty; i+=run) {
+		swa = sorted[i]->lp_swapaddr;
+		for (run=1; i+run<ndirty; run++) {
+			if (sorted[i+run]->lp_swapaddr != swa + run*PAGE_SIZE) {
+				break;
+			}
+		}
+		swap_pageout_cluster(&pas[i], run, swa);
+	}
+
+	for (i=0; i<n; i++) {
+		lp = victims[i];
+		lpage_lock(lp);
+		KASSERT(coremap_pageispinned(lp->lp_paddr & PAGE_FRAME));
+
+		spinlock_acquire(&stats_spinlock);
+		if (LP_ISDIRTY(lp)) {
+			ct_write_evictions++;
+		}
+		else {
+			ct_discard_evictions++;
+		}
+		spinlock_release(&stats_spinlock);
+
+		/* The page now lives only in swap (and is clean). */
+		lp->lp_paddr = INVALID_PADDR;
+		lpage_unlock(lp);
+	}
 }
 
 /*
- * lpage_evict: Evict an lpage from physical memory.
+ * lpage_evict: Evict one lpage from physical memory.
  *
- * Synchronization: lock the lpage while evicting it. We come here
- * from the coremap and should have the coremap spinlock and should 
- * have pinned the physical page. This is why we must not hold lpage
- * locks while entering the coremap code.
+ * Synchronization: as for lpage_evict_cluster. The coremap has the
+ * physical page pinned while we lock the lpage; this is why we must
+ * not hold lpage locks while entering the coremap code.
  */
 void
 lpage_evict(struct lpage *lp)
 {
-	(void)lp;	// suppress compiler warning until code gets written
+	lpage_evict_cluster(&lp, 1);
 }
@@ -69,18 +69,17 @@ static unsigned long swap_reserved_pages;
 static struct vnode *swapstore;	// swap file
 
 /*
- * Only one page can be in transit to/from disk at once (at least under
- * present circumstances.) While the disk device will queue up multiple
- * concurrent requests correctly, there's no benefit to doing so. So we
- * enforce mutual exclusion at a higher level. This reduces the number
- * of pages marked in transit at any one time and thus (hopefully) makes
- * paging more intelligent and multipage allocation less likely to starve.
- *
- * This lock signals "intent to page" and should be construed as
- * advisory.
+ * Any number of pages may be in transit to/from disk at once; the
+ * disk queues the requests and sorts them. Each page in transit is
+ * pinned in the coremap, and one being read in is also marked busy
+ * in its lpage, so nobody else touches it meanwhile. How many
+ * evictions run at once is limited in the coremap.
  */
 
-struct lock *global_paging_lock;
+/* I/O counters. */
+static uint32_t ct_swap_reads, ct_swap_readpages;
+static uint32_t ct_swap_writes, ct_swap_writepages;
+static struct spinlock swap_statlock = SPINLOCK_INITIALIZER;
 
 
 /*
@@ -150,6 +149,9 @@ swap_bootstrap(void)
 	/* mark the first page of swap used so we can check for errors */
 	bitmap_mark(swapmap, 0);
 	swap_free_pages--;
+
+	/* Now pages can be evicted, start cleaning them in the background */
+	coremap_pageout_bootstrap();
 }
 
 /*
@@ -169,10 +171,14 @@ swap_shutdown(void)
  * swap_alloc: allocates a page in the swapfile.
  * The page should have already been reserved with swap_reserve.
  *
+ * If HINT is a free swap page, it's used; this lets pages that are
+ * next to each other in memory be next to each other in swap too, so
+ * they can be moved in one I/O.
+ *
  * Synchronization: uses swaplock.
  */
 off_t
-swap_alloc(void)
+swap_alloc(off_t hint)
 {
 	uint32_t rv, index;
 	
@@ -184,9 +190,18 @@ swap_alloc(void)
 	KASSERT(swap_reserved_pages>0);
 	KASSERT(swap_free_pages>0);
 
-	rv = bitmap_alloc(swapmap, &index);
-	/* If this blows up, our counters are wrong */
-	KASSERT(rv == 0);
+	KASSERT(hint % PAGE_SIZE == 0);
+	if (hint != INVALID_SWAPADDR &&
+	    hint / PAGE_SIZE < swap_total_pages &&
+	    !bitmap_isset(swapmap, hint / PAGE_SIZE)) {
+		index = hint / PAGE_SIZE;
+		bitmap_mark(swapmap, index);
+	}
+	else {
+		rv = bitmap_alloc(swapmap, &index);
+		/* If this blows up, our counters are wrong */
+		KASSERT(rv == 0);
+	}
 
 	swap_reserved_pages--;
 	swap_free_pages--;
@@ -266,38 +281,75 @@ swap_unreserve(unsigned long npages)
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_io: Does one swap I/O, of NPAGES pages that are consecutive in
+ * swap starting at SWAPADDR but may be anywhere in physical memory.
+ * Panics on failure.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
+ * Several of these may run at once. Must not take vfs_biglock.
  */
 static
 void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr, enum uio_rw rw)
 {
-	struct iovec iov;
+	struct iovec iov[SWAP_CLUSTER];
+	vaddr_t vas[SWAP_CLUSTER];
 	struct uio u;
-	vaddr_t va;
+	unsigned i;
 	int result;
 
-	KASSERT(lock_do_i_hold(global_paging_lock));
-
-	KASSERT(pa != INVALID_PADDR);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
 	KASSERT(swapaddr % PAGE_SIZE == 0);
-	KASSERT(coremap_pageispinned(pa));
-	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
 
-	va = coremap_map_swap_page(pa);
+	for (i=0; i<npages; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
+
+		vas[i] = coremap_map_swap_page(pas[i]);
+		iov[i].iov_kbase = (void *)vas[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = swapaddr;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	/*
+	 * Call the device directly rather than through VOP_READ and
+	 * VOP_WRITE: vnode_check takes vfs_biglock, and a fault taken
+	 * in uiomove can get here while sfs_read or sfs_write holds a
+	 * vnode lock. The filesystem takes vfs_biglock before vnode
+	 * locks (sfs_sync does, under the syncer), so waiting for it
+	 * here could deadlock. The swap vnode stays open until
+	 * shutdown, so the checks would never fire anyway.
+	 */
+	if (rw==UIO_READ) {
+		result = swapstore->vn_ops->vop_read(swapstore, &u);
+	}
+	else {
+		result = swapstore->vn_ops->vop_write(swapstore, &u);
+	}
 
-	uio_kinit(&iov, &u, (char *)va, PAGE_SIZE, swapaddr, rw);
+	spinlock_acquire(&swap_statlock);
 	if (rw==UIO_READ) {
-		result = VOP_READ(swapstore, &u);
+		ct_swap_reads++;
+		ct_swap_readpages += npages;
 	}
 	else {
-		result = VOP_WRITE(swapstore, &u);
+		ct_swap_writes++;
+		ct_swap_writepages += npages;
 	}
+	spinlock_release(&swap_statlock);
 
-	coremap_unmap_swap_page(va, pa);
+	for (i=0; i<npages; i++) {
+		coremap_unmap_swap_page(vas[i], pas[i]);
+	}
 
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
@@ -320,7 +372,7 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 void
 swap_pagein(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	swap_io(&pa, 1, swapaddr, UIO_READ);
 }
 
 
@@ -331,5 +383,43 @@ swap_pagein(paddr_t pa, off_t swapaddr)
 void
 swap_pageout(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	swap_io(&pa, 1, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_pagein_cluster/swap_pageout_cluster: the same for a run of
+ * pages that are consecutive in swap.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pagein_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_READ);
+}
+
+void
+swap_pageout_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_printstats: print how much swap I/O has been done, and in how
+ * many operations.
+ */
+void
+swap_printstats(void)
+{
+	uint32_t rd, rdp, wr, wrp;
+
+	spinlock_acquire(&swap_statlock);
+	rd = ct_swap_reads;
+	rdp = ct_swap_readpages;
+	wr = ct_swap_writes;
+	wrp = ct_swap_writepages;
+	spinlock_release(&swap_statlock);
+
+	kprintf("swap: %lu pages read in %lu I/Os, %lu written in %lu I/Os\n",
+		(unsigned long) rdp, (unsigned long) rd,
+		(unsigned long) wrp, (unsigned long) wr);
 }
@@ -92,19 +92,19 @@ vm_object_create(size_t npages)
 }
 
 /*
- * vm_object_copy: clone a vm_object.
+ * vm_object_copy: clone a vm_object. The pages themselves are shared
+ * copy-on-write rather than copied; the new object's swap
+ * reservation covers the copies if they're ever made.
  *
- * Synchronization: None; lpage_copy does the hard stuff.
+ * Synchronization: None; lpage_share does the hard stuff.
  */
 int
-vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
-	       struct vm_object **ret)
+vm_object_copy(struct vm_object *vmo, struct vm_object **ret)
 {
 	struct vm_object *newvmo;
 
 	struct lpage *newlp, *lp;
 	unsigned j;
-	int result;
 
 	newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
 	if (newvmo == NULL) {
@@ -126,19 +126,12 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 			continue;
 		}
 
-		result = lpage_copy(lp, &newlp);
-		if (result) {
-			goto fail;
-		}
-		lpage_array_set(newvmo->vmo_lpages, j, newlp);
+		lpage_share(lp);
+		lpage_array_set(newvmo->vmo_lpages, j, lp);
 	}
 
 	*ret = newvmo;
 	return 0;
-
- fail:
-	vm_object_destroy(newas, newvmo);
-	return result;
 }
 
 /*
@@ -209,3 +202,62 @@ vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 	kfree(vmo);
 }
 
+/*
+ * vm_object_swaphint: choose where in swap a new page at INDEX should
+ * go: right after the page before it, or failing that right before
+ * the page after it. Pages that are neighbours in memory can then be
+ * moved to and from swap together.
+ *
+ * Synchronization: none; an lpage's swap address is set when it's
+ * created and never changes.
+ */
+off_t
+vm_object_swaphint(struct vm_object *vmo, unsigned index)
+{
+	struct lpage *lp;
+
+	if (index > 0) {
+		lp = lpage_array_get(vmo->vmo_lpages, index - 1);
+		if (lp != NULL) {
+			return lp->lp_swapaddr + PAGE_SIZE;
+		}
+	}
+	if (index + 1 < lpage_array_num(vmo->vmo_lpages)) {
+		lp = lpage_array_get(vmo->vmo_lpages, index + 1);
+		if (lp != NULL && lp->lp_swapaddr > PAGE_SIZE) {
+			return lp->lp_swapaddr - PAGE_SIZE;
+		}
+	}
+	return INVALID_SWAPADDR;
+}
+
+/*
+ * vm_object_swapnext: put in AHEAD (up to MAX of) the lpages after the
+ * one at INDEX whose swap pages follow on from its own, and return
+ * how many there are.
+ *
+ * Synchronization: none; see vm_object_swaphint.
+ */
+unsigned
+vm_object_swapnext(struct vm_object *vmo, unsigned index,
+		   struct lpage **ahead, unsigned max)
+{
+	struct lpage *lp, *next;
+	unsigned n;
+
+	lp = lpage_array_get(vmo->vmo_lpages, index);
+	KASSERT(lp != NULL);
+
+	for (n=0; n<max; n++) {
+		if (index + n + 1 >= lpage_array_num(vmo->vmo_lpages)) {
+			break;
+		}
+		next = lpage_array_get(vmo->vmo_lpages, index + n + 1);
+		if (next == NULL ||
+		    next->lp_swapaddr != lp->lp_swapaddr + (n+1)*PAGE_SIZE) {
+			break;
+		}
+		ahead[n] = next;
+	}
+	return n;
+}
@@ -68,26 +68,51 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
+	if (SWAPL(sp.sp_journalblocks) > 0) {
+		printf("Journal: %u blocks at block %u\n",
+		       SWAPL(sp.sp_journalblocks), SWAPL(sp.sp_journalstart));
+	}
+	else {
+		printf("Journal: none\n");
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
 
 static
-void
-dodirblock(uint32_t block)
+uint32_t
+dirhash(const char *name)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	uint32_t h = SFS_DIRHASH_INIT;
 	int i;
 
-	diskread(&sds, block);
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = SFS_DIRHASH_STEP(h, name[i]);
+	}
+	return h;
+}
+
+/*
+ * Print some directory entries. For hashed directories (nhashblocks
+ * > 0) also show which block each entry's name hashes to.
+ */
+static
+void
+dodirentries(struct sfs_dir *sds, int nsds, uint32_t nhashblocks)
+{
+	int i;
 
-	printf("    [block %u]\n", block);
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAPL(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
 			printf("        [free entry]\n");
 		}
+		else if (nhashblocks > 0) {
+			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+			printf("        %u %s (hash block %u)\n", ino,
+			       sds[i].sfd_name,
+			       dirhash(sds[i].sfd_name) % nhashblocks);
+		}
 		else {
 			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
 			printf("        %u %s\n", ino, sds[i].sfd_name);
@@ -95,14 +120,54 @@ dodirblock(uint32_t block)
 	}
 }
 
+static
+void
+dodirblock(uint32_t block, uint32_t nhashblocks)
+{
+	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
+
+	diskread(&sds, block);
+
+	printf("    [block %u]\n", block);
+	dodirentries(sds, SFS_BLOCKSIZE/sizeof(struct sfs_dir), nhashblocks);
+}
+
+/*
+ * Print the directory blocks under an indirect block with LEVELS
+ * levels of indirection, counting them in *NBLOCKSP.
+ */
+static
+void
+dumpdirindirect(uint32_t iblock, int levels, uint32_t nhashblocks,
+		uint32_t *nblocksp)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block;
+	int i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			dumpdirindirect(block, levels-1, nhashblocks, nblocksp);
+		}
+		else {
+			dodirblock(block, nhashblocks);
+			(*nblocksp)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
-	int nentries, i;
-	uint32_t block, nblocks=0;
+	int i;
+	uint32_t nentries, block, nblocks=0, nhashblocks=0;
 
 	diskread(&sfi, ino);
 
@@ -110,24 +175,45 @@ dumpdir(uint32_t ino)
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
-	printf("Directory %u: %d entries\n", ino, nentries);
+	if (SWAPL(sfi.sfi_flags) & SFS_IFLAG_HASHDIR) {
+		nhashblocks = SWAPL(sfi.sfi_size) / SFS_BLOCKSIZE;
+		printf("Directory %u: %u entries, hashed over %u blocks\n",
+		       ino, nentries, nhashblocks);
+	}
+	else {
+		printf("Directory %u: %u entries\n", ino, nentries);
+	}
+
+	if (SWAPL(sfi.sfi_flags) & SFS_IFLAG_INLINE) {
+		struct sfs_inlineinode *sfn = (struct sfs_inlineinode *)&sfi;
+
+		if (nentries > SFS_INLINED_BYTES / sizeof(struct sfs_dir)) {
+			warnx("Warning: inline dir is too large");
+			nentries = SFS_INLINED_BYTES / sizeof(struct sfs_dir);
+		}
+		printf("    [inline]\n");
+		dodirentries((struct sfs_dir *)sfn->sfn_data, nentries, 0);
+		return;
+	}
 
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
 		if (block) {
-			dodirblock(block);
+			dodirblock(block, nhashblocks);
 			nblocks++;
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		dumpdirindirect(SWAPL(sfi.sfi_indirect), 1, nhashblocks,
+				&nblocks);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		dumpdirindirect(SWAPL(sfi.sfi_dindirect), 2, nhashblocks,
+				&nblocks);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		dumpdirindirect(SWAPL(sfi.sfi_tindirect), 3, nhashblocks,
+				&nblocks);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
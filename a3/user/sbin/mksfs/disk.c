@@ -36,6 +36,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <err.h>
+#ifdef HOST
+#include <sys/mman.h>
+#endif
 
 #include "support.h"
 #include "disk.h"
@@ -50,6 +53,17 @@
 static int fd=-1;
 static uint32_t nblocks;
 
+#ifdef HOST
+/*
+ * On the host, the whole image is mapped into memory if possible, so
+ * reads and writes are just copies and the OS can read ahead and
+ * write back in big chunks. Otherwise we use pread and pwrite, which
+ * (unlike lseek and read) can be used from several threads at once.
+ */
+static char *mapping;
+static size_t mapsize;
+#endif
+
 void
 opendisk(const char *path)
 {
@@ -87,6 +101,12 @@ opendisk(const char *path)
 			errx(1, "%s: Not a System/161 disk image", path);
 		}
 	}
+
+	mapsize = statbuf.st_size;
+	mapping = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		mapping = NULL;
+	}
 #endif
 }
 
@@ -112,18 +132,32 @@ diskwrite(const void *data, uint32_t block)
 	int len;
 
 	assert(fd>=0);
+	if (block >= nblocks) {
+		errx(1, "write: block %lu past end of disk",
+		     (unsigned long) block);
+	}
 
 #ifdef HOST
 	// skip over disk file header
 	block++;
-#endif
 
+	if (mapping != NULL) {
+		memcpy(mapping + (size_t)block*BLOCKSIZE, data, BLOCKSIZE);
+		return;
+	}
+#else
 	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
+#endif
 
 	while (tot < BLOCKSIZE) {
+#ifdef HOST
+		len = pwrite(fd, cdata + tot, BLOCKSIZE - tot,
+			     (off_t)block*BLOCKSIZE + tot);
+#else
 		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+#endif
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -145,18 +179,32 @@ diskread(void *data, uint32_t block)
 	int len;
 
 	assert(fd>=0);
+	if (block >= nblocks) {
+		errx(1, "read: block %lu past end of disk",
+		     (unsigned long) block);
+	}
 
 #ifdef HOST
 	// skip over disk file header
 	block++;
-#endif
 
+	if (mapping != NULL) {
+		memcpy(data, mapping + (size_t)block*BLOCKSIZE, BLOCKSIZE);
+		return;
+	}
+#else
 	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
+#endif
 
 	while (tot < BLOCKSIZE) {
+#ifdef HOST
+		len = pread(fd, cdata + tot, BLOCKSIZE - tot,
+			    (off_t)block*BLOCKSIZE + tot);
+#else
 		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+#endif
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -174,6 +222,14 @@ void
 closedisk(void)
 {
 	assert(fd>=0);
+#ifdef HOST
+	if (mapping != NULL) {
+		if (munmap(mapping, mapsize)) {
+			err(1, "munmap");
+		}
+		mapping = NULL;
+	}
+#endif
 	if (close(fd)) {
 		err(1, "close");
 	}
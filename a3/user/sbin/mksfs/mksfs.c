@@ -28,7 +28,10 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -42,6 +45,9 @@
 
 #include <netinet/in.h> // for arpa/inet.h
 #include <arpa/inet.h>  // for ntohl
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "hostcompat.h"
 #define SWAPL(x) ntohl(x)
 #define SWAPS(x) ntohs(x)
@@ -57,6 +63,33 @@
 
 #define MAXBITBLOCKS 32
 
+#define DIVROUNDUP(a, b) (((a) + (b) - 1) / (b))
+
+/*
+ * The journal gets 1/32 of the disk, up to JOURNALMAX blocks; disks
+ * too small for JOURNALMIN blocks get none.
+ */
+#define JOURNALMIN 64
+#define JOURNALMAX 1024
+
+static uint32_t journalstart, journalblocks;
+
+static
+void
+layoutjournal(uint32_t fsblocks)
+{
+	journalstart = SFS_MAP_LOCATION + SFS_BITBLOCKS(fsblocks);
+	journalblocks = fsblocks / 32;
+	if (journalblocks > JOURNALMAX) {
+		journalblocks = JOURNALMAX;
+	}
+	if (journalblocks < JOURNALMIN ||
+	    journalstart + journalblocks > fsblocks) {
+		journalstart = 0;
+		journalblocks = 0;
+	}
+}
+
 static
 void
 check(void)
@@ -64,6 +97,7 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jblock)==SFS_BLOCKSIZE);
 }
 
 static
@@ -81,6 +115,8 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_journalstart = SWAPL(journalstart);
+	sp.sp_journalblocks = SWAPL(journalblocks);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
@@ -113,14 +149,16 @@ doallocbit(uint32_t bit)
 	bitbuf[byte] |= mask;
 }
 
+/*
+ * Mark the blocks that are always in use: the superblock, root inode,
+ * bitmap and journal, and the bits past the end of the disk.
+ */
 static
 void
-writebitmap(uint32_t fsblocks)
+initbitmap(uint32_t fsblocks)
 {
-
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
 	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
-	char *ptr;
 	uint32_t i;
 
 	if (nblocks > MAXBITBLOCKS) {
@@ -133,9 +171,21 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<journalblocks; i++) {
+		doallocbit(journalstart+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
+}
+
+static
+void
+writebitmap(uint32_t fsblocks)
+{
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	char *ptr;
+	uint32_t i;
 
 	for (i=0; i<nblocks; i++) {
 		ptr = bitbuf + i*SFS_BLOCKSIZE;
@@ -143,18 +193,561 @@ writebitmap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Clear the journal, so nothing left on the disk looks like a log
+ * record, and write its header.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jblock jb;
+	uint32_t i;
+
+	bzero((void *)&jb, sizeof(jb));
+	for (i=1; i<journalblocks; i++) {
+		diskwrite(&jb, journalstart+i);
+	}
+	if (journalblocks > 0) {
+		jb.sj_magic = SWAPL(SFS_JMAGIC);
+		jb.sj_type = SWAPL(SFS_JTYPE_HEADER);
+		jb.sj_seq = SWAPL(1);
+		jb.sj_count = SWAPL(0);
+		diskwrite(&jb, journalstart);
+	}
+}
+
+#ifdef HOST
+
+/*
+ * Building an image from a directory on the host (-d).
+ *
+ * The tree is copied in one depth-first walk. Blocks are handed out
+ * in increasing order from nextblock, so each directory is followed
+ * by its own blocks, then its files (each inode followed by its data),
+ * then its subdirectories in turn. This is the placement the kernel
+ * aims for on an empty disk: objects near their directory and data
+ * right after the inode. The layout follows the kernel's other
+ * policies as well: small objects are inline, files are mapped with
+ * a single extent, and big directories are hashed.
+ */
+
+static uint32_t nextblock, lastblock;
+
+/* Files with more than one link, so further links find the inode */
+struct hostlink {
+	dev_t hl_dev;
+	ino_t hl_ino;
+	uint32_t hl_sfsino;
+};
+static struct hostlink *hostlinks;
+static unsigned numhostlinks, maxhostlinks;
+
+/* Statistics */
+static unsigned long numfiles, numdirs, numlinks, numinline, numhashed;
+static unsigned long numdatablocks;
+
+static
+uint32_t
+allocblocks(uint32_t n)
+{
+	uint32_t start, i;
+
+	if (n > lastblock - nextblock) {
+		errx(1, "Out of space (the image is too small)");
+	}
+	start = nextblock;
+	for (i=0; i<n; i++) {
+		doallocbit(start+i);
+	}
+	nextblock += n;
+	return start;
+}
+
+/*
+ * Read exactly LEN bytes of a host file.
+ */
+static
+void
+readall(int fd, void *buf, size_t len, const char *path)
+{
+	size_t done;
+	ssize_t r;
+
+	for (done = 0; done < len; done += r) {
+		r = read(fd, (char *)buf + done, len - done);
+		if (r < 0) {
+			err(1, "%s", path);
+		}
+		if (r == 0) {
+			errx(1, "%s: File shrank while being copied", path);
+		}
+	}
+}
+
+/*
+ * Fill in pointers to the next *LEFT blocks starting at *NEXT below
+ * an indirect block of the given level (level 0 is a data block),
+ * allocating and writing the indirect blocks. Returns the block for
+ * the inode (or parent indirect block) to point to.
+ */
+static
+uint32_t
+writeindirect(int indirection, uint32_t *next, uint32_t *left)
+{
+	uint32_t ptrs[SFS_DBPERIDB];
+	uint32_t block, i;
+
+	if (*left == 0) {
+		return 0;
+	}
+	if (indirection == 0) {
+		(*left)--;
+		return (*next)++;
+	}
+	block = allocblocks(1);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		ptrs[i] = SWAPL(writeindirect(indirection-1, next, left));
+	}
+	diskwrite(ptrs, block);
+	return block;
+}
+
+/*
+ * Map NBLOCKS consecutive blocks from START with the inode's block
+ * pointers.
+ */
+static
+void
+mapblocks(struct sfs_inode *sfi, uint32_t start, uint32_t nblocks,
+	  const char *path)
+{
+	uint32_t i;
+
+	for (i=0; i<SFS_NDIRECT && nblocks > 0; i++) {
+		sfi->sfi_direct[i] = SWAPL(start);
+		start++;
+		nblocks--;
+	}
+	sfi->sfi_indirect = SWAPL(writeindirect(1, &start, &nblocks));
+	sfi->sfi_dindirect = SWAPL(writeindirect(2, &start, &nblocks));
+	sfi->sfi_tindirect = SWAPL(writeindirect(3, &start, &nblocks));
+	if (nblocks > 0) {
+		errx(1, "%s: Too large", path);
+	}
+}
+
+/*
+ * Copy a regular file and return its inode number.
+ */
+static
+uint32_t
+writefile(const char *path, const struct stat *st)
+{
+	union {
+		struct sfs_inode i;
+		struct sfs_extinode x;
+		struct sfs_inlineinode n;
+	} u;
+	char buf[SFS_BLOCKSIZE];
+	uint32_t ino, size, start, nblocks, i, len;
+	int fd;
+
+	if (st->st_size > (off_t) UINT32_MAX) {
+		errx(1, "%s: Too large", path);
+	}
+	size = st->st_size;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+
+	bzero(&u, sizeof(u));
+	u.i.sfi_size = SWAPL(size);
+	u.i.sfi_type = SWAPS(SFS_TYPE_FILE);
+	u.i.sfi_linkcount = SWAPS(1);
+
+	ino = allocblocks(1);
+	if (size <= SFS_INLINED_BYTES) {
+		readall(fd, u.n.sfn_data, size, path);
+		u.i.sfi_flags = SWAPL(SFS_IFLAG_INLINE);
+		numinline++;
+	}
+	else {
+		nblocks = DIVROUNDUP(size, SFS_BLOCKSIZE);
+		start = allocblocks(nblocks);
+		for (i=0; i<nblocks; i++) {
+			len = size - i*SFS_BLOCKSIZE;
+			if (len > SFS_BLOCKSIZE) {
+				len = SFS_BLOCKSIZE;
+			}
+			bzero(buf, sizeof(buf));
+			readall(fd, buf, len, path);
+			diskwrite(buf, start+i);
+		}
+		u.x.sfx_nextents = SWAPL(1);
+		u.x.sfx_extents[0].sfe_fileblock = SWAPL(0);
+		u.x.sfx_extents[0].sfe_diskblock = SWAPL(start);
+		u.x.sfx_extents[0].sfe_len = SWAPL(nblocks);
+		u.i.sfi_flags = SWAPL(SFS_IFLAG_EXTENTS);
+		numdatablocks += nblocks;
+	}
+	close(fd);
+
+	diskwrite(&u, ino);
+	numfiles++;
+	return ino;
+}
+
+/*
+ * Copy a file, or if it's another link to one already copied, just
+ * count the link.
+ */
+static
+uint32_t
+linkfile(const char *path, const struct stat *st)
+{
+	struct sfs_inode sfi;
+	unsigned i;
+
+	if (st->st_nlink < 2) {
+		return writefile(path, st);
+	}
+
+	for (i=0; i<numhostlinks; i++) {
+		if (hostlinks[i].hl_dev == st->st_dev &&
+		    hostlinks[i].hl_ino == st->st_ino) {
+			diskread(&sfi, hostlinks[i].hl_sfsino);
+			sfi.sfi_linkcount =
+				SWAPS(SWAPS(sfi.sfi_linkcount) + 1);
+			diskwrite(&sfi, hostlinks[i].hl_sfsino);
+			numlinks++;
+			return hostlinks[i].hl_sfsino;
+		}
+	}
+
+	if (numhostlinks == maxhostlinks) {
+		maxhostlinks = maxhostlinks ? 2*maxhostlinks : 16;
+		hostlinks = realloc(hostlinks,
+				    maxhostlinks * sizeof(*hostlinks));
+		if (hostlinks == NULL) {
+			err(1, "realloc");
+		}
+	}
+	hostlinks[numhostlinks].hl_dev = st->st_dev;
+	hostlinks[numhostlinks].hl_ino = st->st_ino;
+	hostlinks[numhostlinks].hl_sfsino = writefile(path, st);
+	return hostlinks[numhostlinks++].hl_sfsino;
+}
+
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	for (; *name != 0; name++) {
+		h = SFS_DIRHASH_STEP(h, *name);
+	}
+	return h;
+}
+
+/*
+ * Lay out NENTRIES names as a hashed table of NBLOCKS blocks, the
+ * way the kernel does, and hand back each name's slot. Returns
+ * nonzero if some name doesn't fit.
+ */
+static
+int
+hashdir(const char **names, uint32_t nentries, uint32_t nblocks, uint32_t *slots)
+{
+	const uint32_t perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	char used[nblocks * perblock];
+	uint32_t i, k, j, block;
+
+	bzero(used, sizeof(used));
+	for (i=0; i<nentries; i++) {
+		block = dirhash(names[i]) % nblocks;
+		for (k=0; k<SFS_DIRHASH_PROBE && k<nblocks; k++) {
+			for (j=0; j<perblock; j++) {
+				if (!used[block*perblock + j]) {
+					break;
+				}
+			}
+			if (j < perblock) {
+				break;
+			}
+			block = (block + 1) % nblocks;
+		}
+		if (k == SFS_DIRHASH_PROBE || k == nblocks) {
+			return -1;
+		}
+		slots[i] = block*perblock + j;
+		used[slots[i]] = 1;
+	}
+	return 0;
+}
+
+static
+int
+skipdots(const struct dirent *de)
+{
+	return strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+}
+
+/*
+ * Return PATH/NAME in malloc'd memory.
+ */
+static
+char *
+joinpath(const char *path, const char *name)
+{
+	size_t len;
+	char *ret;
+
+	len = strlen(path) + strlen(name) + 2;
+	ret = malloc(len);
+	if (ret == NULL) {
+		err(1, "malloc");
+	}
+	snprintf(ret, len, "%s/%s", path, name);
+	return ret;
+}
+
+/*
+ * Copy the host directory PATH into the inode INO, which the caller
+ * has allocated, and everything under it.
+ */
+static
+void
+writedir(const char *path, uint32_t ino, uint32_t parentino)
+{
+	const uint32_t perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	union {
+		struct sfs_inode i;
+		struct sfs_inlineinode n;
+	} u;
+	struct dirent **hostents;
+	struct stat *sts;
+	struct sfs_dir *entries;
+	const char **names;
+	uint32_t *slots;
+	uint32_t nentries, nslots, nblocks, size, start, subdirs, i;
+	int nhost, h, pass, tries;
+	int hashed = 0;
+	char *subpath;
+
+	nhost = scandir(path, &hostents, skipdots, alphasort);
+	if (nhost < 0) {
+		err(1, "%s", path);
+	}
+
+	/* "." and ".." come first; then what we know how to copy */
+	names = malloc((nhost + 2) * sizeof(const char *));
+	sts = malloc((nhost + 2) * sizeof(struct stat));
+	slots = malloc((nhost + 2) * sizeof(uint32_t));
+	if (names == NULL || sts == NULL || slots == NULL) {
+		err(1, "malloc");
+	}
+	names[0] = ".";
+	names[1] = "..";
+	nentries = 2;
+	for (h=0; h<nhost; h++) {
+		const char *name = hostents[h]->d_name;
+
+		if (strlen(name) >= SFS_NAMELEN) {
+			errx(1, "%s/%s: Name too long", path, name);
+		}
+		subpath = joinpath(path, name);
+		if (lstat(subpath, &sts[nentries])) {
+			err(1, "%s", subpath);
+		}
+		free(subpath);
+		if (!S_ISREG(sts[nentries].st_mode) &&
+		    !S_ISDIR(sts[nentries].st_mode)) {
+			warnx("%s/%s: Not a file or directory (skipped)",
+			      path, name);
+			continue;
+		}
+		names[nentries++] = hostents[h]->d_name;
+	}
+
+	/*
+	 * Pick the layout: inline if it fits; hashed, in twice the
+	 * space needed (or more, if names collide), if it has as many
+	 * entries as the kernel starts hashing at (8 blocks' worth);
+	 * otherwise a plain array.
+	 */
+	bzero(&u, sizeof(u));
+	size = nentries * sizeof(struct sfs_dir);
+	if (size <= SFS_INLINED_BYTES) {
+		nblocks = 0;
+		u.i.sfi_flags = SWAPL(SFS_IFLAG_INLINE);
+		numinline++;
+	}
+	else {
+		nblocks = DIVROUNDUP(nentries, perblock);
+		if (nblocks >= 8) {
+			nblocks *= 2;
+			for (tries=0; tries<3 && !hashed; tries++) {
+				hashed = hashdir(names, nentries, nblocks,
+						 slots) == 0;
+				if (!hashed) {
+					nblocks *= 2;
+				}
+			}
+			if (!hashed) {
+				nblocks = DIVROUNDUP(nentries, perblock);
+			}
+		}
+		if (hashed) {
+			size = nblocks * SFS_BLOCKSIZE;
+			u.i.sfi_flags = SWAPL(SFS_IFLAG_HASHDIR);
+			numhashed++;
+		}
+	}
+	if (!hashed) {
+		for (i=0; i<nentries; i++) {
+			slots[i] = i;
+		}
+	}
+	nslots = nblocks > 0 ? nblocks * perblock : nentries;
+
+	/* The directory's blocks go right after its inode */
+	start = nblocks > 0 ? allocblocks(nblocks) : 0;
+
+	entries = calloc(nslots, sizeof(struct sfs_dir));
+	if (entries == NULL) {
+		err(1, "calloc");
+	}
+	entries[slots[0]].sfd_ino = SWAPL(ino);
+	entries[slots[1]].sfd_ino = SWAPL(parentino);
+	for (i=0; i<nentries; i++) {
+		strcpy(entries[slots[i]].sfd_name, names[i]);
+	}
+
+	/* Then its files, then its subdirectories */
+	subdirs = 0;
+	for (pass=0; pass<2; pass++) {
+		for (i=2; i<nentries; i++) {
+			if (S_ISDIR(sts[i].st_mode) != (pass == 1)) {
+				continue;
+			}
+			subpath = joinpath(path, names[i]);
+			if (pass == 0) {
+				entries[slots[i]].sfd_ino =
+					SWAPL(linkfile(subpath, &sts[i]));
+			}
+			else {
+				uint32_t subino = allocblocks(1);
+
+				entries[slots[i]].sfd_ino = SWAPL(subino);
+				writedir(subpath, subino, ino);
+				subdirs++;
+			}
+			free(subpath);
+		}
+	}
+
+	u.i.sfi_size = SWAPL(size);
+	u.i.sfi_type = SWAPS(SFS_TYPE_DIR);
+	u.i.sfi_linkcount = SWAPS(subdirs + 2);
+	if (nblocks == 0) {
+		memcpy(u.n.sfn_data, entries, size);
+	}
+	else {
+		for (i=0; i<nblocks; i++) {
+			diskwrite(&entries[i * perblock], start+i);
+		}
+		mapblocks(&u.i, start, nblocks, path);
+		numdatablocks += nblocks;
+	}
+	diskwrite(&u, ino);
+	numdirs++;
+
+	for (h=0; h<nhost; h++) {
+		free(hostents[h]);
+	}
+	free(hostents);
+	free(entries);
+	free(slots);
+	free(sts);
+	free(names);
+}
+
+/*
+ * Fill the new volume from the host directory HOSTDIR.
+ */
+static
+void
+populate(const char *hostdir, uint32_t fsblocks)
+{
+	struct stat st;
+
+	if (stat(hostdir, &st)) {
+		err(1, "%s", hostdir);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		errx(1, "%s: Not a directory", hostdir);
+	}
+
+	if (journalblocks > 0) {
+		nextblock = journalstart + journalblocks;
+	}
+	else {
+		nextblock = SFS_MAP_LOCATION + SFS_BITBLOCKS(fsblocks);
+	}
+	lastblock = fsblocks;
+
+	writedir(hostdir, SFS_ROOT_LOCATION, SFS_ROOT_LOCATION);
+
+	printf("mksfs: %lu directories, %lu files, %lu extra links\n",
+	       numdirs, numfiles, numlinks);
+	printf("mksfs: %lu inline objects, %lu hashed directories, "
+	       "%lu data blocks\n", numinline, numhashed, numdatablocks);
+	printf("mksfs: %lu of %lu blocks in use\n",
+	       (unsigned long) nextblock, (unsigned long) fsblocks);
+}
+
+#else /* HOST */
+
+static
+void
+populate(const char *hostdir, uint32_t fsblocks)
+{
+	(void)hostdir;
+	(void)fsblocks;
+	errx(1, "-d is only supported in the host version of mksfs");
+}
+
+#endif /* HOST */
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: mksfs [-d hostdir] device/diskfile volume-name");
+}
+
 int
 main(int argc, char **argv)
 {
 	uint32_t size, blocksize;
+	const char *hostdir = NULL;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	if (argc==5 && !strcmp(argv[1], "-d")) {
+		hostdir = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		usage();
 	}
 
 	check();
@@ -185,9 +778,17 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
+	layoutjournal(size);
 	writesuper(volname, size);
-	writerootdir();
+	initbitmap(size);
+	if (hostdir != NULL) {
+		populate(hostdir, size);
+	}
+	else {
+		writerootdir();
+	}
 	writebitmap(size);
+	writejournal();
 
 	closedisk();
 
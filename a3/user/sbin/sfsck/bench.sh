@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# bench.sh - time sfsck on a large generated volume
+#
+# Usage: bench.sh [-b nblocks] [-d ndirs] [-f nfiles] [-s seed]
+#                 [-j threads] [mksfs [sfsck]]
+#
+# Builds a random tree of NDIRS directories and NFILES files on the
+# host (a mix of inline-sized, small, and multi-indirect files, with
+# some hard links), loads it into a fresh NBLOCKS-block image with
+# mksfs -d, and runs sfsck -t on it twice, printing the per-pass
+# times. The tree is a function of SEED, so runs with different sfsck
+# binaries check the same volume. mksfs and sfsck default to the
+# host versions in $PATH.
+#
+
+NBLOCKS=131000
+NDIRS=3000
+NFILES=5000
+SEED=1
+JOBS=
+
+while getopts b:d:f:s:j: opt; do
+    case $opt in
+	b) NBLOCKS=$OPTARG;;
+	d) NDIRS=$OPTARG;;
+	f) NFILES=$OPTARG;;
+	s) SEED=$OPTARG;;
+	j) JOBS="-j $OPTARG";;
+	*) echo "Usage: $0 [-b nblocks] [-d ndirs] [-f nfiles] [-s seed]" \
+		"[-j threads] [mksfs [sfsck]]"
+	   exit 1;;
+    esac
+done
+shift $(($OPTIND - 1))
+MKSFS=${1:-host-mksfs}
+SFSCK=${2:-host-sfsck}
+
+WORK=`mktemp -d ${TMPDIR:-/tmp}/sfsckbench.XXXXXX` || exit 1
+trap 'rm -rf "$WORK"' 0 1 2 15
+TREE=$WORK/tree
+IMAGE=$WORK/bench.img
+
+echo "Generating $NDIRS directories and $NFILES files (seed $SEED)"
+mkdir $TREE || exit 1
+(cd $TREE && awk -v ndirs=$NDIRS -v nfiles=$NFILES -v seed=$SEED '
+    function pick(n) { return int(rand() * n); }
+
+    BEGIN {
+	srand(seed);
+	block = "";
+	for (i=0; i<512; i++) {
+	    block = block "x";
+	}
+
+	dir[0] = ".";
+	for (i=0; i<ndirs; i++) {
+	    dir[i+1] = dir[pick(i+1)] "/d" i;
+	    system("mkdir " dir[i+1]);
+	}
+
+	for (i=0; i<nfiles; i++) {
+	    path = dir[pick(ndirs+1)] "/f" i;
+	    kind = rand();
+	    if (kind < 0.4) {
+		# small enough to be stored in the inode
+		printf "%s", substr(block, 1, pick(448)) > path;
+	    }
+	    else {
+		if (kind < 0.9) {
+		    nb = 1 + pick(20);
+		}
+		else {
+		    # past the direct blocks, often into double-indirect ones
+		    nb = 20 + pick(300);
+		}
+		for (j=0; j<nb; j++) {
+		    printf "%s", block > path;
+		}
+	    }
+	    close(path);
+
+	    if (rand() < 0.02) {
+		system("ln " path " " dir[pick(ndirs+1)] "/l" i);
+	    }
+	}
+    }
+') || exit 1
+
+echo "Making a $NBLOCKS-block image"
+printf 'System/161 Disk Image' > $IMAGE
+dd if=/dev/zero of=$IMAGE bs=512 seek=1 count=$NBLOCKS conv=notrunc \
+    2>/dev/null || exit 1
+$MKSFS -d $TREE $IMAGE bench || exit 1
+
+# Run twice: the second run has the image in the host page cache.
+for run in 1 2; do
+    echo "sfsck run $run:"
+    $SFSCK -t $JOBS $IMAGE || exit 1
+done
+exit 0
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <err.h>
 
 #include "support.h"
@@ -42,9 +43,11 @@
 #ifdef HOST
 #include <netinet/in.h> // for arpa/inet.h
 #include <arpa/inet.h>  // for ntohl
+#include <pthread.h>
 #include "hostcompat.h"
 #define SWAPL(x) ntohl(x)
 #define SWAPS(x) ntohs(x)
+#define USE_THREADS
 
 #else
 
@@ -66,13 +69,29 @@
 
 static int badness=0;
 
+/*
+ * On the host, the directory pass runs several directories at once
+ * (see check_dirs). fsck_lock covers everything they share: the block
+ * bitmap, the inode table, the counters, and the badness.
+ */
+#ifdef USE_THREADS
+static pthread_mutex_t fscklock = PTHREAD_MUTEX_INITIALIZER;
+#define fsck_lock()   pthread_mutex_lock(&fscklock)
+#define fsck_unlock() pthread_mutex_unlock(&fscklock)
+#else
+#define fsck_lock()   ((void)0)
+#define fsck_unlock() ((void)0)
+#endif
+
 static
 void
 setbadness(int code)
 {
+	fsck_lock();
 	if (badness < code) {
 		badness = code;
 	}
+	fsck_unlock();
 }
 
 ////////////////////////////////////////////////////////////
@@ -83,6 +102,23 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_journalstart = SWAPL(sp->sp_journalstart);
+	sp->sp_journalblocks = SWAPL(sp->sp_journalblocks);
+}
+
+static
+void
+swapjblock(struct sfs_jblock *jb)
+{
+	unsigned i;
+
+	jb->sj_magic = SWAPL(jb->sj_magic);
+	jb->sj_type = SWAPL(jb->sj_type);
+	jb->sj_seq = SWAPL(jb->sj_seq);
+	jb->sj_count = SWAPL(jb->sj_count);
+	for (i=0; i<SFS_JDESCBLOCKS; i++) {
+		jb->sj_blocks[i] = SWAPL(jb->sj_blocks[i]);
+	}
 }
 
 static
@@ -126,6 +162,56 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	/*
+	 * The unused space is zero in an inode mapped by block
+	 * pointers, but an extent-mapped inode keeps its extents
+	 * there, and those are all 32-bit words too.
+	 */
+	for (i=0; i<(int)(sizeof(sfi->sfi_waste)/sizeof(uint32_t)); i++) {
+		sfi->sfi_waste[i] = SWAPL(sfi->sfi_waste[i]);
+	}
+
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
+}
+
+/*
+ * An inline inode's data is bytes, not words; swapinode swaps it
+ * anyway, so swap it back. Use readinode and writeinode, which take
+ * care of this, to move inodes to and from the disk.
+ */
+static
+void
+swapinline(struct sfs_inode *sfi)
+{
+	uint32_t *data = (uint32_t *)((struct sfs_inlineinode *)sfi)->sfn_data;
+	int i;
+
+	for (i=0; i<SFS_INLINED_BYTES/4; i++) {
+		data[i] = SWAPL(data[i]);
+	}
+}
+
+static
+void
+readinode(struct sfs_inode *sfi, uint32_t ino)
+{
+	diskread(sfi, ino);
+	swapinode(sfi);
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		swapinline(sfi);
+	}
+}
+
+static
+void
+writeinode(struct sfs_inode *sfi, uint32_t ino)
+{
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		swapinline(sfi);
+	}
+	swapinode(sfi);
+	diskwrite(sfi, ino);
 }
 
 static
@@ -145,6 +231,22 @@ swapindir(uint32_t *entries)
 	}
 }
 
+static
+void
+swapextblock(struct sfs_extblock *eb)
+{
+	int i;
+
+	eb->sfeb_next = SWAPL(eb->sfeb_next);
+	eb->sfeb_nextents = SWAPL(eb->sfeb_nextents);
+	for (i=0; i<SFS_NBEXTENTS; i++) {
+		struct sfs_extent *e = &eb->sfeb_extents[i];
+		e->sfe_fileblock = SWAPL(e->sfe_fileblock);
+		e->sfe_diskblock = SWAPL(e->sfe_diskblock);
+		e->sfe_len = SWAPL(e->sfe_len);
+	}
+}
+
 static
 void
 swapbits(uint8_t *bits)
@@ -172,6 +274,7 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block used by the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -181,10 +284,24 @@ typedef enum {
 } blockusage_t;
 
 static uint32_t nblocks, bitblocks;
+static uint32_t journalstart, journalblocks;
 static uint32_t uniquecounter = 1;
 
 static unsigned long count_blocks=0, count_dirs=0, count_files=0;
 
+/* Number for making up a name (FSCK.ino.n) for an entry */
+static
+unsigned long
+nextunique(void)
+{
+	unsigned long n;
+
+	fsck_lock();
+	n = uniquecounter++;
+	fsck_unlock();
+	return n;
+}
+
 ////////////////////////////////////////////////////////////
 
 static uint8_t *bitmapdata;
@@ -210,6 +327,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -239,16 +357,21 @@ bitmap_mark(uint32_t block, blockusage_t how, uint32_t howdesc)
 	unsigned index = block/8;
 	uint8_t mask = ((uint8_t)1)<<(block%8);
 
+	fsck_lock();
+
 	if (how == B_TOFREE) {
 		if (tofreedata[index] & mask) {
 			/* already marked to free once, ignore */
+			fsck_unlock();
 			return;
 		}
 		if (bitmapdata[index] & mask) {
 			/* block is used elsewhere, ignore */
+			fsck_unlock();
 			return;
 		}
 		tofreedata[index] |= mask;
+		fsck_unlock();
 		return;
 	}
 
@@ -260,7 +383,10 @@ bitmap_mark(uint32_t block, blockusage_t how, uint32_t howdesc)
 	if (bitmapdata[index] & mask) {
 		warnx("Block %lu (used as %s) already in use! (NOT FIXED)",
 		      (unsigned long) block, blockusagestr(how, howdesc));
-		setbadness(EXIT_UNRECOV);
+		/* (not setbadness, as we hold the lock already) */
+		if (badness < EXIT_UNRECOV) {
+			badness = EXIT_UNRECOV;
+		}
 	}
 
 	bitmapdata[index] |= mask;
@@ -268,6 +394,8 @@ bitmap_mark(uint32_t block, blockusage_t how, uint32_t howdesc)
 	if (how != B_PASTEND) {
 		count_blocks++;
 	}
+
+	fsck_unlock();
 }
 
 static
@@ -373,60 +501,46 @@ check_bitmap(void)
 
 ////////////////////////////////////////////////////////////
 
-struct inodememory {
-	uint32_t ino;
-	uint32_t linkcount;	/* files only; 0 for dirs */
-};
+/*
+ * What we've found out about each inode, indexed by block number:
+ * 0 if nothing links to it, INODE_DIR for a directory, or else the
+ * number of links found to a file.
+ */
+#define INODE_DIR 0xffffffff
 
-static struct inodememory *inodes = NULL;
-static int ninodes=0, maxinodes=0;
+static uint32_t *inodes;
 
 static
 void
-addmemory(uint32_t ino, uint32_t linkcount)
+inodes_init(uint32_t nblocks)
 {
-	assert(ninodes <= maxinodes);
-	if (ninodes == maxinodes) {
-		int newmax = (maxinodes+1)*2;
-#ifdef NO_REALLOC
-		void *p = domalloc(newmax * sizeof(*inodes));
-		if (inodes) {
-			memcpy(p, inodes, ninodes);
-			free(inodes);
-		}
-		inodes = p;
-#else
-		inodes = realloc(inodes, newmax * sizeof(*inodes));
-		if (inodes==NULL) {
-			errx(EXIT_FATAL, "Out of memory");
-		}
-#endif
-		maxinodes = newmax;
+	uint32_t i;
+
+	inodes = domalloc(nblocks * sizeof(uint32_t));
+	for (i=0; i<nblocks; i++) {
+		inodes[i] = 0;
 	}
-	inodes[ninodes].ino = ino;
-	inodes[ninodes].linkcount = linkcount;
-	ninodes++;
 }
 
-/* returns nonzero if directory already remembered */
+/*
+ * Claim directory INO for checking; returns nonzero if it was already
+ * claimed (it's crosslinked).
+ */
 static
 int
-remember_dir(uint32_t ino, const char *pathsofar)
+remember_dir(uint32_t ino)
 {
-	int i;
-
-	/* don't use this for now */
-	(void)pathsofar;
-
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount==0);
-			return 1;
-		}
+	fsck_lock();
+	if (inodes[ino] != 0) {
+		assert(inodes[ino] == INODE_DIR);
+		fsck_unlock();
+		return 1;
 	}
+	inodes[ino] = INODE_DIR;
+	count_dirs++;
+	fsck_unlock();
 
-	addmemory(ino, 0);
-
+	bitmap_mark(ino, B_INODE, ino);
 	return 0;
 }
 
@@ -434,44 +548,16 @@ static
 void
 observe_filelink(uint32_t ino)
 {
-	int i;
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount>0);
-			inodes[i].linkcount++;
-			return;
-		}
-	}
-	bitmap_mark(ino, B_INODE, ino);
-	addmemory(ino, 1);
-}
+	int first;
 
-static
-void
-adjust_filelinks(void)
-{
-	struct sfs_inode sfi;
-	int i;
+	fsck_lock();
+	assert(inodes[ino] != INODE_DIR);
+	first = (inodes[ino] == 0);
+	inodes[ino]++;
+	fsck_unlock();
 
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].linkcount==0) {
-			/* directory */
-			continue;
-		}
-		diskread(&sfi, inodes[i].ino);
-		swapinode(&sfi);
-		assert(sfi.sfi_type == SFS_TYPE_FILE);
-		if (sfi.sfi_linkcount != inodes[i].linkcount) {
-			warnx("File %lu link count %lu should be %lu (fixed)",
-			      (unsigned long) inodes[i].ino,
-			      (unsigned long) sfi.sfi_linkcount,
-			      (unsigned long) inodes[i].linkcount);
-			sfi.sfi_linkcount = inodes[i].linkcount;
-			setbadness(EXIT_RECOV);
-			swapinode(&sfi);
-			diskwrite(&sfi, inodes[i].ino);
-		}
-		count_files++;
+	if (first) {
+		bitmap_mark(ino, B_INODE, ino);
 	}
 }
 
@@ -531,6 +617,7 @@ check_sb(void)
 	assert(bitblocks>0);
 
 	bitmap_init(bitblocks);
+	inodes_init(nblocks);
 	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS; i++) {
 		bitmap_mark(i, B_PASTEND, 0);
 	}
@@ -546,6 +633,20 @@ check_sb(void)
 		schanged = 1;
 	}
 
+	if (sp.sp_journalblocks > 0 &&
+	    (sp.sp_journalstart < SFS_MAP_LOCATION + bitblocks ||
+	     sp.sp_journalblocks < SFS_JOURNAL_MINBLOCKS ||
+	     sp.sp_journalstart + sp.sp_journalblocks > nblocks ||
+	     sp.sp_journalstart + sp.sp_journalblocks < sp.sp_journalstart)) {
+		warnx("Journal location invalid (journal removed)");
+		setbadness(EXIT_RECOV);
+		sp.sp_journalstart = 0;
+		sp.sp_journalblocks = 0;
+		schanged = 1;
+	}
+	journalstart = sp.sp_journalstart;
+	journalblocks = sp.sp_journalblocks;
+
 	if (schanged) {
 		swapsb(&sp);
 		diskwrite(&sp, SFS_SB_LOCATION);
@@ -555,6 +656,111 @@ check_sb(void)
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+	for (i=0; i<journalblocks; i++) {
+		bitmap_mark(journalstart+i, B_JOURNAL, i);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Check if a journal descriptor is sane: the right number of blocks,
+ * none of them going anywhere the kernel would never log.
+ */
+static
+int
+journal_descok(const struct sfs_jblock *jb)
+{
+	uint32_t i, home;
+
+	if (jb->sj_count == 0 || jb->sj_count > SFS_JDESCBLOCKS) {
+		return 0;
+	}
+	for (i=0; i<jb->sj_count; i++) {
+		home = jb->sj_blocks[i];
+		if (home >= nblocks || home == SFS_SB_LOCATION ||
+		    (home >= journalstart &&
+		     home < journalstart + journalblocks)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * If the journal holds a committed transaction, finish it by copying
+ * its blocks home, as the kernel would at mount time. This has to
+ * happen before anything else is checked. Either way, empty the log.
+ */
+static
+void
+replay_journal(void)
+{
+	struct sfs_jblock jb, desc;
+	char data[SFS_BLOCKSIZE];
+	uint32_t seq, pos, total, i;
+	int committed = 0;
+
+	if (journalblocks == 0) {
+		return;
+	}
+
+	diskread(&jb, journalstart);
+	swapjblock(&jb);
+	if (jb.sj_magic != SFS_JMAGIC || jb.sj_type != SFS_JTYPE_HEADER) {
+		warnx("Journal header invalid (fixed)");
+		setbadness(EXIT_RECOV);
+		seq = 0;
+	}
+	else {
+		seq = jb.sj_seq;
+
+		/* Find out if the transaction got as far as committing */
+		total = 0;
+		for (pos = 1; pos < journalblocks; pos += 1 + jb.sj_count) {
+			diskread(&jb, journalstart+pos);
+			swapjblock(&jb);
+			if (jb.sj_magic != SFS_JMAGIC || jb.sj_seq != seq) {
+				break;
+			}
+			if (jb.sj_type == SFS_JTYPE_COMMIT) {
+				committed = (jb.sj_count == total && total > 0);
+				break;
+			}
+			if (jb.sj_type != SFS_JTYPE_DESC ||
+			    !journal_descok(&jb) ||
+			    pos + 1 + jb.sj_count >= journalblocks) {
+				break;
+			}
+			total += jb.sj_count;
+		}
+
+		/* If so, copy the blocks home */
+		for (pos = 1; committed; pos += 1 + desc.sj_count) {
+			diskread(&desc, journalstart+pos);
+			swapjblock(&desc);
+			if (desc.sj_type == SFS_JTYPE_COMMIT) {
+				break;
+			}
+			for (i=0; i<desc.sj_count; i++) {
+				diskread(data, journalstart+pos+1+i);
+				diskwrite(data, desc.sj_blocks[i]);
+			}
+		}
+		if (committed) {
+			warnx("Replayed %lu blocks from the journal (fixed)",
+			      (unsigned long) total);
+			setbadness(EXIT_RECOV);
+		}
+	}
+
+	/* Empty the log */
+	bzero(&jb, sizeof(jb));
+	jb.sj_magic = SFS_JMAGIC;
+	jb.sj_type = SFS_JTYPE_HEADER;
+	jb.sj_seq = seq + 1;
+	swapjblock(&jb);
+	diskwrite(&jb, journalstart);
 }
 
 ////////////////////////////////////////////////////////////
@@ -566,19 +772,21 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     int isdir, int indirection)
 {
 	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
+	uint32_t i, ct, span;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/* Nothing below here; just skip over the blocks it covers */
+		for (i=0, span=1; i<(uint32_t)indirection; i++) {
+			span *= SFS_DBPERIDB;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -704,6 +912,196 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 	return 0;
 }
 
+/*
+ * Check the extents in one list (the inode's, or an extent block's).
+ * Each must be inside the volume and start after the one before it;
+ * bad ones are dropped, and blocks past EOF are freed. *NEXTFBP is the
+ * first file block the next extent may use. Returns nonzero if the
+ * list was changed.
+ */
+static
+int
+check_extents(uint32_t ino, struct sfs_extent *ext, uint32_t *countp,
+	      uint32_t max, uint32_t fileblocks, uint32_t *nextfbp,
+	      uint32_t *badcountp)
+{
+	struct sfs_extent *e;
+	uint32_t i, b, keep, len;
+	int changed = 0;
+
+	if (*countp > max) {
+		warnx("Inode %lu: %lu extents in a list that holds %lu "
+		      "(fixed)", (unsigned long) ino,
+		      (unsigned long) *countp, (unsigned long) max);
+		setbadness(EXIT_RECOV);
+		*countp = max;
+		changed = 1;
+	}
+
+	keep = 0;
+	for (i=0; i<*countp; i++) {
+		e = &ext[i];
+		if (e->sfe_len == 0 || e->sfe_diskblock == 0 ||
+		    e->sfe_diskblock >= nblocks ||
+		    e->sfe_len > nblocks - e->sfe_diskblock ||
+		    e->sfe_fileblock < *nextfbp ||
+		    e->sfe_fileblock + e->sfe_len < e->sfe_fileblock) {
+			warnx("Inode %lu: Bad extent of %lu blocks at %lu "
+			      "for file block %lu (removed)",
+			      (unsigned long) ino,
+			      (unsigned long) e->sfe_len,
+			      (unsigned long) e->sfe_diskblock,
+			      (unsigned long) e->sfe_fileblock);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+			continue;
+		}
+
+		len = e->sfe_len;
+		if (e->sfe_fileblock >= fileblocks) {
+			len = 0;
+		}
+		else if (len > fileblocks - e->sfe_fileblock) {
+			len = fileblocks - e->sfe_fileblock;
+		}
+		for (b=0; b<e->sfe_len; b++) {
+			bitmap_mark(e->sfe_diskblock + b,
+				    b < len ? B_DATA : B_TOFREE,
+				    b < len ? ino : 0);
+		}
+		if (len < e->sfe_len) {
+			*badcountp += e->sfe_len - len;
+			e->sfe_len = len;
+			changed = 1;
+		}
+		if (len == 0) {
+			continue;
+		}
+
+		*nextfbp = e->sfe_fileblock + e->sfe_len;
+		ext[keep++] = *e;
+	}
+
+	for (i=keep; i<*countp; i++) {
+		bzero(&ext[i], sizeof(ext[i]));
+	}
+	*countp = keep;
+
+	return changed;
+}
+
+/*
+ * Check that BLOCK is fit to be the next extent block of inode INO.
+ */
+static
+int
+check_extblock_ptr(uint32_t ino, uint32_t block)
+{
+	int used = 0;
+
+	if (block < nblocks) {
+		fsck_lock();
+		used = bitmapdata[block/8] & (1 << (block%8));
+		fsck_unlock();
+	}
+	if (block >= nblocks || block < SFS_MAP_LOCATION + bitblocks ||
+	    used) {
+		warnx("Inode %lu: Bad extent block %lu (list cut off)",
+		      (unsigned long) ino, (unsigned long) block);
+		setbadness(EXIT_RECOV);
+		return 1;
+	}
+	return 0;
+}
+
+/* returns nonzero if inode modified */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_inode *sfi)
+{
+	struct sfs_extinode *sfx = (struct sfs_extinode *)sfi;
+	struct sfs_extblock eb;
+	uint32_t fileblocks, nextfb, badcount, block, next;
+	int ichanged, changed;
+
+	assert(sizeof(*sfx) == sizeof(*sfi));
+	assert(sizeof(eb) == SFS_BLOCKSIZE);
+
+	fileblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+	if (sfi->sfi_size % SFS_BLOCKSIZE != 0) {
+		fileblocks++;
+	}
+	nextfb = 0;
+	badcount = 0;
+
+	ichanged = check_extents(ino, sfx->sfx_extents, &sfx->sfx_nextents,
+				 SFS_NIEXTENTS, fileblocks, &nextfb, &badcount);
+
+	block = sfx->sfx_overflow;
+	if (block != 0 && check_extblock_ptr(ino, block)) {
+		sfx->sfx_overflow = block = 0;
+		ichanged = 1;
+	}
+	while (block != 0) {
+		diskread(&eb, block);
+		swapextblock(&eb);
+		bitmap_mark(block, B_IBLOCK, ino);
+
+		changed = check_extents(ino, eb.sfeb_extents,
+					&eb.sfeb_nextents, SFS_NBEXTENTS,
+					fileblocks, &nextfb, &badcount);
+		next = eb.sfeb_next;
+		if (next != 0 && check_extblock_ptr(ino, next)) {
+			eb.sfeb_next = next = 0;
+			changed = 1;
+		}
+		if (changed) {
+			swapextblock(&eb);
+			diskwrite(&eb, block);
+		}
+		block = next;
+	}
+
+	if (badcount > 0) {
+		warnx("Inode %lu: %lu blocks after EOF (freed)", 
+		     (unsigned long) ino, (unsigned long) badcount);
+		setbadness(EXIT_RECOV);
+	}
+
+	return ichanged;
+}
+
+/*
+ * Check an inode whose contents are stored inline. There are no
+ * blocks to account for; the contents have to fit, and no other way
+ * of mapping blocks can be in use.
+ */
+/* returns nonzero if inode modified */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_inode *sfi)
+{
+	int changed = 0;
+
+	if (sfi->sfi_flags & (SFS_IFLAG_EXTENTS|SFS_IFLAG_HASHDIR)) {
+		warnx("Inode %lu: Inline inode has other mapping flags "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~(SFS_IFLAG_EXTENTS|SFS_IFLAG_HASHDIR);
+		changed = 1;
+	}
+
+	if (sfi->sfi_size > SFS_INLINED_BYTES) {
+		warnx("Inode %lu: Inline size %lu too large (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = SFS_INLINED_BYTES;
+		changed = 1;
+	}
+
+	return changed;
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -812,6 +1210,15 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		memcpy(d, ((struct sfs_inlineinode *)sfi)->sfn_data,
+		       nd * sizeof(struct sfs_dir));
+		for (i=0; i<nd; i++) {
+			swapdir(&d[i]);
+		}
+		return;
+	}
+
 	for (i=0; i<nblocks; i++) {
 		uint32_t block = dobmap(sfi, i);
 		if (block!=0) {
@@ -827,14 +1234,24 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 	}
 }
 
+/* returns nonzero if inode modified (the entries are inline) */
 static
-void
-dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
+int
+dirwrite(struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 {
 	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j, bad;
 
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		for (i=0; i<(unsigned)nd; i++) {
+			swapdir(&d[i]);
+		}
+		memcpy(((struct sfs_inlineinode *)sfi)->sfn_data, d,
+		       nd * sizeof(struct sfs_dir));
+		return 1;
+	}
+
 	for (i=0; i<nblocks; i++) {
 		uint32_t block = dobmap(sfi, i);
 		if (block!=0) {
@@ -857,26 +1274,25 @@ dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 			}
 		}
 	}
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
 
-static struct sfs_dir *global_sortdirs;
 static
 int
 dirsortfunc(const void *aa, const void *bb)
 {
-	const int *a = (const int *)aa;
-	const int *b = (const int *)bb;
-	const struct sfs_dir *ad = &global_sortdirs[*a];
-	const struct sfs_dir *bd = &global_sortdirs[*b];
+	const struct sfs_dir *ad = *(struct sfs_dir *const *)aa;
+	const struct sfs_dir *bd = *(struct sfs_dir *const *)bb;
 	return strcmp(ad->sfd_name, bd->sfd_name);
 }
 
 #ifdef NO_QSORT
 static
 void
-qsort(int *data, int num, size_t size, int (*f)(const void *, const void *))
+qsort(struct sfs_dir **data, int num, size_t size,
+      int (*f)(const void *, const void *))
 {
 	int i, j;
 	(void)size;
@@ -885,7 +1301,7 @@ qsort(int *data, int num, size_t size, int (*f)(const void *, const void *))
 	for (i=0; i<num-1; i++) {
 		for (j=i+1; j<num; j++) {
 			if (f(&data[i], &data[j]) < 0) {
-				int tmp = data[i];
+				struct sfs_dir *tmp = data[i];
 				data[i] = data[j];
 				data[j] = tmp;
 			}
@@ -894,12 +1310,17 @@ qsort(int *data, int num, size_t size, int (*f)(const void *, const void *))
 }
 #endif
 
+/* Fill VECTOR with pointers to the entries of D in name order */
 static
 void
-sortdir(int *vector, struct sfs_dir *d, int nd)
+sortdir(struct sfs_dir **vector, struct sfs_dir *d, int nd)
 {
-	global_sortdirs = d;
-	qsort(vector, nd, sizeof(int), dirsortfunc);
+	int i;
+
+	for (i=0; i<nd; i++) {
+		vector[i] = &d[i];
+	}
+	qsort(vector, nd, sizeof(struct sfs_dir *), dirsortfunc);
 }
 
 /* tries to add a directory entry; returns 0 on success */
@@ -939,7 +1360,7 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 			snprintf(sfd->sfd_name, sizeof(sfd->sfd_name),
 				 "FSCK.%lu.%lu",
 				 (unsigned long) sfd->sfd_ino,
-				 (unsigned long) uniquecounter++);
+				 (unsigned long) nextunique());
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s entry %lu has file but "
 			      "no name (fixed: %s)",
@@ -967,26 +1388,96 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Files are checked by inode number, without a path; PATHSOFAR is
+ * then NULL.
+ */
+/* returns nonzero if inode modified */
 static
 int
-check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
+check_inode_flags(const char *pathsofar, uint32_t ino,
+		  struct sfs_inode *sfi, uint32_t allowed)
 {
-	struct sfs_inode sfi;
-	struct sfs_dir *direntries;
-	int *sortvector;
-	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
-	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
+	if (sfi->sfi_flags & ~allowed) {
+		setbadness(EXIT_RECOV);
+		if (pathsofar != NULL) {
+			warnx("Object /%s: Unknown inode flags 0x%lx "
+			      "(cleared)", pathsofar,
+			      (unsigned long) (sfi->sfi_flags & ~allowed));
+		}
+		else {
+			warnx("File %lu: Unknown inode flags 0x%lx (cleared)",
+			      (unsigned long) ino,
+			      (unsigned long) (sfi->sfi_flags & ~allowed));
+		}
+		sfi->sfi_flags &= allowed;
+		return 1;
+	}
+	return 0;
+}
 
-	diskread(&sfi, ino);
-	swapinode(&sfi);
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+	int i;
+
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h = SFS_DIRHASH_STEP(h, name[i]);
+	}
+	return h;
+}
+
+/*
+ * Check that every entry of a hashed directory is in one of the
+ * blocks its name hashes to. Returns nonzero if not.
+ */
+static
+int
+check_dir_hashing(struct sfs_dir *d, uint32_t nd)
+{
+	const uint32_t atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	uint32_t nblocks, i, home, dist;
 
-	if (remember_dir(ino, pathsofar)) {
-		/* crosslinked dir */
+	if (nd == 0 || nd % atonce != 0) {
 		return 1;
 	}
+	nblocks = nd / atonce;
 
-	bitmap_mark(ino, B_INODE, ino);
-	count_dirs++;
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		home = dirhash(d[i].sfd_name) % nblocks;
+		dist = (i/atonce + nblocks - home) % nblocks;
+		if (dist >= SFS_DIRHASH_PROBE) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+static void dirjob_add(uint32_t ino, uint32_t parentino, const char *path);
+
+/*
+ * Check one directory, which the caller has claimed with remember_dir.
+ * Files in it are only counted here; their contents are checked in
+ * the inode pass. Subdirectories are claimed here and queued to be
+ * checked later, possibly by another thread.
+ */
+static
+void
+check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
+{
+	struct sfs_inode sfi;
+	struct sfs_dir *direntries, **sortvector;
+	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
+	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
+
+	readinode(&sfi, ino);
 
 	if (sfi.sfi_size % sizeof(struct sfs_dir) != 0) {
 		setbadness(EXIT_RECOV);
@@ -997,16 +1488,28 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
-	if (check_inode_blocks(ino, &sfi, 1)) {
+	if (check_inode_flags(pathsofar, ino, &sfi,
+			      SFS_IFLAG_HASHDIR|SFS_IFLAG_INLINE)) {
+		ichanged = 1;
+	}
+
+	if ((sfi.sfi_flags & SFS_IFLAG_INLINE) ?
+	    check_inode_inline(ino, &sfi) :
+	    check_inode_blocks(ino, &sfi, 1)) {
 		ichanged = 1;
 	}
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
-	maxdirentries = SFS_ROUNDUP(ndirentries, 
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+	if (sfi.sfi_flags & SFS_IFLAG_INLINE) {
+		maxdirentries = SFS_INLINED_BYTES/sizeof(struct sfs_dir);
+	}
+	else {
+		maxdirentries = SFS_ROUNDUP(ndirentries, 
+				SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+	}
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
-	sortvector = domalloc(ndirentries * sizeof(int));
+	sortvector = domalloc(ndirentries * sizeof(struct sfs_dir *));
 
 	dirread(&sfi, direntries, ndirentries);
 	for (i=ndirentries; i<maxdirentries; i++) {
@@ -1018,15 +1521,14 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		if (check_dir_entry(pathsofar, i, &direntries[i])) {
 			dchanged = 1;
 		}
-		sortvector[i] = i;
 	}
 
 	sortdir(sortvector, direntries, ndirentries);
 
 	/* don't use ndirentries-1 here in case ndirentries == 0 */
 	for (i=0; i+1<ndirentries; i++) {
-		struct sfs_dir *d1 = &direntries[sortvector[i]];
-		struct sfs_dir *d2 = &direntries[sortvector[i+1]];
+		struct sfs_dir *d1 = sortvector[i];
+		struct sfs_dir *d2 = sortvector[i+1];
 		assert(d1 != d2);
 
 		if (d1->sfd_ino == SFS_NOINO) {
@@ -1046,7 +1548,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 				snprintf(d1->sfd_name, sizeof(d1->sfd_name),
 					 "FSCK.%lu.%lu",
 					 (unsigned long) d1->sfd_ino,
-					 (unsigned long) uniquecounter++);
+					 (unsigned long) nextunique());
 				setbadness(EXIT_RECOV);
 				warnx("Directory /%s: Duplicate names %s "
 				      "(one renamed: %s)",
@@ -1142,26 +1644,24 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		else {
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
 			struct sfs_inode subsfi;
+			uint32_t subino = direntries[i].sfd_ino;
 
-			diskread(&subsfi, direntries[i].sfd_ino);
-			swapinode(&subsfi);
 			snprintf(path, sizeof(path), "%s/%s", 
 				 pathsofar, direntries[i].sfd_name);
 
+			if (subino >= nblocks) {
+				subsfi.sfi_type = SFS_TYPE_INVAL;
+			}
+			else {
+				readinode(&subsfi, subino);
+			}
+
 			switch (subsfi.sfi_type) {
 			    case SFS_TYPE_FILE:
-				if (check_inode_blocks(direntries[i].sfd_ino,
-						       &subsfi, 0)) {
-					swapinode(&subsfi);
-					diskwrite(&subsfi, 
-						  direntries[i].sfd_ino);
-				}
-				observe_filelink(direntries[i].sfd_ino);
+				observe_filelink(subino);
 				break;
 			    case SFS_TYPE_DIR:
-				if (check_dir(direntries[i].sfd_ino,
-					      ino,
-					      path)) {
+				if (remember_dir(subino)) {
 					setbadness(EXIT_RECOV);
 					warnx("Directory /%s: Crosslink to "
 					      "other directory (removed)",
@@ -1171,6 +1671,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 					dchanged = 1;
 				}
 				else {
+					dirjob_add(subino, ino, path);
 					subdircount++;
 				}
 				break;
@@ -1195,29 +1696,152 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * Anything we fixed above may have put an entry where its hash
+	 * doesn't lead; if so, just turn the hashing off. The kernel
+	 * rebuilds the index when the directory next fills up.
+	 */
+	if ((sfi.sfi_flags & SFS_IFLAG_HASHDIR) &&
+	    check_dir_hashing(direntries, ndirentries)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Bad hash index (removed)", pathsofar);
+		sfi.sfi_flags &= ~SFS_IFLAG_HASHDIR;
+		ichanged = 1;
+	}
+
 	if (dchanged) {
-		dirwrite(&sfi, direntries, ndirentries);
+		if (dirwrite(&sfi, direntries, ndirentries)) {
+			ichanged = 1;
+		}
 	}
 
 	if (ichanged) {
-		swapinode(&sfi);
-		diskwrite(&sfi, ino);
+		writeinode(&sfi, ino);
 	}
 
 	free(direntries);
 	free(sortvector);
+}
 
-	return 0;
+
+////////////////////////////////////////////////////////////
+//
+// Directory pass
+
+/*
+ * Directories waiting to be checked. Each one found is claimed and
+ * put here; the workers take them off and check them, in no
+ * particular order, until there are none left and none being checked
+ * (which could find more).
+ */
+struct dirjob {
+	uint32_t ino;
+	uint32_t parentino;
+	char *path;
+	struct dirjob *next;
+};
+
+static struct dirjob *dirjobs;
+static unsigned dirjobs_busy;
+
+#ifdef USE_THREADS
+static pthread_mutex_t dirjobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dirjobs_cv = PTHREAD_COND_INITIALIZER;
+#endif
+
+static unsigned nworkers;	/* 0 to pick a number */
+
+static
+void
+dirjob_add(uint32_t ino, uint32_t parentino, const char *path)
+{
+	struct dirjob *job;
+
+	job = domalloc(sizeof(*job));
+	job->ino = ino;
+	job->parentino = parentino;
+	job->path = domalloc(strlen(path)+1);
+	strcpy(job->path, path);
+
+#ifdef USE_THREADS
+	pthread_mutex_lock(&dirjobs_lock);
+#endif
+	job->next = dirjobs;
+	dirjobs = job;
+#ifdef USE_THREADS
+	pthread_cond_signal(&dirjobs_cv);
+	pthread_mutex_unlock(&dirjobs_lock);
+#endif
 }
 
+/*
+ * Take the next directory to check, or return NULL once they're all
+ * done.
+ */
+static
+struct dirjob *
+dirjob_get(struct dirjob *done)
+{
+	struct dirjob *job;
+
+#ifdef USE_THREADS
+	pthread_mutex_lock(&dirjobs_lock);
+#endif
+	if (done != NULL) {
+		dirjobs_busy--;
+		free(done->path);
+		free(done);
+	}
+#ifdef USE_THREADS
+	while (dirjobs == NULL && dirjobs_busy > 0) {
+		pthread_cond_wait(&dirjobs_cv, &dirjobs_lock);
+	}
+#endif
+	job = dirjobs;
+	if (job != NULL) {
+		dirjobs = job->next;
+		dirjobs_busy++;
+	}
+#ifdef USE_THREADS
+	else {
+		/* All done; let the other workers see it too */
+		pthread_cond_broadcast(&dirjobs_cv);
+	}
+	pthread_mutex_unlock(&dirjobs_lock);
+#endif
+	return job;
+}
 
+static
+void *
+dirworker(void *arg)
+{
+	struct dirjob *job = NULL;
+
+	(void)arg;
+	while ((job = dirjob_get(job)) != NULL) {
+		check_dir(job->ino, job->parentino, job->path);
+	}
+	return NULL;
+}
+
+/*
+ * Check the directory tree, starting from the root. Separate subtrees
+ * are independent, so on the host they're checked by NWORKERS
+ * threads at once.
+ */
 static
 void
-check_root_dir(void)
+check_dirs(void)
 {
 	struct sfs_inode sfi;
-	diskread(&sfi, SFS_ROOT_LOCATION);
-	swapinode(&sfi);
+#ifdef USE_THREADS
+	pthread_t threads[nworkers];
+	unsigned i;
+	int result;
+#endif
+
+	readinode(&sfi, SFS_ROOT_LOCATION);
 
 	switch (sfi.sfi_type) {
 	    case SFS_TYPE_DIR:
@@ -1231,37 +1855,191 @@ check_root_dir(void)
 	    fix:
 		setbadness(EXIT_RECOV);
 		sfi.sfi_type = SFS_TYPE_DIR;
-		swapinode(&sfi);
-		diskwrite(&sfi, SFS_ROOT_LOCATION);
+		writeinode(&sfi, SFS_ROOT_LOCATION);
 		break;
 	}
 
-	check_dir(SFS_ROOT_LOCATION, SFS_ROOT_LOCATION, "");
+	remember_dir(SFS_ROOT_LOCATION);
+	dirjob_add(SFS_ROOT_LOCATION, SFS_ROOT_LOCATION, "");
+
+#ifdef USE_THREADS
+	for (i=1; i<nworkers; i++) {
+		result = pthread_create(&threads[i], NULL, dirworker, NULL);
+		if (result) {
+			errx(EXIT_FATAL, "pthread_create: %s",
+			     strerror(result));
+		}
+	}
+	dirworker(NULL);
+	for (i=1; i<nworkers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+#else
+	dirworker(NULL);
+#endif
+	assert(dirjobs == NULL && dirjobs_busy == 0);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Inode pass
+
+/*
+ * Check every file the directory pass found, in disk order: its
+ * block map, which accounts for its blocks in the bitmap, and its
+ * link count. Each is checked once no matter how many names it has.
+ */
+static
+void
+check_files(void)
+{
+	struct sfs_inode sfi;
+	uint32_t ino;
+	int ichanged;
+
+	for (ino=0; ino<nblocks; ino++) {
+		if (inodes[ino] == 0 || inodes[ino] == INODE_DIR) {
+			continue;
+		}
+		readinode(&sfi, ino);
+		assert(sfi.sfi_type == SFS_TYPE_FILE);
+
+		ichanged = check_inode_flags(NULL, ino, &sfi,
+					     SFS_IFLAG_EXTENTS |
+					     SFS_IFLAG_INLINE);
+		if ((sfi.sfi_flags & SFS_IFLAG_INLINE) ?
+		    check_inode_inline(ino, &sfi) :
+		    (sfi.sfi_flags & SFS_IFLAG_EXTENTS) ?
+		    check_inode_extents(ino, &sfi) :
+		    check_inode_blocks(ino, &sfi, 0)) {
+			ichanged = 1;
+		}
+
+		if (sfi.sfi_linkcount != inodes[ino]) {
+			warnx("File %lu link count %lu should be %lu (fixed)",
+			      (unsigned long) ino,
+			      (unsigned long) sfi.sfi_linkcount,
+			      (unsigned long) inodes[ino]);
+			sfi.sfi_linkcount = inodes[ino];
+			setbadness(EXIT_RECOV);
+			ichanged = 1;
+		}
+
+		if (ichanged) {
+			writeinode(&sfi, ino);
+		}
+		count_files++;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timing
+
+static int showtimes;
+static time_t pass_secs;
+static unsigned long pass_nsecs;
+
+static
+void
+pass_start(void)
+{
+	__time(&pass_secs, &pass_nsecs);
+}
+
+static
+void
+pass_end(const char *name)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (!showtimes) {
+		return;
+	}
+	__time(&secs, &nsecs);
+	if (nsecs < pass_nsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	secs -= pass_secs;
+	nsecs -= pass_nsecs;
+	warnx("%s: %lu.%03lu seconds", name, (unsigned long) secs,
+	      nsecs / 1000000);
 }
 
 ////////////////////////////////////////////////////////////
 
+static
+void
+usage(void)
+{
+	errx(EXIT_USAGE, "Usage: sfsck [-t] [-j threads] device/diskfile");
+}
+
 int
 main(int argc, char **argv)
 {
+	const char *device = NULL;
+	int i;
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
-	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-t")) {
+			showtimes = 1;
+		}
+		else if (!strcmp(argv[i], "-j") && i+1 < argc) {
+			nworkers = atoi(argv[++i]);
+			if (nworkers < 1) {
+				usage();
+			}
+		}
+		else if (argv[i][0] == '-' || device != NULL) {
+			usage();
+		}
+		else {
+			device = argv[i];
+		}
+	}
+	if (device == NULL) {
+		usage();
+	}
+
+	if (nworkers == 0) {
+#ifdef USE_THREADS
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nworkers = ncpu > 8 ? 8 : ncpu > 1 ? ncpu : 1;
+#else
+		nworkers = 1;
+#endif
 	}
 
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jblock)==SFS_BLOCKSIZE);
 
-	opendisk(argv[1]);
+	opendisk(device);
 
+	pass_start();
 	check_sb();
-	check_root_dir();
+	replay_journal();
+	pass_end("Superblock and journal");
+
+	pass_start();
+	check_dirs();
+	pass_end("Directory pass");
+
+	pass_start();
+	check_files();
+	pass_end("Inode pass");
+
+	pass_start();
 	check_bitmap();
-	adjust_filelinks();
+	pass_end("Bitmap pass");
 
 	closedisk();
 